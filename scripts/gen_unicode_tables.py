@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""Writes src/unicode_tables.c: code point ranges for every assigned Unicode
+general category, from the Unicode database bundled with Python."""
+
+import sys
+import unicodedata
+
+MAX_CODE_POINT = 0x10FFFF
+
+LONG_NAMES = {
+    "Lu": "Uppercase_Letter", "Ll": "Lowercase_Letter", "Lt": "Titlecase_Letter",
+    "Lm": "Modifier_Letter", "Lo": "Other_Letter", "Mn": "Nonspacing_Mark",
+    "Mc": "Spacing_Mark", "Me": "Enclosing_Mark", "Nd": "Decimal_Number",
+    "Nl": "Letter_Number", "No": "Other_Number", "Pc": "Connector_Punctuation",
+    "Pd": "Dash_Punctuation", "Ps": "Open_Punctuation", "Pe": "Close_Punctuation",
+    "Pi": "Initial_Punctuation", "Pf": "Final_Punctuation", "Po": "Other_Punctuation",
+    "Sm": "Math_Symbol", "Sc": "Currency_Symbol", "Sk": "Modifier_Symbol",
+    "So": "Other_Symbol", "Zs": "Space_Separator", "Zl": "Line_Separator",
+    "Zp": "Paragraph_Separator", "Cc": "Control", "Cf": "Format", "Cs": "Surrogate",
+    "Co": "Private_Use",
+}
+
+
+def main():
+    ranges = {name: [] for name in LONG_NAMES}
+    for cp in range(MAX_CODE_POINT + 1):
+        category = unicodedata.category(chr(cp))
+        if category == "Cn":
+            continue
+        table = ranges[category]
+        if table and table[-1][1] == cp - 1:
+            table[-1][1] = cp
+        else:
+            table.append([cp, cp])
+
+    out = sys.stdout
+    out.write("// Generated by scripts/gen_unicode_tables.py from Unicode %s; do not edit.\n"
+              % unicodedata.unidata_version)
+    out.write('#include "utf8.h"\n\n')
+    for name, table in ranges.items():
+        out.write("static const code_point_range_t sCategory%s[] = {\n" % name)
+        for i in range(0, len(table), 4):
+            row = ", ".join("{0x%X, 0x%X}" % (a, b) for a, b in table[i:i + 4])
+            out.write("    %s,\n" % row)
+        out.write("};\n\n")
+    out.write("const unicode_category_t kUnicodeCategories[] = {\n")
+    for name in ranges:
+        out.write('    {"%s", "%s", sCategory%s, sizeof(sCategory%s) / sizeof(code_point_range_t)},\n'
+                  % (name, LONG_NAMES[name], name, name))
+    out.write("};\n\n")
+    out.write("const size_t kUnicodeCategoryCount =\n"
+              "    sizeof(kUnicodeCategories) / sizeof(kUnicodeCategories[0]);\n")
+
+
+if __name__ == "__main__":
+    main()
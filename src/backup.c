@@ -0,0 +1,191 @@
+#include "backup.h"
+#include <gc.h>
+#include <string.h>
+
+#define ERROR_RULE_ACTION "ECHO;"
+
+static size_t Expand(const dfa_tables_t *tables, uint32_t state, bool *seen, uint32_t *queue,
+                     size_t count);
+static size_t Reach(const dfa_tables_t *tables, uint32_t state, bool *seen, uint32_t *reached);
+static bool Accepts(const dfa_tables_t *tables, uint32_t state);
+static void AddRules(const dfa_tables_t *tables, uint32_t state, bool *rules);
+static bool *NewRuleSet(const dfa_tables_t *tables);
+
+vec_backing_up_state_t *FindBackingUp(const dfa_tables_t *tables)
+{
+    const uint32_t stateCount = tables->stateCount;
+    bool *seen = GC_malloc_atomic(stateCount);
+    uint32_t *queue = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+
+    // Every state reachable from an accepting one can be entered after an
+    // accept.
+    memset(seen, 0, stateCount);
+    size_t count = 0;
+    for (uint32_t s = 1; s < stateCount; ++s)
+    {
+        if (tables->accept[s] != LEX_NO_RULE)
+        {
+            count = Expand(tables, s, seen, queue, count);
+        }
+    }
+    for (size_t next = 0; next < count; ++next)
+    {
+        count = Expand(tables, queue[next], seen, queue, count);
+    }
+
+    vec_backing_up_state_t *states = GC_malloc(sizeof(vec_backing_up_state_t));
+    vec_init(states);
+    backing_up_state_t **byState = GC_malloc(stateCount * sizeof(backing_up_state_t *));
+    for (uint32_t s = 1; s < stateCount; ++s)
+    {
+        if (seen[s] && !Accepts(tables, s))
+        {
+            backing_up_state_t *state = GC_malloc(sizeof(backing_up_state_t));
+            state->state = s;
+            state->backsUpTo = NewRuleSet(tables);
+            state->matching = NewRuleSet(tables);
+            vec_push(states, state);
+            byState[s] = state;
+        }
+    }
+
+    // A state backs up to the rules of the accepting states that reach it
+    // without accepting on the way, and is still matching the rules of the
+    // states it reaches that way.
+    for (uint32_t s = 1; s < stateCount; ++s)
+    {
+        if (tables->accept[s] == LEX_NO_RULE)
+        {
+            continue;
+        }
+        size_t reached = Reach(tables, s, seen, queue);
+        for (size_t k = 0; k < reached; ++k)
+        {
+            if (!Accepts(tables, queue[k]))
+            {
+                AddRules(tables, s, byState[queue[k]]->backsUpTo);
+            }
+        }
+    }
+    backing_up_state_t *state;
+    int i;
+    vec_foreach(states, state, i)
+    {
+        // A state whose $ rule may not hold is still matching that rule.
+        AddRules(tables, state->state, state->matching);
+        size_t reached = Reach(tables, state->state, seen, queue);
+        for (size_t k = 0; k < reached; ++k)
+        {
+            AddRules(tables, queue[k], state->matching);
+        }
+    }
+    return states;
+}
+
+dfa_tables_t *AddErrorRules(const dfa_tables_t *tables, const vec_backing_up_state_t *states)
+{
+    dfa_tables_t *result = GC_malloc(sizeof(dfa_tables_t));
+    *result = *tables;
+    const uint32_t errorRule = tables->ruleCount;
+    result->ruleCount = errorRule + 1;
+
+    // A state whose $ rule may not hold falls back on the error rule instead.
+    uint32_t *accept = GC_malloc_atomic(tables->stateCount * sizeof(uint32_t));
+    uint32_t *fallback = GC_malloc_atomic(tables->stateCount * sizeof(uint32_t));
+    memcpy(accept, tables->accept, tables->stateCount * sizeof(uint32_t));
+    memcpy(fallback, tables->fallback, tables->stateCount * sizeof(uint32_t));
+    backing_up_state_t *state;
+    int i;
+    vec_foreach(states, state, i)
+    {
+        if (accept[state->state] == LEX_NO_RULE)
+        {
+            accept[state->state] = errorRule;
+        }
+        else
+        {
+            fallback[state->state] = errorRule;
+        }
+    }
+    result->accept = accept;
+    result->fallback = fallback;
+
+    lex_rule_info_t *rules = GC_malloc_atomic(result->ruleCount * sizeof(lex_rule_info_t));
+    memcpy(rules, tables->rules, errorRule * sizeof(lex_rule_info_t));
+    rules[errorRule] = (lex_rule_info_t){.anchor = ANCHOR_NONE,
+                                         .actionOffset = tables->stringsSize,
+                                         .actionLength = strlen(ERROR_RULE_ACTION),
+                                         .trail = TRAIL_NONE,
+                                         .fixedLength = 0};
+    result->rules = rules;
+
+    result->stringsSize = tables->stringsSize + sizeof(ERROR_RULE_ACTION);
+    char *strings = GC_malloc_atomic(result->stringsSize);
+    memcpy(strings, tables->strings, tables->stringsSize);
+    memcpy(strings + tables->stringsSize, ERROR_RULE_ACTION, sizeof(ERROR_RULE_ACTION));
+    result->strings = strings;
+    return result;
+}
+
+// Appends the live successors of state not yet seen to queue, which holds
+// count states, and returns the new count.
+static size_t Expand(const dfa_tables_t *tables, uint32_t state, bool *seen, uint32_t *queue,
+                     size_t count)
+{
+    for (uint32_t k = 0; k < tables->classCount; ++k)
+    {
+        uint32_t next = DfaTransition(tables, state, k);
+        if (next != LEX_DEAD_STATE && !seen[next])
+        {
+            seen[next] = true;
+            queue[count++] = next;
+        }
+    }
+    return count;
+}
+
+// Fills reached with the states that one or more steps from state reach
+// without passing through a state that surely accepts, including the
+// accepting states those paths end at, and returns how many there are.
+static size_t Reach(const dfa_tables_t *tables, uint32_t state, bool *seen, uint32_t *reached)
+{
+    memset(seen, 0, tables->stateCount);
+    size_t count = Expand(tables, state, seen, reached, 0);
+    for (size_t next = 0; next < count; ++next)
+    {
+        if (!Accepts(tables, reached[next]))
+        {
+            count = Expand(tables, reached[next], seen, reached, count);
+        }
+    }
+    return count;
+}
+
+// Whether entering state accepts whatever byte follows: it accepts a rule
+// without $, or has one to fall back on.
+static bool Accepts(const dfa_tables_t *tables, uint32_t state)
+{
+    uint32_t rule = tables->accept[state];
+    return rule != LEX_NO_RULE && (!(tables->rules[rule].anchor & ANCHOR_LINE_END) ||
+                                   tables->fallback[state] != LEX_NO_RULE);
+}
+
+// Marks the rules state may accept.
+static void AddRules(const dfa_tables_t *tables, uint32_t state, bool *rules)
+{
+    if (tables->accept[state] != LEX_NO_RULE)
+    {
+        rules[tables->accept[state]] = true;
+    }
+    if (tables->fallback[state] != LEX_NO_RULE)
+    {
+        rules[tables->fallback[state]] = true;
+    }
+}
+
+static bool *NewRuleSet(const dfa_tables_t *tables)
+{
+    bool *set = GC_malloc_atomic(tables->ruleCount ? tables->ruleCount : 1);
+    memset(set, 0, tables->ruleCount);
+    return set;
+}
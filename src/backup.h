@@ -0,0 +1,30 @@
+#ifndef LEX_BACKUP_H
+#define LEX_BACKUP_H
+
+#include "tables.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vec.h>
+
+// A state the scanner can enter after it has accepted and then leave without
+// accepting again, so the bytes read since the last accept are read twice.
+// backsUpTo[r] is set for the rules it may have to fall back on and
+// matching[r] for the rules it could still go on to accept.
+typedef struct
+{
+    uint32_t state;
+    bool *backsUpTo;
+    bool *matching;
+} backing_up_state_t;
+
+typedef vec_t(backing_up_state_t *) vec_backing_up_state_t;
+
+// Lists the states of tables that back up, in state order.
+vec_backing_up_state_t *FindBackingUp(const dfa_tables_t *tables);
+
+// Returns tables in which every listed state accepts a new last rule, whose
+// action is ECHO as for unmatched input. The scanner then returns the bytes
+// read so far as that rule's token rather than backing up.
+dfa_tables_t *AddErrorRules(const dfa_tables_t *tables, const vec_backing_up_state_t *states);
+
+#endif // LEX_BACKUP_H
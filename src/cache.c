@@ -0,0 +1,290 @@
+#include "cache.h"
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define MAKE_DIRECTORY(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define MAKE_DIRECTORY(path) mkdir(path, 0777)
+#endif
+
+#ifndef LEX_VERSION
+#define LEX_VERSION "unknown"
+#endif
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static void AppendKey(vec_char_t *key, const char *text, size_t length);
+static void AppendSection(vec_char_t *key, const char *name, const char *text);
+static int CompareMacroNames(const void *a, const void *b);
+static char *EntryPath(const char *directory, uint64_t hash, const char *suffix);
+static char *ReadWholeFile(const char *path, size_t *length);
+static bool CopyFile(const char *from, const char *to);
+static void CountEvent(const char *directory, const char *name);
+static size_t FileSize(const char *path);
+
+lex_cache_key_t *MakeCacheKey(const lex_spec_t *spec, const char *options, bool withCode)
+{
+    vec_char_t key;
+    vec_init(&key);
+    char header[64];
+    int headerLength = snprintf(header, sizeof(header), "lex %s image %d\n", LEX_VERSION,
+                                LEX_IMAGE_VERSION);
+    AppendKey(&key, header, headerLength);
+    AppendKey(&key, options, strlen(options));
+    AppendKey(&key, "\n", 1);
+
+    // Macros live in a hash whose order depends on insertion; sort them so the
+    // key only changes when a definition does.
+    size_t macroCount = HASH_COUNT(spec->macros);
+    macro_t **macros = GC_malloc(macroCount * sizeof(macro_t *) + 1);
+    macro_t *macro;
+    macro_t *tmp;
+    size_t n = 0;
+    HASH_ITER(hh, spec->macros, macro, tmp)
+    {
+        macros[n++] = macro;
+    }
+    qsort(macros, macroCount, sizeof(macro_t *), CompareMacroNames);
+    for (size_t i = 0; i < macroCount; ++i)
+    {
+        AppendKey(&key, macros[i]->name, strlen(macros[i]->name));
+        AppendKey(&key, "\t", 1);
+        AppendKey(&key, macros[i]->definition, strlen(macros[i]->definition));
+        AppendKey(&key, "\n", 1);
+    }
+    if (spec->caseless)
+    {
+        AppendKey(&key, "%option case-insensitive\n", 25);
+    }
+    start_condition_t *condition;
+    int i;
+    vec_foreach(&spec->conditions, condition, i)
+    {
+        AppendKey(&key, condition->exclusive ? "%x " : "%s ", 3);
+        AppendKey(&key, condition->name, strlen(condition->name));
+        AppendKey(&key, "\n", 1);
+    }
+    keyword_t *keyword;
+    vec_foreach(&spec->keywords, keyword, i)
+    {
+        AppendKey(&key, "%keyword ", 9);
+        AppendKey(&key, keyword->word, strlen(keyword->word));
+        AppendKey(&key, "\t", 1);
+        AppendKey(&key, keyword->action, strlen(keyword->action));
+        AppendKey(&key, "\n", 1);
+    }
+    AppendKey(&key, "%%\n", 3);
+
+    // Blank lines and trailing whitespace never reach the automaton.
+    const char *line = spec->rules;
+    const char *end = spec->rules + spec->rulesLength;
+    while (line < end)
+    {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+        {
+            eol = end;
+        }
+        const char *last = eol;
+        while (last > line && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+        {
+            --last;
+        }
+        if (last > line)
+        {
+            AppendKey(&key, line, last - line);
+            AppendKey(&key, "\n", 1);
+        }
+        line = eol + 1;
+    }
+    if (withCode)
+    {
+        AppendSection(&key, "prologue", spec->prologue);
+        AppendSection(&key, "epilogue", spec->epilogue);
+    }
+
+    lex_cache_key_t *result = GC_malloc(sizeof(lex_cache_key_t));
+    result->key = key.data;
+    result->keyLength = key.length;
+    result->hash = FNV_OFFSET_BASIS;
+    for (int i = 0; i < key.length; ++i)
+    {
+        result->hash ^= (unsigned char)key.data[i];
+        result->hash *= FNV_PRIME;
+    }
+    return result;
+}
+
+bool LookupCache(const char *directory, const lex_cache_key_t *key, const char *outputPath)
+{
+    MAKE_DIRECTORY(directory);
+    size_t storedLength;
+    char *stored = ReadWholeFile(EntryPath(directory, key->hash, ".key"), &storedLength);
+    bool hit = stored && storedLength == key->keyLength &&
+               memcmp(stored, key->key, storedLength) == 0 &&
+               CopyFile(EntryPath(directory, key->hash, ".out"), outputPath);
+    CountEvent(directory, hit ? "hits" : "misses");
+    return hit;
+}
+
+void StoreCache(const char *directory, const lex_cache_key_t *key, const char *outputPath)
+{
+    // The output goes in first: a reader that finds a matching key can rely
+    // on the output beside it.
+    char *keyPath = EntryPath(directory, key->hash, ".key");
+    char *tempPath = EntryPath(directory, key->hash, ".key.tmp");
+    if (!CopyFile(outputPath, EntryPath(directory, key->hash, ".out")))
+    {
+        return;
+    }
+    FILE *file = fopen(tempPath, "wb");
+    if (!file)
+    {
+        return;
+    }
+    bool ok = fwrite(key->key, 1, key->keyLength, file) == key->keyLength;
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    remove(keyPath);
+#endif
+    if (!ok || rename(tempPath, keyPath) != 0)
+    {
+        remove(tempPath);
+    }
+}
+
+void ReadCacheStats(const char *directory, size_t *hits, size_t *misses)
+{
+    size_t length = strlen(directory);
+    char *path = GC_malloc_atomic(length + sizeof("/misses"));
+    sprintf(path, "%s/hits", directory);
+    *hits = FileSize(path);
+    sprintf(path, "%s/misses", directory);
+    *misses = FileSize(path);
+}
+
+static void AppendKey(vec_char_t *key, const char *text, size_t length)
+{
+    vec_pusharr(key, text, length);
+}
+
+// Appends text behind its name and length, so no text can run into the next
+// section.
+static void AppendSection(vec_char_t *key, const char *name, const char *text)
+{
+    char header[64];
+    size_t length = strlen(text);
+    int headerLength = snprintf(header, sizeof(header), "%%%s %zu\n", name, length);
+    AppendKey(key, header, headerLength);
+    AppendKey(key, text, length);
+    AppendKey(key, "\n", 1);
+}
+
+static int CompareMacroNames(const void *a, const void *b)
+{
+    return strcmp((*(macro_t *const *)a)->name, (*(macro_t *const *)b)->name);
+}
+
+static char *EntryPath(const char *directory, uint64_t hash, const char *suffix)
+{
+    size_t length = strlen(directory) + 1 + 16 + strlen(suffix) + 1;
+    char *path = GC_malloc_atomic(length);
+    snprintf(path, length, "%s/%016llx%s", directory, (unsigned long long)hash, suffix);
+    return path;
+}
+
+static char *ReadWholeFile(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+    vec_char_t text;
+    vec_init(&text);
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        vec_pusharr(&text, buffer, n);
+    }
+    fclose(file);
+    *length = text.length;
+    return text.data ? text.data : GC_malloc_atomic(1);
+}
+
+// Copies through a temporary file and a rename, so neither a concurrent
+// reader of the destination nor a crash mid-copy sees a partial file.
+static bool CopyFile(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb");
+    if (!in)
+    {
+        return false;
+    }
+    size_t length = strlen(to);
+    char *tempPath = GC_malloc_atomic(length + sizeof(".tmp"));
+    memcpy(tempPath, to, length);
+    memcpy(tempPath + length, ".tmp", sizeof(".tmp"));
+    FILE *out = fopen(tempPath, "wb");
+    if (!out)
+    {
+        fclose(in);
+        return false;
+    }
+
+    bool ok = true;
+    char buffer[4096];
+    size_t n;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        ok = fwrite(buffer, 1, n, out) == n;
+    }
+    ok = !ferror(in) && ok;
+    fclose(in);
+    ok = fclose(out) == 0 && ok;
+#ifdef _WIN32
+    if (ok)
+    {
+        remove(to);
+    }
+#endif
+    if (!ok || rename(tempPath, to) != 0)
+    {
+        remove(tempPath);
+        return false;
+    }
+    return true;
+}
+
+static void CountEvent(const char *directory, const char *name)
+{
+    size_t length = strlen(directory) + 1 + strlen(name) + 1;
+    char *path = GC_malloc_atomic(length);
+    snprintf(path, length, "%s/%s", directory, name);
+    FILE *file = fopen(path, "ab");
+    if (file)
+    {
+        fputc('.', file);
+        fclose(file);
+    }
+}
+
+static size_t FileSize(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size > 0 ? (size_t)size : 0;
+}
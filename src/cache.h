@@ -0,0 +1,29 @@
+#ifndef LEX_CACHE_H
+#define LEX_CACHE_H
+
+#include "spec.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A directory of compiled outputs keyed by the normalized spec. Each entry is
+// `<hash>.key`, the exact normalized text, and `<hash>.out`, the output it
+// produced; a lookup only hits when the stored key matches byte for byte, so
+// a hash collision costs a rebuild rather than a wrong scanner. Hits and
+// misses are appended as single bytes to `hits` and `misses`, which stays
+// correct when several builds share the cache.
+typedef struct
+{
+    char *key;
+    size_t keyLength;
+    uint64_t hash;
+} lex_cache_key_t;
+
+// options must describe everything outside the spec that changes the output.
+// withCode adds the prologue and epilogue, which only generated C copies.
+lex_cache_key_t *MakeCacheKey(const lex_spec_t *spec, const char *options, bool withCode);
+bool LookupCache(const char *directory, const lex_cache_key_t *key, const char *outputPath);
+void StoreCache(const char *directory, const lex_cache_key_t *key, const char *outputPath);
+void ReadCacheStats(const char *directory, size_t *hits, size_t *misses);
+
+#endif // LEX_CACHE_H
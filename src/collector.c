@@ -0,0 +1,122 @@
+#include "collector.h"
+#include <gc.h>
+#include <stdbool.h>
+#include <threads.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+static thread_local bool sRegistered = false;
+// Set on the thread that started the collector, which registered it.
+static thread_local bool sStartedHere = false;
+
+static void StartCollector(void);
+static void UnregisterAtExit(void);
+
+void RegisterCollectorThread(void)
+{
+    if (sRegistered)
+    {
+        return;
+    }
+    sRegistered = true;
+    StartCollector();
+    if (!GC_thread_is_registered())
+    {
+        struct GC_stack_base base;
+        GC_get_stack_base(&base);
+        GC_register_my_thread(&base);
+    }
+    else if (!sStartedHere)
+    {
+        // Created through the collector's own wrappers, which unregister it.
+        return;
+    }
+    UnregisterAtExit();
+}
+
+#ifdef _WIN32
+
+static INIT_ONCE sStarted = INIT_ONCE_STATIC_INIT;
+static INIT_ONCE sExitKeyCreated = INIT_ONCE_STATIC_INIT;
+static DWORD sExitKey;
+
+static BOOL CALLBACK Start(PINIT_ONCE once, PVOID parameter, PVOID *context)
+{
+    (void)once;
+    (void)parameter;
+    (void)context;
+    GC_INIT();
+    GC_allow_register_threads();
+    sStartedHere = true;
+    return TRUE;
+}
+
+static VOID WINAPI Unregister(PVOID value)
+{
+    (void)value;
+    GC_unregister_my_thread();
+}
+
+static BOOL CALLBACK CreateExitKey(PINIT_ONCE once, PVOID parameter, PVOID *context)
+{
+    (void)once;
+    (void)parameter;
+    (void)context;
+    sExitKey = FlsAlloc(Unregister);
+    return TRUE;
+}
+
+static void StartCollector(void)
+{
+    InitOnceExecuteOnce(&sStarted, Start, NULL, NULL);
+}
+
+// A fiber-local value with a callback is the only per-thread destructor
+// Windows offers; the callback runs on the exiting thread.
+static void UnregisterAtExit(void)
+{
+    InitOnceExecuteOnce(&sExitKeyCreated, CreateExitKey, NULL, NULL);
+    FlsSetValue(sExitKey, &sExitKey);
+}
+
+#else
+
+static pthread_once_t sStarted = PTHREAD_ONCE_INIT;
+static pthread_once_t sExitKeyCreated = PTHREAD_ONCE_INIT;
+static pthread_key_t sExitKey;
+
+static void Start(void)
+{
+    GC_INIT();
+    GC_allow_register_threads();
+    sStartedHere = true;
+}
+
+static void Unregister(void *value)
+{
+    (void)value;
+    GC_unregister_my_thread();
+}
+
+static void CreateExitKey(void)
+{
+    pthread_key_create(&sExitKey, Unregister);
+}
+
+static void StartCollector(void)
+{
+    pthread_once(&sStarted, Start);
+}
+
+// Key destructors run on the exiting thread, and only for a non-NULL value.
+static void UnregisterAtExit(void)
+{
+    pthread_once(&sExitKeyCreated, CreateExitKey);
+    pthread_setspecific(sExitKey, &sExitKey);
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef LEX_COLLECTOR_H
+#define LEX_COLLECTOR_H
+
+// The collector is built with thread support and only scans, and stops for a
+// collection, the threads registered with it. Every public entry point that
+// allocates, frees or scans calls RegisterCollectorThread first: the first
+// call anywhere starts the collector, and the first call on each thread
+// registers that thread, which unregisters itself when it exits. Later calls
+// on a registered thread cost one thread-local test.
+void RegisterCollectorThread(void);
+
+#endif // LEX_COLLECTOR_H
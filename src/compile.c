@@ -0,0 +1,616 @@
+#include "compile.h"
+#include "backup.h"
+#include "pike.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How many of the worst rules an overflow report names.
+#define OVERFLOW_RULES_REPORTED 3
+// How many of a state's successors a profile report names.
+#define PROFILE_SUCCESSORS_REPORTED 4
+
+typedef struct
+{
+    uint32_t index;
+    uint64_t count;
+} ranked_count_t;
+
+static void LocateRule(const lex_spec_t *spec, const nfa_t *nfa, size_t rule,
+                       lex_error_t *error);
+static void ReportBackingUp(const lex_spec_t *spec, const nfa_t *nfa, const dfa_tables_t *tables,
+                            const vec_backing_up_state_t *states, bool errorRules, FILE *out);
+static void WriteRuleLines(const lex_spec_t *spec, const nfa_t *nfa, const bool *rules,
+                           FILE *out);
+static void WriteByte(int c, FILE *out);
+static bool JamsOn(const dfa_tables_t *tables, uint32_t state, bool lineEnd, int c);
+static bool SameWord(const char *a, const char *b, bool caseless);
+static void ReportProfile(const lex_spec_t *spec, const nfa_t *nfa, const dfa_tables_t *tables,
+                          const dfa_profile_t *profile, FILE *out);
+static bitset_t **FindMatchingRules(const dfa_tables_t *tables);
+static void WriteSuccessors(const dfa_tables_t *tables, const dfa_profile_t *profile,
+                            uint32_t state, ranked_count_t *successors, FILE *out);
+static int CompareRankedCounts(const void *a, const void *b);
+static void SetKeywordError(const keyword_t *keyword, const char *message, const char *other,
+                            lex_error_t *error);
+
+nfa_t *CompileSpecNfa(const lex_spec_t *spec, lex_nfa_construction_t construction,
+                      lex_stats_t *stats, lex_error_t *warning, lex_error_t *error)
+{
+    LexStatsBeginPhase(stats, LEX_PHASE_NFA);
+    nfa_t *nfa = ConstructNfa(spec->rules, spec->rulesLength, spec->macros, &spec->conditions,
+                              spec->caseless, stats, warning, error);
+    if (nfa && construction == LEX_NFA_GLUSHKOV)
+    {
+        nfa = ConstructPositionAutomaton(nfa, stats);
+    }
+    LexStatsEndPhase(stats, LEX_PHASE_NFA);
+    if (!nfa)
+    {
+        error->offset += spec->rulesOffset;
+        error->line += spec->rulesLine - 1;
+    }
+    else if (warning && warning->message)
+    {
+        warning->offset += spec->rulesOffset;
+        warning->line += spec->rulesLine - 1;
+    }
+    return nfa;
+}
+
+dfa_tables_t *CompileNfaTables(nfa_t *nfa, const dfa_budget_t *budget, dfa_overflow_t *overflow,
+                               lex_stats_t *stats)
+{
+    LexStatsBeginPhase(stats, LEX_PHASE_DFA);
+    dfa_t *dfa = ConstructDfa(nfa, budget, overflow, stats);
+    LexStatsEndPhase(stats, LEX_PHASE_DFA);
+    if (!dfa)
+    {
+        return NULL;
+    }
+    LexStatsBeginPhase(stats, LEX_PHASE_MINIMIZE);
+    dfa = MinimizeDfa(dfa, stats);
+    LexStatsEndPhase(stats, LEX_PHASE_MINIMIZE);
+    LexStatsBeginPhase(stats, LEX_PHASE_TABLES);
+    dfa_tables_t *tables = BuildDfaTables(dfa, nfa);
+    LexStatsEndPhase(stats, LEX_PHASE_TABLES);
+    return tables;
+}
+
+dfa_tables_t *CompileSpecTables(const lex_spec_t *spec, lex_nfa_construction_t construction,
+                                const dfa_budget_t *budget,
+                                const backing_up_options_t *backingUp, lex_stats_t *stats,
+                                lex_error_t *warning, lex_error_t *error)
+{
+    nfa_t *nfa = CompileSpecNfa(spec, construction, stats, warning, error);
+    if (!nfa)
+    {
+        return NULL;
+    }
+    size_t rule;
+    if (FindVariableTrail(nfa, &rule))
+    {
+        LocateRule(spec, nfa, rule, error);
+        error->message = "trailing context with variable-length text on both sides of '/' "
+                         "needs a tagged DFA, which tables cannot hold";
+        return NULL;
+    }
+    dfa_overflow_t overflow;
+    dfa_tables_t *tables = CompileNfaTables(nfa, budget, &overflow, stats);
+    if (!tables)
+    {
+        DescribeDfaOverflow(spec, nfa, &overflow, error);
+        return NULL;
+    }
+    if (backingUp && (backingUp->report || backingUp->errorRules))
+    {
+        vec_backing_up_state_t *states = FindBackingUp(tables);
+        if (backingUp->report)
+        {
+            ReportBackingUp(spec, nfa, tables, states, backingUp->errorRules, backingUp->report);
+        }
+        if (backingUp->errorRules && states->length > 0)
+        {
+            tables = AddErrorRules(tables, states);
+        }
+    }
+    if (!CompileKeywords(spec, nfa, tables->ruleCount, &tables->keywords, error))
+    {
+        return NULL;
+    }
+    return tables;
+}
+
+// The keywords are scanned as a scanner would meet them, in INITIAL mid-line.
+bool CompileKeywords(const lex_spec_t *spec, const nfa_t *nfa, uint32_t firstRule,
+                     const keyword_table_t **keywords, lex_error_t *error)
+{
+    *keywords = NULL;
+    if (spec->keywords.length == 0)
+    {
+        return true;
+    }
+    pike_vm_t *vm = CreatePikeVm(nfa);
+    uint32_t rule = LEX_NO_RULE;
+    const keyword_t *ruleKeyword = NULL;
+    bool ok = true;
+    for (int k = 0; ok && k < spec->keywords.length; ++k)
+    {
+        const keyword_t *keyword = spec->keywords.data[k];
+        for (int j = 0; ok && j < k; ++j)
+        {
+            if (SameWord(spec->keywords.data[j]->word, keyword->word, spec->caseless))
+            {
+                SetKeywordError(keyword, "keyword '%s' is listed twice", "", error);
+                ok = false;
+            }
+        }
+        if (!ok)
+        {
+            break;
+        }
+        size_t length = strlen(keyword->word);
+        lex_match_t match;
+        if (!SimulateNfa(nfa, vm, 0, (const unsigned char *)keyword->word, length, false,
+                         &match) ||
+            match.length != length)
+        {
+            SetKeywordError(keyword, "keyword '%s' is not matched in full by any rule", "",
+                            error);
+            ok = false;
+        }
+        else if (rule == LEX_NO_RULE)
+        {
+            rule = match.rule;
+            ruleKeyword = keyword;
+        }
+        else if (match.rule != rule)
+        {
+            SetKeywordError(keyword, "keyword '%s' is matched by another rule than '%s'",
+                            ruleKeyword->word, error);
+            ok = false;
+        }
+    }
+    DestroyPikeVm(vm);
+    if (ok)
+    {
+        *keywords = BuildKeywordTable(&spec->keywords, spec->caseless, rule, firstRule);
+    }
+    return ok;
+}
+
+bool ReportSpecProfile(const lex_spec_t *spec, lex_nfa_construction_t construction,
+                       bool errorRules, const char *profilePath, FILE *out, lex_error_t *error)
+{
+    nfa_t *nfa = CompileSpecNfa(spec, construction, NULL, NULL, error);
+    if (!nfa)
+    {
+        return false;
+    }
+    size_t rule;
+    if (FindVariableTrail(nfa, &rule))
+    {
+        LocateRule(spec, nfa, rule, error);
+        error->message = "trailing context with variable-length text on both sides of '/' "
+                         "needs a tagged DFA, which profiles do not cover";
+        return false;
+    }
+    dfa_overflow_t overflow;
+    dfa_tables_t *tables = CompileNfaTables(nfa, NULL, &overflow, NULL);
+    if (errorRules)
+    {
+        vec_backing_up_state_t *states = FindBackingUp(tables);
+        if (states->length > 0)
+        {
+            tables = AddErrorRules(tables, states);
+        }
+    }
+    const char *problem;
+    dfa_profile_t *profile = ReadDfaProfile(profilePath, tables, &problem);
+    if (!profile)
+    {
+        int length = snprintf(NULL, 0, "%s: %s", profilePath, problem);
+        *error = (lex_error_t){.message = GC_malloc_atomic(length + 1)};
+        snprintf(error->message, length + 1, "%s: %s", profilePath, problem);
+        return false;
+    }
+    ReportProfile(spec, nfa, tables, profile, out);
+    return true;
+}
+
+bool FindVariableTrail(const nfa_t *nfa, size_t *rule)
+{
+    for (size_t r = 0; r < nfa->ruleCount; ++r)
+    {
+        if (nfa->ruleEnds.data[r]->trail == TRAIL_VARIABLE)
+        {
+            *rule = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+void DescribeDfaOverflow(const lex_spec_t *spec, const nfa_t *nfa,
+                         const dfa_overflow_t *overflow, lex_error_t *report)
+{
+    // Keep the worst rules sorted by state count, most first.
+    size_t worst[OVERFLOW_RULES_REPORTED];
+    size_t worstCount = 0;
+    for (size_t r = 0; r < nfa->ruleCount; ++r)
+    {
+        size_t states = overflow->ruleStates[r];
+        size_t k = worstCount;
+        if (states == 0 ||
+            (k == OVERFLOW_RULES_REPORTED && overflow->ruleStates[worst[k - 1]] >= states))
+        {
+            continue;
+        }
+        if (k < OVERFLOW_RULES_REPORTED)
+        {
+            ++worstCount;
+        }
+        else
+        {
+            --k;
+        }
+        for (; k > 0 && overflow->ruleStates[worst[k - 1]] < states; --k)
+        {
+            worst[k] = worst[k - 1];
+        }
+        worst[k] = r;
+    }
+
+    char message[256];
+    int length = snprintf(message, sizeof(message),
+                          "DFA exceeded its budget at %zu states (%zu KiB); rules forming "
+                          "the most NFA sets:",
+                          overflow->states, overflow->bytes / 1024);
+    *report = (lex_error_t){.offset = 0, .line = 0, .column = 0};
+    for (size_t k = 0; k < worstCount; ++k)
+    {
+        lex_error_t at;
+        LocateRule(spec, nfa, worst[k], &at);
+        length += snprintf(message + length, sizeof(message) - length, "%s line %zu (%zu)",
+                           k > 0 ? "," : "", at.line, overflow->ruleStates[worst[k]]);
+        if (k == 0)
+        {
+            *report = at;
+        }
+    }
+    report->message = GC_strdup(message);
+}
+
+// Positions error at the start of a rule in the spec text.
+static void LocateRule(const lex_spec_t *spec, const nfa_t *nfa, size_t rule,
+                       lex_error_t *error)
+{
+    size_t offset = nfa->ruleOffsets.data[rule];
+    size_t line = spec->rulesLine;
+    size_t column = 1;
+    for (size_t i = 0; i < offset; ++i)
+    {
+        column = spec->rules[i] == '\n' ? 1 : column + 1;
+        line += spec->rules[i] == '\n';
+    }
+    *error = (lex_error_t){
+        .offset = spec->rulesOffset + offset, .line = line, .column = column};
+}
+
+// One line per state, naming rules by the spec line they start on and
+// listing the bytes on which the state jams, then a summary.
+static void ReportBackingUp(const lex_spec_t *spec, const nfa_t *nfa, const dfa_tables_t *tables,
+                            const vec_backing_up_state_t *states, bool errorRules, FILE *out)
+{
+    backing_up_state_t *state;
+    int i;
+    vec_foreach(states, state, i)
+    {
+        fprintf(out, "state %u backs up to ", state->state);
+        WriteRuleLines(spec, nfa, state->backsUpTo, out);
+        fputs("; still matching ", out);
+        WriteRuleLines(spec, nfa, state->matching, out);
+        // A listed state that accepts has a $ rule, which holds at a line end.
+        bool lineEnd = tables->accept[state->state] != LEX_NO_RULE;
+        fputs(lineEnd ? "; jams on" : "; jams on end of input", out);
+        for (int c = 0; c < LEX_BYTE_COUNT; ++c)
+        {
+            if (!JamsOn(tables, state->state, lineEnd, c))
+            {
+                continue;
+            }
+            int last = c;
+            while (last + 1 < LEX_BYTE_COUNT && JamsOn(tables, state->state, lineEnd, last + 1))
+            {
+                ++last;
+            }
+            fputc(' ', out);
+            WriteByte(c, out);
+            if (last > c)
+            {
+                fputc('-', out);
+                WriteByte(last, out);
+            }
+            c = last;
+        }
+        fputc('\n', out);
+    }
+
+    if (states->length == 0)
+    {
+        fputs("no backing up\n", out);
+    }
+    else if (errorRules)
+    {
+        fprintf(out, "%d states back up; an error rule now catches them\n", states->length);
+    }
+    else
+    {
+        fprintf(out, "%d states back up\n", states->length);
+    }
+}
+
+static void WriteRuleLines(const lex_spec_t *spec, const nfa_t *nfa, const bool *rules,
+                           FILE *out)
+{
+    bool any = false;
+    for (size_t r = 0; r < nfa->ruleCount; ++r)
+    {
+        if (rules[r])
+        {
+            lex_error_t at;
+            LocateRule(spec, nfa, r, &at);
+            fprintf(out, "%s%zu", any ? ", " : "line ", at.line);
+            any = true;
+        }
+    }
+    if (!any)
+    {
+        fputs("no rule", out);
+    }
+}
+
+static void WriteByte(int c, FILE *out)
+{
+    if (c > ' ' && c < 0x7F && c != '\\' && c != '-')
+    {
+        fputc(c, out);
+    }
+    else
+    {
+        fprintf(out, "\\x%02X", c);
+    }
+}
+
+// Case is folded for ASCII letters only, as %option case-insensitive does.
+static bool SameWord(const char *a, const char *b, bool caseless)
+{
+    for (;; ++a, ++b)
+    {
+        int x = caseless && *a >= 'A' && *a <= 'Z' ? *a - 'A' + 'a' : *a;
+        int y = caseless && *b >= 'A' && *b <= 'Z' ? *b - 'A' + 'a' : *b;
+        if (x != y || x == '\0')
+        {
+            return x == y;
+        }
+    }
+}
+
+// message has a %s for the keyword, which may be followed by one for other.
+static void SetKeywordError(const keyword_t *keyword, const char *message, const char *other,
+                            lex_error_t *error)
+{
+    int length = snprintf(NULL, 0, message, keyword->word, other);
+    error->message = GC_malloc_atomic(length + 1);
+    snprintf(error->message, length + 1, message, keyword->word, other);
+    error->offset = keyword->offset;
+    error->line = keyword->line;
+    error->column = keyword->column;
+}
+
+// Whether state stops on byte c without accepting.
+static bool JamsOn(const dfa_tables_t *tables, uint32_t state, bool lineEnd, int c)
+{
+    if (lineEnd && (c == '\n' || c == '\r'))
+    {
+        return false;
+    }
+    return DfaTransition(tables, state, tables->classMap[c]) == LEX_DEAD_STATE;
+}
+
+static void ReportProfile(const lex_spec_t *spec, const nfa_t *nfa, const dfa_tables_t *tables,
+                          const dfa_profile_t *profile, FILE *out)
+{
+    const uint32_t stateCount = tables->stateCount;
+    uint64_t total = 0;
+    uint32_t visited = 0;
+    ranked_count_t *states = GC_malloc_atomic(stateCount * sizeof(ranked_count_t));
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        states[s] = (ranked_count_t){.index = s, .count = atomic_load(&profile->visits[s])};
+        total += states[s].count;
+        visited += states[s].count > 0;
+    }
+    fprintf(out, "%" PRIu64 " state visits; %u of %u states visited\n", total, visited,
+            stateCount - 1);
+    if (total == 0)
+    {
+        return;
+    }
+
+    // A state's visits count toward every rule it can still go on to accept,
+    // so the shares add up to more than the whole.
+    bitset_t **matching = FindMatchingRules(tables);
+    ranked_count_t *rules = GC_malloc_atomic(nfa->ruleCount * sizeof(ranked_count_t));
+    for (uint32_t r = 0; r < nfa->ruleCount; ++r)
+    {
+        rules[r] = (ranked_count_t){.index = r, .count = 0};
+        for (uint32_t s = 1; s < stateCount; ++s)
+        {
+            if (bitset_get(matching[s], r))
+            {
+                rules[r].count += states[s].count;
+            }
+        }
+    }
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        bitset_free(matching[s]);
+    }
+    qsort(rules, nfa->ruleCount, sizeof(ranked_count_t), CompareRankedCounts);
+    fputs("visits to states still matching each rule:\n", out);
+    for (uint32_t k = 0; k < nfa->ruleCount && rules[k].count > 0; ++k)
+    {
+        lex_error_t at;
+        LocateRule(spec, nfa, rules[k].index, &at);
+        fprintf(out, "  line %zu: %" PRIu64 " (%.1f%%)\n", at.line, rules[k].count,
+                100.0 * rules[k].count / total);
+    }
+
+    qsort(states, stateCount, sizeof(ranked_count_t), CompareRankedCounts);
+    ranked_count_t *successors = GC_malloc_atomic(tables->classCount * sizeof(ranked_count_t));
+    fputs("states, hottest first:\n", out);
+    for (uint32_t k = 0; k < stateCount && states[k].count > 0; ++k)
+    {
+        uint32_t s = states[k].index;
+        fprintf(out, "  state %u: %" PRIu64 " (%.1f%%)", s, states[k].count,
+                100.0 * states[k].count / total);
+        if (tables->accept[s] >= nfa->ruleCount && tables->accept[s] != LEX_NO_RULE)
+        {
+            fputs(", accepts the error rule", out);
+        }
+        else if (tables->accept[s] != LEX_NO_RULE)
+        {
+            lex_error_t at;
+            LocateRule(spec, nfa, tables->accept[s], &at);
+            fprintf(out, ", accepts line %zu", at.line);
+        }
+        WriteSuccessors(tables, profile, s, successors, out);
+        fputc('\n', out);
+    }
+}
+
+// The rules each state can accept on entry or on some path on from it: the
+// union over its successors, grown from the accepting states backwards until
+// nothing changes.
+static bitset_t **FindMatchingRules(const dfa_tables_t *tables)
+{
+    const uint32_t stateCount = tables->stateCount;
+    bitset_t **matching = GC_malloc(stateCount * sizeof(bitset_t *));
+    bool *queued = GC_malloc_atomic(stateCount);
+    uint32_t *queue = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    size_t count = 0;
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        matching[s] = bitset_create();
+        if (s != LEX_DEAD_STATE && tables->accept[s] != LEX_NO_RULE)
+        {
+            bitset_set(matching[s], tables->accept[s]);
+            if (tables->fallback[s] != LEX_NO_RULE)
+            {
+                bitset_set(matching[s], tables->fallback[s]);
+            }
+        }
+        queued[s] = s != LEX_DEAD_STATE;
+        if (queued[s])
+        {
+            queue[count++] = s;
+        }
+    }
+
+    // Predecessor lists, in one array indexed by firstPredecessor.
+    size_t *firstPredecessor = GC_malloc_atomic((stateCount + 1) * sizeof(size_t));
+    memset(firstPredecessor, 0, (stateCount + 1) * sizeof(size_t));
+    const size_t cells = (size_t)stateCount * tables->classCount;
+    for (uint32_t s = 1; s < stateCount; ++s)
+    {
+        for (uint32_t k = 0; k < tables->classCount; ++k)
+        {
+            ++firstPredecessor[DfaTransition(tables, s, k) + 1];
+        }
+    }
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        firstPredecessor[s + 1] += firstPredecessor[s];
+    }
+    uint32_t *predecessors = GC_malloc_atomic((cells + 1) * sizeof(uint32_t));
+    size_t *filled = GC_malloc_atomic(stateCount * sizeof(size_t));
+    memcpy(filled, firstPredecessor, stateCount * sizeof(size_t));
+    for (uint32_t s = 1; s < stateCount; ++s)
+    {
+        for (uint32_t k = 0; k < tables->classCount; ++k)
+        {
+            predecessors[filled[DfaTransition(tables, s, k)]++] = s;
+        }
+    }
+
+    // The queue is a ring of at most stateCount states, each queued once.
+    for (size_t head = 0; count > 0; head = (head + 1) % stateCount, --count)
+    {
+        uint32_t t = queue[head];
+        queued[t] = false;
+        for (size_t k = firstPredecessor[t]; k < firstPredecessor[t + 1]; ++k)
+        {
+            uint32_t p = predecessors[k];
+            size_t before = bitset_count(matching[p]);
+            bitset_inplace_union(matching[p], matching[t]);
+            if (bitset_count(matching[p]) != before && !queued[p])
+            {
+                queued[p] = true;
+                queue[(head + count) % stateCount] = p;
+                ++count;
+            }
+        }
+    }
+    return matching;
+}
+
+// Names the states most often entered from state, with how often, and 0 for
+// the scans that stopped there.
+static void WriteSuccessors(const dfa_tables_t *tables, const dfa_profile_t *profile,
+                            uint32_t state, ranked_count_t *successors, FILE *out)
+{
+    size_t count = 0;
+    for (uint32_t k = 0; k < tables->classCount; ++k)
+    {
+        uint64_t taken =
+            atomic_load(&profile->transitions[(size_t)state * tables->classCount + k]);
+        if (taken == 0)
+        {
+            continue;
+        }
+        uint32_t next = DfaTransition(tables, state, k);
+        size_t j = 0;
+        while (j < count && successors[j].index != next)
+        {
+            ++j;
+        }
+        if (j == count)
+        {
+            successors[count++] = (ranked_count_t){.index = next, .count = 0};
+        }
+        successors[j].count += taken;
+    }
+    qsort(successors, count, sizeof(ranked_count_t), CompareRankedCounts);
+    for (size_t j = 0; j < count && j < PROFILE_SUCCESSORS_REPORTED; ++j)
+    {
+        fprintf(out, "%s%u (%" PRIu64 ")", j == 0 ? "; to " : ", ", successors[j].index,
+                successors[j].count);
+    }
+    if (count > PROFILE_SUCCESSORS_REPORTED)
+    {
+        fputs(", ...", out);
+    }
+}
+
+// Most counted first, then by index.
+static int CompareRankedCounts(const void *a, const void *b)
+{
+    const ranked_count_t *x = a;
+    const ranked_count_t *y = b;
+    if (x->count != y->count)
+    {
+        return x->count > y->count ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
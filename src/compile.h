@@ -0,0 +1,59 @@
+#ifndef LEX_COMPILE_H
+#define LEX_COMPILE_H
+
+#include "dfa.h"
+#include "nfa.h"
+#include "profile.h"
+#include "spec.h"
+#include "stats.h"
+#include "tables.h"
+#include <stdio.h>
+
+// What CompileSpecTables does about states that back up: a non-NULL report
+// receives a description of each, and errorRules gives them an error rule as
+// AddErrorRules describes.
+typedef struct
+{
+    FILE *report;
+    bool errorRules;
+} backing_up_options_t;
+
+// Parses a spec's rules into an NFA of the chosen construction. Returns NULL
+// on a bad rule, with the error positioned in the spec text rather than the
+// rules section; *warning, which may be NULL, is set as ConstructNfa sets it
+// and positioned the same way.
+nfa_t *CompileSpecNfa(const lex_spec_t *spec, lex_nfa_construction_t construction,
+                      lex_stats_t *stats, lex_error_t *warning, lex_error_t *error);
+// Subset construction, minimization and table building. Returns NULL when
+// construction passes the budget (which may be NULL), filling in *overflow.
+dfa_tables_t *CompileNfaTables(nfa_t *nfa, const dfa_budget_t *budget, dfa_overflow_t *overflow,
+                               lex_stats_t *stats);
+// Both of the above. Passing the budget is reported in *error like a bad
+// rule, positioned at the rule most responsible, and so is a rule whose
+// trailing context only a tagged DFA can resolve. backingUp may be NULL.
+dfa_tables_t *CompileSpecTables(const lex_spec_t *spec, lex_nfa_construction_t construction,
+                                const dfa_budget_t *budget,
+                                const backing_up_options_t *backingUp, lex_stats_t *stats,
+                                lex_error_t *warning, lex_error_t *error);
+// Builds the keyword table of a spec with %keywords, or sets *keywords to NULL
+// for one without. Every keyword must be matched in full by the same rule of
+// nfa, which then reports keyword k as rule firstRule + k. Fails, positioned
+// at the keyword, for one listed twice or matched otherwise.
+bool CompileKeywords(const lex_spec_t *spec, const nfa_t *nfa, uint32_t firstRule,
+                     const keyword_table_t **keywords, lex_error_t *error);
+// Compiles spec's tables as CompileSpecTables does with no budget, adding
+// error rules when errorRules is set, and describes the profile at
+// profilePath, counted on them in any state order: how many visits went to
+// states still matching each rule, and each visited state, hottest first,
+// with the states it went on to. Fails when the spec does not compile or the
+// profile is not one of its tables.
+bool ReportSpecProfile(const lex_spec_t *spec, lex_nfa_construction_t construction,
+                       bool errorRules, const char *profilePath, FILE *out, lex_error_t *error);
+// Finds a TRAIL_VARIABLE rule, which plain tables cannot scan.
+bool FindVariableTrail(const nfa_t *nfa, size_t *rule);
+// Describes an overflow: its size and, by spec line, the rules whose own
+// nodes formed the most distinct sets among the states.
+void DescribeDfaOverflow(const lex_spec_t *spec, const nfa_t *nfa,
+                         const dfa_overflow_t *overflow, lex_error_t *report);
+
+#endif // LEX_COMPILE_H
@@ -1,30 +1,64 @@
 #include "dfa.h"
+#include "stats.h"
 #include "vec.h"
+#include <string.h>
 
-static void ComputeEpsilonClosure(nfa_t *nfa, bitset_t *set, char **accept, anchor_t *anchor);
-static bitset_t *MoveOnChar(nfa_t *nfa, bitset_t *set, char c);
-static dfa_node_t *FindDfaState(dfa_t *dfa, bitset_t *stateSet);
+typedef struct
+{
+    size_t *key;
+    size_t group;
+    UT_hash_handle hh;
+} dfa_signature_t;
+
+// Subset construction looks states up by their NFA set; the key is the set's
+// words with trailing zero words dropped, so equal sets hash equally whatever
+// their capacity.
+typedef struct
+{
+    dfa_node_t *node;
+    UT_hash_handle hh;
+} dfa_state_entry_t;
+
+static size_t AssignGroup(dfa_signature_t **signatures, size_t *key, size_t keyLength,
+                          size_t *groupCount);
+static void ComputeEpsilonClosure(nfa_t *nfa, bitset_t *set, char **accept, anchor_t *anchor,
+                                  size_t *rule, size_t *fallback, lex_stats_t *stats);
+static void SelectAcceptingRule(nfa_t *nfa, bitset_t *set, char **accept, anchor_t *anchor,
+                                size_t *rule, size_t *fallback);
+static void ConsiderAccepting(const nfa_node_t *p, char **accept, anchor_t *anchor, size_t *rule,
+                              size_t *fallback);
+static void MoveOnAllChars(nfa_t *nfa, bitset_t *set, bitset_t **moves, lex_stats_t *stats);
+static void MoveOnAllPositions(nfa_t *nfa, bitset_t *set, bitset_t **moves, lex_stats_t *stats);
+static size_t StateKeyLength(const bitset_t *stateSet);
+static dfa_node_t *FindDfaState(dfa_state_entry_t *states, bitset_t *stateSet);
+static void AddDfaState(dfa_state_entry_t **states, dfa_node_t *node);
+static size_t DfaStateBytes(const dfa_node_t *node);
+static bool OverBudget(const dfa_budget_t *budget, size_t states, size_t bytes);
+static void DescribeOverflow(nfa_t *nfa, dfa_t *dfa, size_t bytes, dfa_overflow_t *overflow);
 
 void DfaNodeInit(dfa_node_t *node)
 {
     node->edges = NULL;
     node->acceptString = NULL;
     node->anchor = ANCHOR_NONE;
+    node->rule = 0;
+    node->fallback = SIZE_MAX;
+    node->index = 0;
     node->equivalentNfaIndices = bitset_create();
 }
 
-void DfaNodeAddEdge(dfa_node_t *node, char id, dfa_node_t *ptr)
+void DfaNodeAddEdge(dfa_node_t *node, unsigned char id, dfa_node_t *ptr)
 {
     dfa_node_edge_t *edge = GC_malloc(sizeof(dfa_node_edge_t));
     edge->id = id;
     edge->ptr = ptr;
-    HASH_ADD(hh, node->edges, id, sizeof(char), edge);
+    HASH_ADD(hh, node->edges, id, sizeof(unsigned char), edge);
 }
 
-dfa_node_t *DfaNodeFollowEdge(dfa_node_t *node, char id)
+dfa_node_t *DfaNodeFollowEdge(dfa_node_t *node, unsigned char id)
 {
     dfa_node_edge_t *edge;
-    HASH_FIND(hh, node->edges, &id, sizeof(char), edge);
+    HASH_FIND(hh, node->edges, &id, sizeof(unsigned char), edge);
     if (!edge)
     {
         return NULL;
@@ -32,65 +66,254 @@ dfa_node_t *DfaNodeFollowEdge(dfa_node_t *node, char id)
     return edge->ptr;
 }
 
-dfa_t *ConstructDfa(nfa_t *nfa)
+dfa_t *ConstructDfa(nfa_t *nfa, const dfa_budget_t *budget, dfa_overflow_t *overflow,
+                    lex_stats_t *stats)
 {
-    bitset_t *nfaSet = bitset_create();
-    bitset_set(nfaSet, nfa->start);
-    dfa_node_t *current = GC_malloc(sizeof(dfa_node_t));
-    DfaNodeInit(current);
-    ComputeEpsilonClosure(nfa, nfaSet, &current->acceptString, &current->anchor);
-    current->equivalentNfaIndices = nfaSet;
-    vec_dfa_node_t stack;
-    vec_init(&stack);
-    vec_push(&stack, current);
     dfa_t *dfa = GC_malloc(sizeof(dfa_t));
     vec_init(&dfa->nodes);
-    dfa->start = 0;
+    vec_init(&dfa->starts);
+
+    // Conditions whose rules begin alike share an entry state.
+    dfa_state_entry_t *states = NULL;
+    size_t bytes = 0;
+    vec_dfa_node_t stack;
+    vec_init(&stack);
+    bitset_t *nfaSet;
+    size_t nfaStart;
+    int condition;
+    vec_foreach(&nfa->starts, nfaStart, condition)
+    {
+        nfaSet = bitset_create();
+        LexStatsCount(stats, LEX_COUNTER_BITSETS, 1);
+        bitset_set(nfaSet, nfaStart);
+        dfa_node_t *start = GC_malloc(sizeof(dfa_node_t));
+        DfaNodeInit(start);
+        if (nfa->positional)
+        {
+            SelectAcceptingRule(nfa, nfaSet, &start->acceptString, &start->anchor, &start->rule,
+                                &start->fallback);
+        }
+        else
+        {
+            ComputeEpsilonClosure(nfa, nfaSet, &start->acceptString, &start->anchor,
+                                  &start->rule, &start->fallback, stats);
+        }
+        dfa_node_t *existing = FindDfaState(states, nfaSet);
+        if (existing)
+        {
+            vec_push(&dfa->starts, existing->index);
+            continue;
+        }
+        start->equivalentNfaIndices = nfaSet;
+        start->index = dfa->nodes.length;
+        vec_push(&dfa->nodes, start);
+        vec_push(&dfa->starts, start->index);
+        AddDfaState(&states, start);
+        bytes += DfaStateBytes(start);
+        vec_push(&stack, start);
+    }
     while (stack.length > 0)
     {
-        char *acceptString;
-        anchor_t anchor;
         dfa_node_t *current = vec_pop(&stack);
-        for (int c = 0; c < 0x80; ++c)
+        bitset_t *moves[DFA_ALPHABET_SIZE];
+        if (nfa->positional)
         {
-            dfa_node_t *nextState;
-            nfaSet = MoveOnChar(nfa, current->equivalentNfaIndices, c);
-            if (nfaSet)
+            MoveOnAllPositions(nfa, current->equivalentNfaIndices, moves, stats);
+        }
+        else
+        {
+            MoveOnAllChars(nfa, current->equivalentNfaIndices, moves, stats);
+        }
+        for (int c = 0; c < DFA_ALPHABET_SIZE; ++c)
+        {
+            nfaSet = moves[c];
+            if (!nfaSet)
             {
-                ComputeEpsilonClosure(nfa, nfaSet, &acceptString, &anchor);
+                continue;
             }
-            if (!nfaSet)
+
+            char *acceptString;
+            anchor_t anchor;
+            size_t rule;
+            size_t fallback;
+            if (nfa->positional)
             {
-                nextState = NULL;
+                SelectAcceptingRule(nfa, nfaSet, &acceptString, &anchor, &rule, &fallback);
             }
             else
             {
-                nextState = FindDfaState(dfa, nfaSet);
-                if (!nextState)
-                {
-                    nextState = GC_malloc(sizeof(dfa_node_t));
-                    DfaNodeInit(nextState);
-                    nextState->equivalentNfaIndices = nfaSet;
-                    nextState->acceptString = acceptString;
-                    nextState->anchor = anchor;
-                    vec_push(&dfa->nodes, nextState);
-                }
+                ComputeEpsilonClosure(nfa, nfaSet, &acceptString, &anchor, &rule, &fallback,
+                                      stats);
+            }
+            dfa_node_t *nextState = FindDfaState(states, nfaSet);
+            if (!nextState)
+            {
+                nextState = GC_malloc(sizeof(dfa_node_t));
+                DfaNodeInit(nextState);
+                nextState->equivalentNfaIndices = nfaSet;
+                nextState->acceptString = acceptString;
+                nextState->anchor = anchor;
+                nextState->rule = rule;
+                nextState->fallback = fallback;
+                nextState->index = dfa->nodes.length;
+                vec_push(&dfa->nodes, nextState);
+                vec_push(&stack, nextState);
+                AddDfaState(&states, nextState);
+                bytes += DfaStateBytes(nextState);
             }
-            dfa_node_edge_t *edge = GC_malloc(sizeof(dfa_node_edge_t));
-            edge->id = c;
-            edge->ptr = nextState;
-            HASH_ADD(hh, current->edges, id, sizeof(char), edge);
+            DfaNodeAddEdge(current, c, nextState);
+            bytes += sizeof(dfa_node_edge_t);
+        }
+        if (OverBudget(budget, dfa->nodes.length, bytes))
+        {
+            vec_deinit(&stack);
+            DescribeOverflow(nfa, dfa, bytes, overflow);
+            LexStatsCount(stats, LEX_COUNTER_DFA_STATES, dfa->nodes.length);
+            return NULL;
         }
     }
+    vec_deinit(&stack);
+    LexStatsCount(stats, LEX_COUNTER_DFA_STATES, dfa->nodes.length);
+    LexStatsCount(stats, LEX_COUNTER_BITSETS, dfa->nodes.length);
     return dfa;
 }
 
-static void ComputeEpsilonClosure(nfa_t *nfa, bitset_t *set, char **accept, anchor_t *anchor)
+dfa_t *MinimizeDfa(dfa_t *dfa, lex_stats_t *stats)
 {
+    size_t count = dfa->nodes.length;
+    size_t *group = GC_malloc_atomic(count * sizeof(size_t));
+    size_t groupCount = 0;
+    dfa_signature_t *signatures = NULL;
+    for (size_t i = 0; i < count; ++i)
+    {
+        dfa_node_t *node = dfa->nodes.data[i];
+        size_t *key = GC_malloc_atomic(3 * sizeof(size_t));
+        key[0] = node->acceptString ? node->rule + 1 : 0;
+        key[1] = node->anchor;
+        key[2] = node->fallback;
+        group[i] = AssignGroup(&signatures, key, 3, &groupCount);
+    }
+
+    // Bytes whose columns are identical in every state always split groups the
+    // same way, so refinement only needs one representative byte per column.
+    size_t *successor = GC_malloc_atomic(DFA_ALPHABET_SIZE * count * sizeof(size_t));
+    int representatives[DFA_ALPHABET_SIZE];
+    size_t classCount = 0;
+    dfa_signature_t *columns = NULL;
+    for (int c = 0; c < DFA_ALPHABET_SIZE; ++c)
+    {
+        size_t *column = successor + c * count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            dfa_node_t *next = DfaNodeFollowEdge(dfa->nodes.data[i], c);
+            column[i] = next ? next->index + 1 : 0;
+        }
+        size_t previousCount = classCount;
+        AssignGroup(&columns, column, count, &classCount);
+        if (classCount > previousCount)
+        {
+            representatives[previousCount] = c;
+        }
+    }
+
+    // Split groups until every member of a group moves into the same groups
+    // on every input symbol; a dead transition counts as its own group.
+    size_t keyLength = classCount + 1;
+    for (;;)
+    {
+        size_t *nextGroup = GC_malloc_atomic(count * sizeof(size_t));
+        size_t *keys = GC_malloc_atomic(count * keyLength * sizeof(size_t));
+        size_t nextGroupCount = 0;
+        signatures = NULL;
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t *key = keys + i * keyLength;
+            key[0] = group[i];
+            for (size_t k = 0; k < classCount; ++k)
+            {
+                size_t next = successor[representatives[k] * count + i];
+                key[k + 1] = next ? group[next - 1] + 1 : 0;
+            }
+            nextGroup[i] = AssignGroup(&signatures, key, keyLength, &nextGroupCount);
+        }
+        group = nextGroup;
+        if (nextGroupCount == groupCount)
+        {
+            break;
+        }
+        groupCount = nextGroupCount;
+    }
+
+    dfa_t *minimized = GC_malloc(sizeof(dfa_t));
+    vec_init(&minimized->nodes);
+    for (size_t i = 0; i < groupCount; ++i)
+    {
+        dfa_node_t *node = GC_malloc(sizeof(dfa_node_t));
+        DfaNodeInit(node);
+        node->index = i;
+        vec_push(&minimized->nodes, node);
+    }
+    bitset_t *filled = bitset_create();
+    LexStatsCount(stats, LEX_COUNTER_BITSETS, groupCount + 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+        dfa_node_t *node = dfa->nodes.data[i];
+        dfa_node_t *merged = minimized->nodes.data[group[i]];
+        bitset_inplace_union(merged->equivalentNfaIndices, node->equivalentNfaIndices);
+        if (bitset_get(filled, group[i]))
+        {
+            continue;
+        }
+        bitset_set(filled, group[i]);
+        merged->acceptString = node->acceptString;
+        merged->anchor = node->anchor;
+        merged->rule = node->rule;
+        merged->fallback = node->fallback;
+        for (int c = 0; c < DFA_ALPHABET_SIZE; ++c)
+        {
+            dfa_node_t *next = DfaNodeFollowEdge(node, c);
+            if (next)
+            {
+                DfaNodeAddEdge(merged, c, minimized->nodes.data[group[next->index]]);
+            }
+        }
+    }
+    vec_init(&minimized->starts);
+    size_t start;
+    int condition;
+    vec_foreach(&dfa->starts, start, condition)
+    {
+        vec_push(&minimized->starts, group[start]);
+    }
+    LexStatsCount(stats, LEX_COUNTER_MINIMIZED_STATES, minimized->nodes.length);
+    return minimized;
+}
+
+static size_t AssignGroup(dfa_signature_t **signatures, size_t *key, size_t keyLength,
+                          size_t *groupCount)
+{
+    dfa_signature_t *signature;
+    HASH_FIND(hh, *signatures, key, keyLength * sizeof(size_t), signature);
+    if (!signature)
+    {
+        signature = GC_malloc(sizeof(dfa_signature_t));
+        signature->key = key;
+        signature->group = (*groupCount)++;
+        HASH_ADD_KEYPTR(hh, *signatures, signature->key, keyLength * sizeof(size_t), signature);
+    }
+    return signature->group;
+}
+
+static void ComputeEpsilonClosure(nfa_t *nfa, bitset_t *set, char **accept, anchor_t *anchor,
+                                  size_t *rule, size_t *fallback, lex_stats_t *stats)
+{
+    LexStatsCount(stats, LEX_COUNTER_CLOSURES, 1);
     vec_int_t stack;
     vec_init(&stack);
     *accept = NULL;
-    int acceptNum = -1;
+    *anchor = ANCHOR_NONE;
+    *rule = 0;
+    *fallback = SIZE_MAX;
     for (int c = 0; c < nfa->nodes.length; ++c)
     {
         if (bitset_get(set, c))
@@ -103,63 +326,233 @@ static void ComputeEpsilonClosure(nfa_t *nfa, bitset_t *set, char **accept, anch
     {
         int i = vec_pop(&stack);
         nfa_node_t *p = nfa->nodes.data[i];
-        if (p->acceptString && (i < acceptNum || acceptNum == -1))
-        {
-            acceptNum = i;
-            *accept = p->acceptString;
-            *anchor = p->anchor;
-        }
+        ConsiderAccepting(p, accept, anchor, rule, fallback);
 
         if (p->edge == EDGE_EPSILON)
         {
-            for (int i = 0; i < 2; ++i)
+            for (int j = 0; j < 2; ++j)
             {
-                if (p->next[i])
+                if (p->next[j])
                 {
-                    i = p->next[i]->index;
-                    if (!bitset_get(set, i))
+                    size_t next = p->next[j]->index;
+                    if (!bitset_get(set, next))
                     {
-                        bitset_set(set, i);
-                        vec_push(&stack, i);
+                        bitset_set(set, next);
+                        vec_push(&stack, next);
                     }
                 }
             }
         }
     }
+    vec_deinit(&stack);
+    if (!(*anchor & ANCHOR_LINE_END))
+    {
+        *fallback = SIZE_MAX;
+    }
 }
 
-static bitset_t *MoveOnChar(nfa_t *nfa, bitset_t *set, char c)
+// Computes the successor set for every byte in one pass over the members of
+// set; moves[c] is NULL when no member has an edge on c.
+static void MoveOnAllChars(nfa_t *nfa, bitset_t *set, bitset_t **moves, lex_stats_t *stats)
 {
-    bitset_t *outset = NULL;
-    for (int i = 0; i < nfa->nodes.length; ++i)
+    memset(moves, 0, DFA_ALPHABET_SIZE * sizeof(bitset_t *));
+    for (size_t i = 0; nextSetBit(set, &i); ++i)
     {
-        if (bitset_get(set, i))
+        nfa_node_t *p = nfa->nodes.data[i];
+        if (p->edge == EDGE_EPSILON || p->edge == EDGE_EMPTY)
         {
-            nfa_node_t *p = nfa->nodes.data[i];
-            if (p->edge == c ||
-                (p->edge == EDGE_CHARACTER_CLASS && bitset_get(p->characterClass, c)))
+            continue;
+        }
+        for (int c = 0; c < DFA_ALPHABET_SIZE; ++c)
+        {
+            if (!NfaEdgeMatches(p, c))
             {
-                if (!outset)
-                {
-                    outset = bitset_create();
-                }
-                bitset_set(outset, p->index);
+                continue;
+            }
+            if (!moves[c])
+            {
+                moves[c] = bitset_create();
+                LexStatsCount(stats, LEX_COUNTER_BITSETS, 1);
             }
+            bitset_set(moves[c], p->next[0]->index);
         }
     }
-    return outset;
 }
 
-static dfa_node_t *FindDfaState(dfa_t *dfa, bitset_t *stateSet)
+// A position set is already closed: its rule is the earliest any member
+// accepts.
+static void SelectAcceptingRule(nfa_t *nfa, bitset_t *set, char **accept, anchor_t *anchor,
+                                size_t *rule, size_t *fallback)
 {
-    dfa_node_t *node;
-    int i;
-    vec_foreach(&dfa->nodes, node, i)
+    *accept = NULL;
+    *anchor = ANCHOR_NONE;
+    *rule = 0;
+    *fallback = SIZE_MAX;
+    for (size_t i = 0; nextSetBit(set, &i); ++i)
+    {
+        ConsiderAccepting(nfa->nodes.data[i], accept, anchor, rule, fallback);
+    }
+    if (!(*anchor & ANCHOR_LINE_END))
+    {
+        *fallback = SIZE_MAX;
+    }
+}
+
+// Keeps the earliest rule accepting so far in *rule and the earliest without
+// a trailing $ in *fallback, which the callers clear unless *rule has one.
+static void ConsiderAccepting(const nfa_node_t *p, char **accept, anchor_t *anchor, size_t *rule,
+                              size_t *fallback)
+{
+    if (!p->acceptString)
+    {
+        return;
+    }
+    if (!*accept || p->rule < *rule)
+    {
+        *accept = p->acceptString;
+        *anchor = p->anchor;
+        *rule = p->rule;
+    }
+    if (!(p->anchor & ANCHOR_LINE_END) && p->rule < *fallback)
+    {
+        *fallback = p->rule;
+    }
+}
+
+// The positions that can follow any member are gathered first, so each is
+// tested against the alphabet once however many members it follows; the move
+// on c is then every candidate whose edge matches c, recorded by its
+// representative so that interchangeable positions make one state.
+static void MoveOnAllPositions(nfa_t *nfa, bitset_t *set, bitset_t **moves, lex_stats_t *stats)
+{
+    memset(moves, 0, DFA_ALPHABET_SIZE * sizeof(bitset_t *));
+    bitset_t *candidates = bitset_create();
+    for (size_t i = 0; nextSetBit(set, &i); ++i)
+    {
+        bitset_inplace_union(candidates, nfa->nodes.data[i]->follow);
+    }
+    for (size_t i = 0; nextSetBit(candidates, &i); ++i)
+    {
+        nfa_node_t *p = nfa->nodes.data[i];
+        for (int c = 0; c < DFA_ALPHABET_SIZE; ++c)
+        {
+            if (!NfaEdgeMatches(p, c))
+            {
+                continue;
+            }
+            if (!moves[c])
+            {
+                moves[c] = bitset_create();
+                LexStatsCount(stats, LEX_COUNTER_BITSETS, 1);
+            }
+            bitset_set(moves[c], p->representative);
+        }
+    }
+    bitset_free(candidates);
+}
+
+static size_t StateKeyLength(const bitset_t *stateSet)
+{
+    size_t words = stateSet->arraysize;
+    while (words > 0 && stateSet->array[words - 1] == 0)
+    {
+        --words;
+    }
+    return words * sizeof(uint64_t);
+}
+
+static dfa_node_t *FindDfaState(dfa_state_entry_t *states, bitset_t *stateSet)
+{
+    dfa_state_entry_t *entry;
+    HASH_FIND(hh, states, stateSet->array, StateKeyLength(stateSet), entry);
+    return entry ? entry->node : NULL;
+}
+
+static void AddDfaState(dfa_state_entry_t **states, dfa_node_t *node)
+{
+    dfa_state_entry_t *entry = GC_malloc(sizeof(dfa_state_entry_t));
+    entry->node = node;
+    bitset_t *stateSet = node->equivalentNfaIndices;
+    HASH_ADD_KEYPTR(hh, *states, stateSet->array, StateKeyLength(stateSet), entry);
+}
+
+static size_t DfaStateBytes(const dfa_node_t *node)
+{
+    return sizeof(dfa_node_t) + sizeof(dfa_state_entry_t) +
+           node->equivalentNfaIndices->arraysize * sizeof(uint64_t);
+}
+
+static bool OverBudget(const dfa_budget_t *budget, size_t states, size_t bytes)
+{
+    return budget && ((budget->maxStates && states > budget->maxStates) ||
+                      (budget->maxBytes && bytes > budget->maxBytes));
+}
+
+// Splits each state's NFA set by rule and counts, per rule, the distinct
+// pieces seen. A rule that is merely alive in many states (an identifier loop,
+// say) contributes the same few pieces to all of them, while a rule whose own
+// nodes combine in many ways is what multiplies the states.
+static void DescribeOverflow(nfa_t *nfa, dfa_t *dfa, size_t bytes, dfa_overflow_t *overflow)
+{
+    overflow->states = dfa->nodes.length;
+    overflow->bytes = bytes;
+    overflow->ruleStates = GC_malloc_atomic(nfa->ruleCount * sizeof(size_t));
+    memset(overflow->ruleStates, 0, nfa->ruleCount * sizeof(size_t));
+    size_t *first = GC_malloc_atomic(nfa->ruleCount * sizeof(size_t));
+    size_t *last = GC_malloc_atomic(nfa->ruleCount * sizeof(size_t));
+    size_t *next = GC_malloc_atomic(nfa->nodes.length * sizeof(size_t));
+    dfa_signature_t *pieces = NULL;
+    for (int s = 0; s < dfa->nodes.length; ++s)
     {
-        if (bitsets_equal(node->equivalentNfaIndices, stateSet))
+        // Chain each rule's members in index order, then key each chain by its
+        // rule followed by its members.
+        bitset_t *set = dfa->nodes.data[s]->equivalentNfaIndices;
+        memset(first, 0xFF, nfa->ruleCount * sizeof(size_t));
+        size_t members = 0;
+        for (size_t i = 0; nextSetBit(set, &i); ++i)
+        {
+            // The positional start nodes sit outside every rule.
+            if (nfa->positional && i < (size_t)nfa->starts.length)
+            {
+                continue;
+            }
+            size_t rule = nfa->nodes.data[i]->rule;
+            if (first[rule] == SIZE_MAX)
+            {
+                first[rule] = i;
+            }
+            else
+            {
+                next[last[rule]] = i;
+            }
+            last[rule] = i;
+            next[i] = SIZE_MAX;
+            ++members;
+        }
+        size_t *keys = GC_malloc_atomic((members + nfa->ruleCount) * sizeof(size_t));
+        for (size_t rule = 0; rule < nfa->ruleCount; ++rule)
         {
-            return node;
+            if (first[rule] == SIZE_MAX)
+            {
+                continue;
+            }
+            size_t *key = keys;
+            *keys++ = rule;
+            for (size_t i = first[rule]; i != SIZE_MAX; i = next[i])
+            {
+                *keys++ = i;
+            }
+            size_t keyLength = (keys - key) * sizeof(size_t);
+            dfa_signature_t *piece;
+            HASH_FIND(hh, pieces, key, keyLength, piece);
+            if (!piece)
+            {
+                piece = GC_malloc(sizeof(dfa_signature_t));
+                piece->key = key;
+                piece->group = rule;
+                HASH_ADD_KEYPTR(hh, pieces, piece->key, keyLength, piece);
+                ++overflow->ruleStates[rule];
+            }
         }
     }
-    return NULL;
 }
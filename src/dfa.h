@@ -9,9 +9,12 @@
 #include <uthash.h>
 #include <vec.h>
 
+// Input symbols explored during subset construction.
+#define DFA_ALPHABET_SIZE 0x100
+
 typedef struct
 {
-    char id;
+    unsigned char id;
     struct DFA_NODE *ptr;
     UT_hash_handle hh;
 } dfa_node_edge_t;
@@ -21,20 +24,50 @@ typedef struct DFA_NODE
     dfa_node_edge_t *edges;
     char *acceptString;
     anchor_t anchor;
+    size_t rule;
+    // When rule ends in $, the earliest rule without one that also accepts,
+    // for when the next byte does not end a line; otherwise SIZE_MAX.
+    size_t fallback;
+    size_t index;
     bitset_t *equivalentNfaIndices;
 } dfa_node_t;
 
 typedef vec_t(dfa_node_t *) vec_dfa_node_t;
 
+// starts[i] indexes the entry state for the NFA's starts[i].
 typedef struct
 {
     vec_dfa_node_t nodes;
-    size_t start;
+    vec_size_t starts;
 } dfa_t;
 
+// Limits on subset construction; zero leaves a limit off. Bytes count the
+// memory construction itself holds: states, their NFA sets and their edges.
+typedef struct
+{
+    size_t maxStates;
+    size_t maxBytes;
+} dfa_budget_t;
+
+// What construction had built when it gave up. ruleStates[r] counts the
+// distinct sets of rule r's NFA nodes found among the states, which is large
+// for the rules whose nodes combine in the most ways.
+typedef struct
+{
+    size_t states;
+    size_t bytes;
+    size_t *ruleStates;
+} dfa_overflow_t;
+
 void DfaNodeInit(dfa_node_t *node);
-void DfaNodeAddEdge(dfa_node_t *node, char id, dfa_node_t *ptr);
-dfa_node_t *DfaNodeFollowEdge(dfa_node_t *node, char id);
-dfa_t *ConstructDfa(nfa_t *nfa);
+void DfaNodeAddEdge(dfa_node_t *node, unsigned char id, dfa_node_t *ptr);
+dfa_node_t *DfaNodeFollowEdge(dfa_node_t *node, unsigned char id);
+// Returns NULL, filling in *overflow, once the DFA passes either limit of a
+// non-NULL budget.
+dfa_t *ConstructDfa(nfa_t *nfa, const dfa_budget_t *budget, dfa_overflow_t *overflow,
+                    lex_stats_t *stats);
+// Merges equivalent states (same accepting rules, transitions into the same
+// groups) and returns a new automaton; the input is left untouched.
+dfa_t *MinimizeDfa(dfa_t *dfa, lex_stats_t *stats);
 
 #endif // LEX_DFA_H
@@ -0,0 +1,379 @@
+#include "emit.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifndef LEX_VERSION
+#define LEX_VERSION "unknown"
+#endif
+
+static void EmitArray(FILE *out, const char *type, const char *name, const uint32_t *values,
+                      size_t count);
+static void EmitRuntime(FILE *out, const dfa_tables_t *tables);
+static void EmitKeywords(FILE *out, const keyword_table_t *keywords);
+
+static const char sRuntimeHeader[] = "#include <stdint.h>\n"
+                                     "#include <stdio.h>\n"
+                                     "#include <stdlib.h>\n"
+                                     "#include <string.h>\n"
+                                     "\n"
+                                     "#define YY_NO_RULE 0xFFFFFFFFu\n"
+                                     "#define YY_ANCHOR_LINE_END 2\n"
+                                     "#define YY_TRAIL_FIXED_TRAIL 1\n"
+                                     "#define YY_TRAIL_FIXED_HEAD 2\n"
+                                     "#define ECHO fwrite(yytext, 1, yyleng, yyout)\n"
+                                     "#define BEGIN yy_start_condition =\n"
+                                     "#define YY_START yy_start_condition\n"
+                                     "\n";
+
+// Compiled with YY_PROFILE defined, the scanner counts state visits and
+// transitions as dfa_profile_t does and writes them in its text form when the
+// program exits, to the file YY_PROFILE_FILE names or lex.profile, numbering
+// states by yy_profile_state. Otherwise the hooks expand to nothing.
+static const char sProfileRuntime[] =
+    "static unsigned long long yy_profile_visits[YY_STATE_COUNT];\n"
+    "static unsigned long long yy_profile_transitions[YY_STATE_COUNT * YY_CLASS_COUNT];\n"
+    "\n"
+    "static void yy_write_profile(void)\n"
+    "{\n"
+    "    const char *path = getenv(\"YY_PROFILE_FILE\");\n"
+    "    FILE *file = fopen(path ? path : \"lex.profile\", \"w\");\n"
+    "    if (!file)\n"
+    "    {\n"
+    "        return;\n"
+    "    }\n"
+    "    unsigned by_number[YY_STATE_COUNT];\n"
+    "    for (unsigned s = 0; s < YY_STATE_COUNT; ++s)\n"
+    "    {\n"
+    "        by_number[yy_profile_state[s]] = s;\n"
+    "    }\n"
+    "    fprintf(file, \"lex profile 2 %u %u\\n\", YY_STATE_COUNT, YY_CLASS_COUNT);\n"
+    "    for (unsigned n = 0; n < YY_STATE_COUNT; ++n)\n"
+    "    {\n"
+    "        if (yy_profile_visits[by_number[n]])\n"
+    "        {\n"
+    "            fprintf(file, \"v %u %llu\\n\", n, yy_profile_visits[by_number[n]]);\n"
+    "        }\n"
+    "    }\n"
+    "    for (unsigned n = 0; n < YY_STATE_COUNT; ++n)\n"
+    "    {\n"
+    "        for (unsigned k = 0; k < YY_CLASS_COUNT; ++k)\n"
+    "        {\n"
+    "            unsigned long long count =\n"
+    "                yy_profile_transitions[by_number[n] * YY_CLASS_COUNT + k];\n"
+    "            if (count)\n"
+    "            {\n"
+    "                fprintf(file, \"t %u %u %llu\\n\", n, k, count);\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    fclose(file);\n"
+    "}\n"
+    "\n"
+    "#define YY_PROFILE_START() atexit(yy_write_profile)\n"
+    "#define YY_PROFILE_VISIT(s) ++yy_profile_visits[s]\n"
+    "#define YY_PROFILE_TRANSITION(cell) ++yy_profile_transitions[cell]\n"
+    "#else\n"
+    "#define YY_PROFILE_START()\n"
+    "#define YY_PROFILE_VISIT(s)\n"
+    "#define YY_PROFILE_TRANSITION(cell)\n"
+    "#endif\n"
+    "\n";
+
+// The whole input is read up front and scanned in place; yytext points into
+// that buffer and the byte after the token is saved and replaced by a NUL
+// while the action runs.
+static const char sRuntimeBody[] =
+    "FILE *yyin;\n"
+    "FILE *yyout;\n"
+    "char *yytext;\n"
+    "size_t yyleng;\n"
+    "\n"
+    "static char *yy_buffer;\n"
+    "static size_t yy_buffer_length;\n"
+    "static size_t yy_position;\n"
+    "static char yy_hold_char;\n"
+    "static int yy_at_bol = 1;\n"
+    "static int yy_start_condition;\n"
+    "\n"
+    "static void yy_load_buffer(void)\n"
+    "{\n"
+    "    size_t capacity = 4096;\n"
+    "    size_t n;\n"
+    "    if (!yyin)\n"
+    "    {\n"
+    "        yyin = stdin;\n"
+    "    }\n"
+    "    if (!yyout)\n"
+    "    {\n"
+    "        yyout = stdout;\n"
+    "    }\n"
+    "    yy_buffer = malloc(capacity + 1);\n"
+    "    while (yy_buffer && (n = fread(yy_buffer + yy_buffer_length, 1,\n"
+    "                                   capacity - yy_buffer_length, yyin)) > 0)\n"
+    "    {\n"
+    "        yy_buffer_length += n;\n"
+    "        if (yy_buffer_length == capacity)\n"
+    "        {\n"
+    "            capacity *= 2;\n"
+    "            yy_buffer = realloc(yy_buffer, capacity + 1);\n"
+    "        }\n"
+    "    }\n"
+    "    if (!yy_buffer)\n"
+    "    {\n"
+    "        fprintf(stderr, \"scanner out of memory\\n\");\n"
+    "        exit(2);\n"
+    "    }\n"
+    "    yy_buffer[yy_buffer_length] = '\\0';\n"
+    "    YY_PROFILE_START();\n"
+    "}\n"
+    "\n"
+    "int yylex(void)\n"
+    "{\n"
+    "    if (!yy_buffer)\n"
+    "    {\n"
+    "        yy_load_buffer();\n"
+    "    }\n"
+    "    while (yy_position < yy_buffer_length)\n"
+    "    {\n"
+    "        if (yytext)\n"
+    "        {\n"
+    "            yytext[yyleng] = yy_hold_char;\n"
+    "        }\n"
+    "        const unsigned char *start = (const unsigned char *)yy_buffer + yy_position;\n"
+    "        size_t remaining = yy_buffer_length - yy_position;\n"
+    "        uint32_t state = yy_condition_start[2 * yy_start_condition + yy_at_bol];\n"
+    "        uint32_t rule = YY_NO_RULE;\n"
+    "        size_t length = 0;\n"
+    "        YY_PROFILE_VISIT(state);\n"
+    "        for (size_t i = 0; i < remaining; ++i)\n"
+    "        {\n"
+    "            size_t cell = state * YY_CLASS_COUNT + yy_ec[start[i]];\n"
+    "            YY_PROFILE_TRANSITION(cell);\n"
+    "            state = yy_nxt[cell];\n"
+    "            if (state == 0)\n"
+    "            {\n"
+    "                break;\n"
+    "            }\n"
+    "            YY_PROFILE_VISIT(state);\n"
+    "            uint32_t accepted = yy_accept[state];\n"
+    "            if (accepted != YY_NO_RULE && (yy_rule_anchor[accepted] & YY_ANCHOR_LINE_END) &&\n"
+    "                i + 1 < remaining && start[i + 1] != '\\n' && start[i + 1] != '\\r')\n"
+    "            {\n"
+    "                accepted = yy_fallback[state];\n"
+    "            }\n"
+    "            if (accepted != YY_NO_RULE)\n"
+    "            {\n"
+    "                rule = accepted;\n"
+    "                length = i + 1;\n"
+    "                if (yy_rule_trail[accepted] == YY_TRAIL_FIXED_TRAIL)\n"
+    "                {\n"
+    "                    length -= yy_rule_fixed_length[accepted];\n"
+    "                }\n"
+    "                else if (yy_rule_trail[accepted] == YY_TRAIL_FIXED_HEAD)\n"
+    "                {\n"
+    "                    length = yy_rule_fixed_length[accepted];\n"
+    "                }\n"
+    "            }\n"
+    "        }\n"
+    "        if (length == 0)\n"
+    "        {\n"
+    "            rule = YY_NO_RULE;\n"
+    "            length = 1;\n"
+    "        }\n";
+
+// Takes the token's action, once any keyword check has run.
+static const char sRuntimeDispatch[] =
+    "        yytext = (char *)start;\n"
+    "        yyleng = length;\n"
+    "        yy_position += length;\n"
+    "        yy_at_bol = yytext[yyleng - 1] == '\\n';\n"
+    "        yy_hold_char = yytext[yyleng];\n"
+    "        yytext[yyleng] = '\\0';\n"
+    "        switch (rule)\n"
+    "        {\n";
+
+bool EmitScanner(const dfa_tables_t *tables, const lex_spec_t *spec, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        return false;
+    }
+
+    fprintf(out, "/* Generated by lex %s. */\n", LEX_VERSION);
+    fputs(spec->prologue, out);
+    fputs(sRuntimeHeader, out);
+    EmitRuntime(out, tables);
+    fputs(spec->epilogue, out);
+    bool ok = !ferror(out);
+    return fclose(out) == 0 && ok;
+}
+
+static void EmitArray(FILE *out, const char *type, const char *name, const uint32_t *values,
+                      size_t count)
+{
+    fprintf(out, "static const %s %s[%zu] = {", type, name, count ? count : 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+        fprintf(out, "%s%u,", i % 12 == 0 ? "\n    " : " ", values[i]);
+    }
+    fputs(count ? "\n};\n\n" : "0};\n\n", out);
+}
+
+static void EmitRuntime(FILE *out, const dfa_tables_t *tables)
+{
+    fprintf(out, "#define YY_STATE_COUNT %u\n", tables->stateCount);
+    fprintf(out, "#define YY_CLASS_COUNT %u\n", tables->classCount);
+    uint32_t *starts = GC_malloc_atomic(2 * tables->conditionCount * sizeof(uint32_t));
+    for (uint32_t c = 0; c < tables->conditionCount; ++c)
+    {
+        const lex_condition_info_t *condition = &tables->conditions[c];
+        fprintf(out, "#define %.*s %u\n", (int)condition->nameLength,
+                tables->strings + condition->nameOffset, c);
+        starts[2 * c] = condition->start;
+        starts[2 * c + 1] = condition->lineStart;
+    }
+    fputc('\n', out);
+
+    uint32_t classMap[LEX_BYTE_COUNT];
+    for (int c = 0; c < LEX_BYTE_COUNT; ++c)
+    {
+        classMap[c] = tables->classMap[c];
+    }
+    EmitArray(out, "uint8_t", "yy_ec", classMap, LEX_BYTE_COUNT);
+    // yy_nxt keeps the tables' transition width.
+    const size_t cells = (size_t)tables->stateCount * tables->classCount;
+    uint32_t *transitions = GC_malloc_atomic(cells * sizeof(uint32_t));
+    for (uint32_t s = 0; s < tables->stateCount; ++s)
+    {
+        for (uint32_t k = 0; k < tables->classCount; ++k)
+        {
+            transitions[(size_t)s * tables->classCount + k] = DfaTransition(tables, s, k);
+        }
+    }
+    const char *transitionType = tables->transitionWidth == 1   ? "uint8_t"
+                                 : tables->transitionWidth == 2 ? "uint16_t"
+                                                                : "uint32_t";
+    EmitArray(out, transitionType, "yy_nxt", transitions, cells);
+    EmitArray(out, "uint32_t", "yy_accept", tables->accept, tables->stateCount);
+    EmitArray(out, "uint32_t", "yy_fallback", tables->fallback, tables->stateCount);
+    EmitArray(out, "uint32_t", "yy_condition_start", starts, 2 * tables->conditionCount);
+    uint32_t *anchors = GC_malloc_atomic((tables->ruleCount + 1) * sizeof(uint32_t));
+    uint32_t *trails = GC_malloc_atomic((tables->ruleCount + 1) * sizeof(uint32_t));
+    uint32_t *fixedLengths = GC_malloc_atomic((tables->ruleCount + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < tables->ruleCount; ++i)
+    {
+        anchors[i] = tables->rules[i].anchor;
+        trails[i] = tables->rules[i].trail;
+        fixedLengths[i] = tables->rules[i].fixedLength;
+    }
+    EmitArray(out, "uint8_t", "yy_rule_anchor", anchors, tables->ruleCount);
+    EmitArray(out, "uint8_t", "yy_rule_trail", trails, tables->ruleCount);
+    EmitArray(out, "uint32_t", "yy_rule_fixed_length", fixedLengths, tables->ruleCount);
+
+    fputs("#ifdef YY_PROFILE\n", out);
+    EmitArray(out, "uint32_t", "yy_profile_state", NumberStatesCanonically(tables),
+              tables->stateCount);
+    fputs(sProfileRuntime, out);
+    if (tables->keywords)
+    {
+        EmitKeywords(out, tables->keywords);
+    }
+    fputs(sRuntimeBody, out);
+    if (tables->keywords)
+    {
+        fputs("        else if (rule == YY_KEYWORD_RULE)\n"
+              "        {\n"
+              "            rule = yy_keyword(start, length);\n"
+              "        }\n",
+              out);
+    }
+    fputs(sRuntimeDispatch, out);
+    for (uint32_t i = 0; i < tables->ruleCount; ++i)
+    {
+        const lex_rule_info_t *rule = &tables->rules[i];
+        fprintf(out, "        case %u:\n            %.*s\n            break;\n", i,
+                (int)rule->actionLength, tables->strings + rule->actionOffset);
+    }
+    for (uint32_t k = 0; tables->keywords && k < tables->keywords->count; ++k)
+    {
+        const lex_keyword_info_t *keyword = &tables->keywords->keywords[k];
+        fprintf(out, "        case %u:\n            %.*s\n            break;\n",
+                tables->keywords->firstRule + k, (int)keyword->actionLength,
+                tables->keywords->strings + keyword->actionOffset);
+    }
+    fputs("        default:\n"
+          "            ECHO;\n"
+          "            break;\n"
+          "        }\n"
+          "    }\n"
+          "    return 0;\n"
+          "}\n",
+          out);
+}
+
+// yy_keyword hashes a match of the keyword rule as FindKeyword does and
+// returns the rule of the keyword it is, or the keyword rule itself.
+static void EmitKeywords(FILE *out, const keyword_table_t *keywords)
+{
+    fprintf(out, "#define YY_KEYWORD_RULE %u\n", keywords->rule);
+    fprintf(out, "#define YY_KEYWORD_FIRST_RULE %u\n", keywords->firstRule);
+    fprintf(out, "#define YY_KEYWORD_SEED %uu\n", keywords->seed);
+    fprintf(out, "#define YY_KEYWORD_BUCKET_COUNT %u\n", keywords->bucketCount);
+    fprintf(out, "#define YY_KEYWORD_SHIFT %u\n", 32 - keywords->slotBits);
+    fputs(keywords->caseless ? "#define YY_KEYWORD_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? "
+                               "(c) - 'A' + 'a' : (c))\n\n"
+                             : "#define YY_KEYWORD_FOLD(c) (c)\n\n",
+          out);
+
+    // The words alone, back to back; the actions go into the switch.
+    uint32_t *offsets = GC_malloc_atomic(keywords->count * sizeof(uint32_t));
+    uint32_t *lengths = GC_malloc_atomic(keywords->count * sizeof(uint32_t));
+    uint32_t *text = GC_malloc_atomic(keywords->stringsSize * sizeof(uint32_t));
+    uint32_t textSize = 0;
+    for (uint32_t k = 0; k < keywords->count; ++k)
+    {
+        const lex_keyword_info_t *keyword = &keywords->keywords[k];
+        offsets[k] = textSize;
+        lengths[k] = keyword->textLength;
+        for (uint32_t i = 0; i < keyword->textLength; ++i)
+        {
+            text[textSize++] = (unsigned char)keywords->strings[keyword->textOffset + i];
+        }
+    }
+    EmitArray(out, "uint32_t", "yy_keyword_displacement", keywords->displacements,
+              keywords->bucketCount);
+    EmitArray(out, "uint32_t", "yy_keyword_slot", keywords->slots,
+              (size_t)1 << keywords->slotBits);
+    EmitArray(out, "uint32_t", "yy_keyword_offset", offsets, keywords->count);
+    EmitArray(out, "uint32_t", "yy_keyword_length", lengths, keywords->count);
+    EmitArray(out, "unsigned char", "yy_keyword_text", text, textSize);
+    fprintf(out,
+            "static uint32_t yy_keyword(const unsigned char *text, size_t length)\n"
+            "{\n"
+            "    uint32_t hash = YY_KEYWORD_SEED;\n"
+            "    for (size_t i = 0; i < length; ++i)\n"
+            "    {\n"
+            "        hash = (hash ^ YY_KEYWORD_FOLD(text[i])) * %uu;\n"
+            "    }\n"
+            "    uint32_t displacement =\n"
+            "        yy_keyword_displacement[hash %% YY_KEYWORD_BUCKET_COUNT];\n"
+            "    uint32_t k =\n"
+            "        yy_keyword_slot[((hash ^ displacement) * 0x%Xu) >> YY_KEYWORD_SHIFT];\n"
+            "    if (k == YY_NO_RULE || yy_keyword_length[k] != length)\n"
+            "    {\n"
+            "        return YY_KEYWORD_RULE;\n"
+            "    }\n"
+            "    const unsigned char *word = yy_keyword_text + yy_keyword_offset[k];\n"
+            "    for (size_t i = 0; i < length; ++i)\n"
+            "    {\n"
+            "        if (YY_KEYWORD_FOLD(text[i]) != word[i])\n"
+            "        {\n"
+            "            return YY_KEYWORD_RULE;\n"
+            "        }\n"
+            "    }\n"
+            "    return YY_KEYWORD_FIRST_RULE + k;\n"
+            "}\n"
+            "\n",
+            KEYWORD_FNV_PRIME, KEYWORD_MULTIPLIER);
+}
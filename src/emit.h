@@ -0,0 +1,14 @@
+#ifndef LEX_EMIT_H
+#define LEX_EMIT_H
+
+#include "spec.h"
+#include "tables.h"
+#include <stdbool.h>
+
+// Writes a self-contained C scanner: the tables as static arrays, a yylex()
+// running each rule's action from the spec, and the spec's own code. The
+// class map covers all 256 byte values, so the inner loop indexes it with
+// the raw input byte and never tests the byte's range.
+bool EmitScanner(const dfa_tables_t *tables, const lex_spec_t *spec, const char *path);
+
+#endif // LEX_EMIT_H
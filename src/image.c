@@ -0,0 +1,317 @@
+#include "image.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+static bool WriteSection(FILE *file, uint64_t *offset, uint64_t target, const void *data,
+                         size_t size);
+static bool SectionInBounds(uint64_t offset, uint64_t size, uint64_t fileSize);
+static bool MapFile(const char *path, lex_image_t *image, const char **error);
+
+bool WriteLexImage(const dfa_tables_t *tables, const char *path)
+{
+    lex_image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LEX_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = LEX_IMAGE_VERSION;
+    header.byteOrder = LEX_IMAGE_BYTE_ORDER;
+    header.stateCount = tables->stateCount;
+    header.classCount = tables->classCount;
+    header.conditionCount = tables->conditionCount;
+    header.ruleCount = tables->ruleCount;
+    header.transitionWidth = tables->transitionWidth;
+
+    size_t transitionsSize =
+        (size_t)tables->stateCount * tables->classCount * tables->transitionWidth;
+    size_t acceptSize = tables->stateCount * sizeof(uint32_t);
+    size_t rulesSize = tables->ruleCount * sizeof(lex_rule_info_t);
+    size_t conditionsSize = tables->conditionCount * sizeof(lex_condition_info_t);
+    header.classMapOffset = ALIGN8(sizeof(header));
+    header.transitionsOffset = ALIGN8(header.classMapOffset + LEX_BYTE_COUNT);
+    header.acceptOffset = ALIGN8(header.transitionsOffset + transitionsSize);
+    header.fallbackOffset = ALIGN8(header.acceptOffset + acceptSize);
+    header.rulesOffset = ALIGN8(header.fallbackOffset + acceptSize);
+    header.conditionsOffset = ALIGN8(header.rulesOffset + rulesSize);
+    header.stringsOffset = ALIGN8(header.conditionsOffset + conditionsSize);
+    header.stringsSize = tables->stringsSize;
+
+    static const keyword_table_t kNoKeywords = {.count = 0};
+    const keyword_table_t *keywords = tables->keywords ? tables->keywords : &kNoKeywords;
+    header.keywordRule = keywords->rule;
+    header.keywordFirstRule = keywords->firstRule;
+    header.keywordCount = keywords->count;
+    header.keywordCaseless = keywords->caseless;
+    header.keywordSeed = keywords->seed;
+    header.keywordBucketCount = keywords->bucketCount;
+    header.keywordSlotBits = keywords->slotBits;
+    header.keywordStringsSize = keywords->stringsSize;
+    size_t keywordsSize = keywords->count * sizeof(lex_keyword_info_t);
+    size_t displacementsSize = keywords->bucketCount * sizeof(uint32_t);
+    size_t slotsSize = keywords->count ? ((size_t)1 << keywords->slotBits) * sizeof(uint32_t) : 0;
+    header.keywordsOffset = ALIGN8(header.stringsOffset + header.stringsSize);
+    header.displacementsOffset = ALIGN8(header.keywordsOffset + keywordsSize);
+    header.slotsOffset = ALIGN8(header.displacementsOffset + displacementsSize);
+    header.keywordStringsOffset = ALIGN8(header.slotsOffset + slotsSize);
+    header.fileSize = header.keywordStringsOffset + header.keywordStringsSize;
+
+    size_t pathLength = strlen(path);
+    char *tempPath = GC_malloc_atomic(pathLength + sizeof(".tmp"));
+    memcpy(tempPath, path, pathLength);
+    memcpy(tempPath + pathLength, ".tmp", sizeof(".tmp"));
+    FILE *file = fopen(tempPath, "wb");
+    if (!file)
+    {
+        return false;
+    }
+
+    uint64_t offset = 0;
+    bool ok = WriteSection(file, &offset, 0, &header, sizeof(header)) &&
+              WriteSection(file, &offset, header.classMapOffset, tables->classMap,
+                           LEX_BYTE_COUNT) &&
+              WriteSection(file, &offset, header.transitionsOffset, tables->transitions,
+                           transitionsSize) &&
+              WriteSection(file, &offset, header.acceptOffset, tables->accept, acceptSize) &&
+              WriteSection(file, &offset, header.fallbackOffset, tables->fallback, acceptSize) &&
+              WriteSection(file, &offset, header.rulesOffset, tables->rules, rulesSize) &&
+              WriteSection(file, &offset, header.conditionsOffset, tables->conditions,
+                           conditionsSize) &&
+              WriteSection(file, &offset, header.stringsOffset, tables->strings,
+                           tables->stringsSize) &&
+              WriteSection(file, &offset, header.keywordsOffset, keywords->keywords,
+                           keywordsSize) &&
+              WriteSection(file, &offset, header.displacementsOffset, keywords->displacements,
+                           displacementsSize) &&
+              WriteSection(file, &offset, header.slotsOffset, keywords->slots, slotsSize) &&
+              WriteSection(file, &offset, header.keywordStringsOffset, keywords->strings,
+                           keywords->stringsSize);
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    if (ok)
+    {
+        remove(path);
+    }
+#endif
+    if (!ok || rename(tempPath, path) != 0)
+    {
+        remove(tempPath);
+        return false;
+    }
+    return true;
+}
+
+bool MapLexImage(const char *path, lex_image_t *image, const char **error)
+{
+    memset(image, 0, sizeof(*image));
+    if (!MapFile(path, image, error))
+    {
+        return false;
+    }
+
+    const lex_image_header_t *header = image->base;
+    *error = NULL;
+    if (image->size < sizeof(lex_image_header_t) ||
+        memcmp(header->magic, LEX_IMAGE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        *error = "not a lex image";
+    }
+    else if (header->version != LEX_IMAGE_VERSION)
+    {
+        *error = "unsupported image version";
+    }
+    else if (header->byteOrder != LEX_IMAGE_BYTE_ORDER)
+    {
+        *error = "image was written with a different byte order";
+    }
+    else if (header->fileSize != image->size || header->stateCount == 0 ||
+             header->conditionCount == 0 || header->classCount == 0 ||
+             header->classCount > LEX_BYTE_COUNT ||
+             (header->transitionWidth != 1 && header->transitionWidth != 2 &&
+              header->transitionWidth != 4) ||
+             (header->transitionWidth < 4 &&
+              header->stateCount > 1u << (8 * header->transitionWidth)) ||
+             (header->keywordCount > 0 &&
+              (header->keywordBucketCount == 0 || header->keywordSlotBits == 0 ||
+               header->keywordSlotBits > 31)))
+    {
+        *error = "corrupt image header";
+    }
+    else if (!SectionInBounds(header->classMapOffset, LEX_BYTE_COUNT, image->size) ||
+             !SectionInBounds(header->transitionsOffset,
+                              (uint64_t)header->stateCount * header->classCount *
+                                  header->transitionWidth,
+                              image->size) ||
+             !SectionInBounds(header->acceptOffset, header->stateCount * sizeof(uint32_t),
+                              image->size) ||
+             !SectionInBounds(header->fallbackOffset, header->stateCount * sizeof(uint32_t),
+                              image->size) ||
+             !SectionInBounds(header->rulesOffset, header->ruleCount * sizeof(lex_rule_info_t),
+                              image->size) ||
+             !SectionInBounds(header->conditionsOffset,
+                              header->conditionCount * sizeof(lex_condition_info_t),
+                              image->size) ||
+             !SectionInBounds(header->stringsOffset, header->stringsSize, image->size) ||
+             !SectionInBounds(header->keywordsOffset,
+                              header->keywordCount * sizeof(lex_keyword_info_t), image->size) ||
+             !SectionInBounds(header->displacementsOffset,
+                              header->keywordBucketCount * sizeof(uint32_t), image->size) ||
+             !SectionInBounds(header->slotsOffset,
+                              header->keywordCount
+                                  ? ((uint64_t)1 << header->keywordSlotBits) * sizeof(uint32_t)
+                                  : 0,
+                              image->size) ||
+             !SectionInBounds(header->keywordStringsOffset, header->keywordStringsSize,
+                              image->size))
+    {
+        *error = "image section out of bounds";
+    }
+    if (*error)
+    {
+        UnmapLexImage(image);
+        return false;
+    }
+
+    const char *base = image->base;
+    dfa_tables_t *tables = &image->tables;
+    tables->stateCount = header->stateCount;
+    tables->classCount = header->classCount;
+    tables->conditionCount = header->conditionCount;
+    tables->ruleCount = header->ruleCount;
+    tables->stringsSize = header->stringsSize;
+    tables->transitionWidth = header->transitionWidth;
+    tables->classMap = (const uint8_t *)(base + header->classMapOffset);
+    tables->transitions = base + header->transitionsOffset;
+    tables->accept = (const uint32_t *)(base + header->acceptOffset);
+    tables->fallback = (const uint32_t *)(base + header->fallbackOffset);
+    tables->rules = (const lex_rule_info_t *)(base + header->rulesOffset);
+    tables->conditions = (const lex_condition_info_t *)(base + header->conditionsOffset);
+    tables->strings = base + header->stringsOffset;
+    if (header->keywordCount > 0)
+    {
+        keyword_table_t *keywords = &image->keywords;
+        keywords->rule = header->keywordRule;
+        keywords->firstRule = header->keywordFirstRule;
+        keywords->count = header->keywordCount;
+        keywords->caseless = header->keywordCaseless;
+        keywords->seed = header->keywordSeed;
+        keywords->bucketCount = header->keywordBucketCount;
+        keywords->slotBits = header->keywordSlotBits;
+        keywords->stringsSize = header->keywordStringsSize;
+        keywords->keywords = (const lex_keyword_info_t *)(base + header->keywordsOffset);
+        keywords->displacements = (const uint32_t *)(base + header->displacementsOffset);
+        keywords->slots = (const uint32_t *)(base + header->slotsOffset);
+        keywords->strings = base + header->keywordStringsOffset;
+        tables->keywords = keywords;
+    }
+    return true;
+}
+
+void UnmapLexImage(lex_image_t *image)
+{
+    if (!image->base)
+    {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(image->base);
+    CloseHandle(image->mapping);
+#else
+    munmap((void *)image->base, image->size);
+#endif
+    memset(image, 0, sizeof(*image));
+}
+
+static bool WriteSection(FILE *file, uint64_t *offset, uint64_t target, const void *data,
+                         size_t size)
+{
+    for (; *offset < target; ++*offset)
+    {
+        if (fputc(0, file) == EOF)
+        {
+            return false;
+        }
+    }
+    if (size > 0 && fwrite(data, size, 1, file) != 1)
+    {
+        return false;
+    }
+    *offset += size;
+    return true;
+}
+
+static bool SectionInBounds(uint64_t offset, uint64_t size, uint64_t fileSize)
+{
+    return offset % 8 == 0 && offset <= fileSize && size <= fileSize - offset;
+}
+
+#ifdef _WIN32
+static bool MapFile(const char *path, lex_image_t *image, const char **error)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        *error = "cannot open image";
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        *error = "cannot determine image size";
+        return false;
+    }
+    image->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!image->mapping)
+    {
+        *error = "cannot map image";
+        return false;
+    }
+    image->base = MapViewOfFile(image->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!image->base)
+    {
+        CloseHandle(image->mapping);
+        *error = "cannot map image";
+        return false;
+    }
+    image->size = size.QuadPart;
+    return true;
+}
+#else
+static bool MapFile(const char *path, lex_image_t *image, const char **error)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        *error = "cannot open image";
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        *error = "cannot determine image size";
+        return false;
+    }
+    void *base = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        *error = "cannot map image";
+        return false;
+    }
+    image->base = base;
+    image->size = info.st_size;
+    return true;
+}
+#endif
@@ -0,0 +1,74 @@
+#ifndef LEX_IMAGE_H
+#define LEX_IMAGE_H
+
+#include "tables.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk form of dfa_tables_t. Every section is stored exactly as the
+// scanner reads it, 8-byte aligned and in host byte order, so a mapped image
+// is used in place and processes mapping the same file share its pages.
+//
+//   header | class map | transitions | accept | fallback | rules | conditions |
+//   strings | keywords | displacements | slots | keyword strings
+//
+// Transitions are transitionWidth bytes each, as in dfa_tables_t. The keyword
+// sections are empty, and keywordCount 0, without %keywords.
+#define LEX_IMAGE_MAGIC "LEXDFA\r\n"
+#define LEX_IMAGE_VERSION 7
+#define LEX_IMAGE_BYTE_ORDER 0x01020304u
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t stateCount;
+    uint32_t classCount;
+    uint32_t conditionCount;
+    uint32_t ruleCount;
+    uint32_t transitionWidth;
+    uint32_t reserved;
+    uint64_t classMapOffset;
+    uint64_t transitionsOffset;
+    uint64_t acceptOffset;
+    uint64_t fallbackOffset;
+    uint64_t rulesOffset;
+    uint64_t conditionsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint32_t keywordRule;
+    uint32_t keywordFirstRule;
+    uint32_t keywordCount;
+    uint32_t keywordCaseless;
+    uint32_t keywordSeed;
+    uint32_t keywordBucketCount;
+    uint32_t keywordSlotBits;
+    uint32_t keywordStringsSize;
+    uint64_t keywordsOffset;
+    uint64_t displacementsOffset;
+    uint64_t slotsOffset;
+    uint64_t keywordStringsOffset;
+    uint64_t fileSize;
+} lex_image_header_t;
+
+typedef struct
+{
+    dfa_tables_t tables;
+    keyword_table_t keywords;
+    const void *base;
+    size_t size;
+    void *mapping;
+} lex_image_t;
+
+// Writes through a temporary file and renames it into place, so processes
+// that still map an older image at the same path keep their pages.
+bool WriteLexImage(const dfa_tables_t *tables, const char *path);
+
+// Images are trusted build outputs: the header and section bounds are
+// checked, the table contents are not. On failure, *error names the problem.
+bool MapLexImage(const char *path, lex_image_t *image, const char **error);
+void UnmapLexImage(lex_image_t *image);
+
+#endif // LEX_IMAGE_H
@@ -0,0 +1,200 @@
+#include "keywords.h"
+#include <gc.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 2166136261u
+// How many displacements a bucket tries before the table grows.
+#define DISPLACEMENT_TRIES 4096
+
+static uint32_t HashKeyword(uint32_t seed, bool caseless, const unsigned char *text,
+                            size_t length);
+static uint32_t SlotOf(uint32_t hash, uint32_t displacement, uint32_t slotBits);
+static unsigned char Fold(bool caseless, unsigned char c);
+static bool Displace(keyword_table_t *table, const uint32_t *hashes, uint32_t *displacements,
+                     uint32_t *slots);
+
+// Hash and displace: keywords fall into buckets of about two by hash, and the
+// fullest buckets pick first a displacement that moves all of their keywords
+// into free slots. A table that will not fill grows, and keywords whose whole
+// hashes collide get a new seed.
+keyword_table_t *BuildKeywordTable(const vec_keyword_t *keywords, bool caseless, uint32_t rule,
+                                   uint32_t firstRule)
+{
+    keyword_table_t *table = GC_malloc(sizeof(keyword_table_t));
+    const uint32_t count = keywords->length;
+    table->rule = rule;
+    table->firstRule = firstRule;
+    table->count = count;
+    table->caseless = caseless;
+    table->bucketCount = (count + 1) / 2;
+
+    lex_keyword_info_t *infos = GC_malloc_atomic(count * sizeof(lex_keyword_info_t));
+    table->stringsSize = 0;
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        table->stringsSize += strlen(keywords->data[k]->word) +
+                              strlen(keywords->data[k]->action) + 2;
+    }
+    char *strings = GC_malloc_atomic(table->stringsSize);
+    uint32_t size = 0;
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        const keyword_t *keyword = keywords->data[k];
+        infos[k].textOffset = size;
+        infos[k].textLength = strlen(keyword->word);
+        for (uint32_t i = 0; i < infos[k].textLength; ++i)
+        {
+            strings[size++] = Fold(caseless, keyword->word[i]);
+        }
+        strings[size++] = '\0';
+        infos[k].actionOffset = size;
+        infos[k].actionLength = strlen(keyword->action);
+        memcpy(strings + size, keyword->action, infos[k].actionLength + 1);
+        size += infos[k].actionLength + 1;
+    }
+    table->keywords = infos;
+    table->strings = strings;
+
+    uint32_t minimumBits = 1;
+    while ((1u << minimumBits) < count)
+    {
+        ++minimumBits;
+    }
+    uint32_t *hashes = GC_malloc_atomic(count * sizeof(uint32_t));
+    uint32_t *displacements = GC_malloc_atomic(table->bucketCount * sizeof(uint32_t));
+    for (table->seed = FNV_OFFSET_BASIS;; table->seed = table->seed * KEYWORD_FNV_PRIME + 1)
+    {
+        for (uint32_t k = 0; k < count; ++k)
+        {
+            hashes[k] = HashKeyword(table->seed, caseless,
+                                    (const unsigned char *)strings + infos[k].textOffset,
+                                    infos[k].textLength);
+        }
+        for (table->slotBits = minimumBits; table->slotBits <= minimumBits + 2;
+             ++table->slotBits)
+        {
+            uint32_t *slots = GC_malloc_atomic(((size_t)1 << table->slotBits) * sizeof(uint32_t));
+            if (Displace(table, hashes, displacements, slots))
+            {
+                table->displacements = displacements;
+                table->slots = slots;
+                return table;
+            }
+        }
+    }
+}
+
+uint32_t FindKeyword(const keyword_table_t *table, const unsigned char *text, size_t length)
+{
+    uint32_t hash = HashKeyword(table->seed, table->caseless, text, length);
+    uint32_t k = table->slots[SlotOf(hash, table->displacements[hash % table->bucketCount],
+                                     table->slotBits)];
+    if (k == LEX_NO_RULE || table->keywords[k].textLength != length)
+    {
+        return LEX_NO_RULE;
+    }
+    const unsigned char *word =
+        (const unsigned char *)table->strings + table->keywords[k].textOffset;
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (Fold(table->caseless, text[i]) != word[i])
+        {
+            return LEX_NO_RULE;
+        }
+    }
+    return table->firstRule + k;
+}
+
+static uint32_t HashKeyword(uint32_t seed, bool caseless, const unsigned char *text,
+                            size_t length)
+{
+    uint32_t hash = seed;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash = (hash ^ Fold(caseless, text[i])) * KEYWORD_FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint32_t SlotOf(uint32_t hash, uint32_t displacement, uint32_t slotBits)
+{
+    return ((hash ^ displacement) * KEYWORD_MULTIPLIER) >> (32 - slotBits);
+}
+
+static unsigned char Fold(bool caseless, unsigned char c)
+{
+    return caseless && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Fills slots, 1 << slotBits of them, and a displacement per bucket, or
+// returns false when some bucket finds no displacement that fits.
+static bool Displace(keyword_table_t *table, const uint32_t *hashes, uint32_t *displacements,
+                     uint32_t *slots)
+{
+    const uint32_t count = table->count;
+    const uint32_t slotCount = 1u << table->slotBits;
+    for (uint32_t s = 0; s < slotCount; ++s)
+    {
+        slots[s] = LEX_NO_RULE;
+    }
+
+    // Chain each bucket's keywords through next.
+    uint32_t *first = GC_malloc_atomic(table->bucketCount * sizeof(uint32_t));
+    uint32_t *sizes = GC_malloc_atomic(table->bucketCount * sizeof(uint32_t));
+    uint32_t *next = GC_malloc_atomic(count * sizeof(uint32_t));
+    for (uint32_t b = 0; b < table->bucketCount; ++b)
+    {
+        first[b] = LEX_NO_RULE;
+        sizes[b] = 0;
+        displacements[b] = 0;
+    }
+    uint32_t largest = 0;
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        uint32_t b = hashes[k] % table->bucketCount;
+        next[k] = first[b];
+        first[b] = k;
+        if (++sizes[b] > largest)
+        {
+            largest = sizes[b];
+        }
+    }
+
+    for (uint32_t size = largest; size > 0; --size)
+    {
+        for (uint32_t b = 0; b < table->bucketCount; ++b)
+        {
+            if (sizes[b] != size)
+            {
+                continue;
+            }
+            uint32_t d = 0;
+            for (; d < DISPLACEMENT_TRIES; ++d)
+            {
+                // Place the bucket's keywords one by one, taking them back out
+                // if one lands on a taken slot.
+                uint32_t k = first[b];
+                while (k != LEX_NO_RULE && slots[SlotOf(hashes[k], d, table->slotBits)] ==
+                                               LEX_NO_RULE)
+                {
+                    slots[SlotOf(hashes[k], d, table->slotBits)] = k;
+                    k = next[k];
+                }
+                if (k == LEX_NO_RULE)
+                {
+                    break;
+                }
+                for (uint32_t placed = first[b]; placed != k; placed = next[placed])
+                {
+                    slots[SlotOf(hashes[placed], d, table->slotBits)] = LEX_NO_RULE;
+                }
+            }
+            if (d == DISPLACEMENT_TRIES)
+            {
+                return false;
+            }
+            displacements[b] = d;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,53 @@
+#ifndef LEX_KEYWORDS_H
+#define LEX_KEYWORDS_H
+
+#include "spec.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Keyword k's word is textLength bytes at textOffset in strings, folded to
+// lower case when the table is caseless, and its action follows it.
+typedef struct
+{
+    uint32_t textOffset;
+    uint32_t textLength;
+    uint32_t actionOffset;
+    uint32_t actionLength;
+} lex_keyword_info_t;
+
+// A perfect hash over a spec's keywords, so telling a keyword from any other
+// match of the rule that matches them all costs one hash of the match and one
+// comparison. The hash is 32-bit FNV-1a from seed over the bytes, folded when
+// caseless; it picks displacements[hash % bucketCount], and keyword
+// slots[((hash ^ displacement) * KEYWORD_MULTIPLIER) >> (32 - slotBits)],
+// LEX_NO_RULE for an empty slot, is the only one the match can be. Keyword k
+// reports rule firstRule + k, which comes after every rule of the automaton.
+#define KEYWORD_FNV_PRIME 16777619u
+#define KEYWORD_MULTIPLIER 0x9E3779B1u
+
+typedef struct
+{
+    uint32_t rule;
+    uint32_t firstRule;
+    uint32_t count;
+    uint32_t caseless;
+    uint32_t seed;
+    uint32_t bucketCount;
+    uint32_t slotBits;
+    uint32_t stringsSize;
+    const lex_keyword_info_t *keywords;
+    const uint32_t *displacements;
+    const uint32_t *slots;
+    const char *strings;
+} keyword_table_t;
+
+// Builds the table for a non-empty list of keywords, no two of which may be
+// the same word (ignoring case when caseless).
+keyword_table_t *BuildKeywordTable(const vec_keyword_t *keywords, bool caseless, uint32_t rule,
+                                   uint32_t firstRule);
+
+// The rule of the keyword that text is, or LEX_NO_RULE.
+uint32_t FindKeyword(const keyword_table_t *table, const unsigned char *text, size_t length);
+
+#endif // LEX_KEYWORDS_H
@@ -0,0 +1,566 @@
+#include "lex.h"
+#include "collector.h"
+#include "compile.h"
+#include "emit.h"
+#include "image.h"
+#include "pike.h"
+#include "scan.h"
+#include "shiftand.h"
+#include "spec.h"
+#include "tdfa.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct LEX_CONTEXT
+{
+    lex_error_t error;
+    bool collectStats;
+    lex_stats_t stats;
+    lex_nfa_construction_t construction;
+    lex_engine_t engine;
+    dfa_budget_t budget;
+    bool captures;
+    bool fellBack;
+    lex_error_t fallback;
+    lex_error_t warning;
+};
+
+// Tables are either built in memory or mapped from an image. A compiled
+// scanner also keeps its spec so the C emitter can copy the spec's code, and
+// its NFA for the rule actions. An NFA scanner has neither tables nor a
+// Shift-And machine; it keeps one VM's scratch space to hand to whichever
+// scan takes it first, and concurrent scans make their own. A scanner with
+// captures has only its tagged DFA. Whatever the engine, keywords tells the
+// spec's keywords apart once a match is found. Built with LEX_PROFILE, a
+// scanner with tables counts into profile as it scans them.
+struct LEX_SCANNER
+{
+    const dfa_tables_t *tables;
+    const keyword_table_t *keywords;
+    const tagged_dfa_t *tagged;
+    const shift_and_t *shiftAnd;
+    const nfa_t *nfa;
+    _Atomic(pike_vm_t *) *spareVm;
+    const lex_spec_t *spec;
+    bool mapped;
+    lex_image_t image;
+#ifdef LEX_PROFILE
+    dfa_profile_t *profile;
+#endif
+};
+
+static void SetError(lex_context_t *context, const char *format, const char *detail);
+static lex_stats_t *ActiveStats(lex_context_t *context);
+static lex_scanner_t *CreateScanner(void);
+static bool RequireTables(lex_context_t *context, const lex_scanner_t *scanner);
+static void SetTables(lex_scanner_t *scanner, const dfa_tables_t *tables);
+static const shift_and_t *TryShiftAnd(nfa_t *nfa, lex_stats_t *stats);
+static lex_scanner_t *CompileDfaOrFallBack(lex_context_t *context, lex_scanner_t *scanner,
+                                           lex_stats_t *stats);
+static lex_scanner_t *CompileTaggedDfa(lex_context_t *context, lex_scanner_t *scanner,
+                                       lex_stats_t *stats);
+
+// Both objects are uncollectable so callers can keep the only reference to
+// them in memory the collector never scans; everything they point to stays
+// reachable through them until they are destroyed.
+lex_context_t *LexCreateContext(void)
+{
+    RegisterCollectorThread();
+    lex_context_t *context = GC_malloc_uncollectable(sizeof(lex_context_t));
+    context->error = (lex_error_t){.message = NULL};
+    context->collectStats = false;
+    InitLexStats(&context->stats);
+    context->construction = LEX_NFA_THOMPSON;
+    context->engine = LEX_ENGINE_DFA;
+    context->budget = (dfa_budget_t){.maxStates = 0, .maxBytes = 0};
+    context->captures = false;
+    context->fellBack = false;
+    context->warning = (lex_error_t){.message = NULL};
+    return context;
+}
+
+void LexDestroyContext(lex_context_t *context)
+{
+    RegisterCollectorThread();
+    GC_free(context);
+}
+
+const lex_error_t *LexGetError(const lex_context_t *context)
+{
+    return &context->error;
+}
+
+void LexEnableStats(lex_context_t *context, bool enabled)
+{
+    context->collectStats = enabled;
+}
+
+void LexSetNfaConstruction(lex_context_t *context, lex_nfa_construction_t construction)
+{
+    context->construction = construction;
+}
+
+void LexSetEngine(lex_context_t *context, lex_engine_t engine)
+{
+    context->engine = engine;
+}
+
+void LexSetDfaBudget(lex_context_t *context, size_t maxStates, size_t maxBytes)
+{
+    context->budget = (dfa_budget_t){.maxStates = maxStates, .maxBytes = maxBytes};
+}
+
+void LexSetCaptures(lex_context_t *context, bool enabled)
+{
+    context->captures = enabled;
+}
+
+const lex_error_t *LexGetFallback(const lex_context_t *context)
+{
+    return context->fellBack ? &context->fallback : NULL;
+}
+
+const lex_error_t *LexGetWarning(const lex_context_t *context)
+{
+    return context->warning.message ? &context->warning : NULL;
+}
+
+void LexWriteStats(const lex_context_t *context, FILE *out)
+{
+    PrintLexStats(&context->stats, out);
+}
+
+bool LexWriteStatsTrace(const lex_context_t *context, const char *path)
+{
+    return WriteLexStatsTrace(&context->stats, path);
+}
+
+lex_scanner_t *LexCompile(lex_context_t *context, const char *spec, size_t length)
+{
+    RegisterCollectorThread();
+    if (context->collectStats)
+    {
+        InitLexStats(&context->stats);
+    }
+    context->fellBack = false;
+    context->warning.message = NULL;
+    lex_stats_t *stats = ActiveStats(context);
+    LexStatsBeginPhase(stats, LEX_PHASE_READ_SPEC);
+    lex_spec_t *parsed = ParseSpec("<string>", spec, length, &context->error);
+    LexStatsEndPhase(stats, LEX_PHASE_READ_SPEC);
+    if (!parsed)
+    {
+        return NULL;
+    }
+    // Tags ride on epsilon edges, which only the Thompson form keeps, so the
+    // position automaton is derived only once it is clear no tags are needed.
+    nfa_t *nfa =
+        CompileSpecNfa(parsed, LEX_NFA_THOMPSON, stats, &context->warning, &context->error);
+    if (!nfa)
+    {
+        return NULL;
+    }
+    size_t rule;
+    bool tagged = context->captures || FindVariableTrail(nfa, &rule);
+    if (!tagged && context->construction == LEX_NFA_GLUSHKOV)
+    {
+        LexStatsBeginPhase(stats, LEX_PHASE_NFA);
+        nfa = ConstructPositionAutomaton(nfa, stats);
+        LexStatsEndPhase(stats, LEX_PHASE_NFA);
+    }
+
+    const keyword_table_t *keywords;
+    if (!CompileKeywords(parsed, nfa, nfa->ruleCount, &keywords, &context->error))
+    {
+        return NULL;
+    }
+
+    lex_scanner_t *scanner = CreateScanner();
+    scanner->spec = parsed;
+    scanner->nfa = nfa;
+    scanner->keywords = keywords;
+    if (tagged)
+    {
+        return CompileTaggedDfa(context, scanner, stats);
+    }
+    if (context->engine == LEX_ENGINE_SHIFT_AND || context->engine == LEX_ENGINE_AUTO)
+    {
+        scanner->shiftAnd = TryShiftAnd(nfa, stats);
+        if (scanner->shiftAnd || context->engine == LEX_ENGINE_AUTO)
+        {
+            return scanner->shiftAnd ? scanner : CompileDfaOrFallBack(context, scanner, stats);
+        }
+        SetError(context, "%s", "the rules have too many positions for the Shift-And engine");
+        LexDestroyScanner(scanner);
+        return NULL;
+    }
+    return context->engine == LEX_ENGINE_NFA ? scanner
+                                             : CompileDfaOrFallBack(context, scanner, stats);
+}
+
+lex_scanner_t *LexLoadImage(lex_context_t *context, const char *path)
+{
+    RegisterCollectorThread();
+    lex_scanner_t *scanner = CreateScanner();
+    const char *error;
+    if (!MapLexImage(path, &scanner->image, &error))
+    {
+        SetError(context, "%s", error);
+        LexDestroyScanner(scanner);
+        return NULL;
+    }
+    SetTables(scanner, &scanner->image.tables);
+    scanner->keywords = scanner->tables->keywords;
+    scanner->mapped = true;
+    return scanner;
+}
+
+bool LexSaveImage(lex_context_t *context, const lex_scanner_t *scanner, const char *path)
+{
+    RegisterCollectorThread();
+    if (!RequireTables(context, scanner))
+    {
+        return false;
+    }
+    lex_stats_t *stats = ActiveStats(context);
+    LexStatsBeginPhase(stats, LEX_PHASE_EMIT);
+    bool written = WriteLexImage(scanner->tables, path);
+    LexStatsEndPhase(stats, LEX_PHASE_EMIT);
+    if (!written)
+    {
+        SetError(context, "cannot write '%s'", path);
+    }
+    return written;
+}
+
+bool LexEmitC(lex_context_t *context, const lex_scanner_t *scanner, const char *path)
+{
+    RegisterCollectorThread();
+    // An image keeps the rule actions but not the spec's own code.
+    static const lex_spec_t kNoCode = {.prologue = "", .epilogue = ""};
+    if (!RequireTables(context, scanner))
+    {
+        return false;
+    }
+    lex_stats_t *stats = ActiveStats(context);
+    LexStatsBeginPhase(stats, LEX_PHASE_EMIT);
+    bool written = EmitScanner(scanner->tables, scanner->spec ? scanner->spec : &kNoCode, path);
+    LexStatsEndPhase(stats, LEX_PHASE_EMIT);
+    if (!written)
+    {
+        SetError(context, "cannot write '%s'", path);
+    }
+    return written;
+}
+
+bool LexWriteProfile(lex_context_t *context, const lex_scanner_t *scanner, const char *path)
+{
+    RegisterCollectorThread();
+#ifdef LEX_PROFILE
+    if (!RequireTables(context, scanner))
+    {
+        return false;
+    }
+    if (!WriteDfaProfile(scanner->profile, scanner->tables, path))
+    {
+        SetError(context, "cannot write '%s'", path);
+        return false;
+    }
+    return true;
+#else
+    (void)scanner;
+    (void)path;
+    SetError(context, "%s", "profiling needs a library built with LEX_PROFILE");
+    return false;
+#endif
+}
+
+void LexDestroyScanner(lex_scanner_t *scanner)
+{
+    RegisterCollectorThread();
+    if (scanner->mapped)
+    {
+        UnmapLexImage(&scanner->image);
+    }
+    pike_vm_t *vm = atomic_load(scanner->spareVm);
+    if (vm)
+    {
+        DestroyPikeVm(vm);
+    }
+    free(scanner->spareVm);
+    GC_free(scanner);
+}
+
+lex_engine_t LexScannerEngine(const lex_scanner_t *scanner)
+{
+    if (scanner->tables || scanner->tagged)
+    {
+        return LEX_ENGINE_DFA;
+    }
+    return scanner->shiftAnd ? LEX_ENGINE_SHIFT_AND : LEX_ENGINE_NFA;
+}
+
+uint32_t LexRuleCount(const lex_scanner_t *scanner)
+{
+    if (scanner->keywords)
+    {
+        return scanner->keywords->firstRule + scanner->keywords->count;
+    }
+    return scanner->tables ? scanner->tables->ruleCount : scanner->nfa->ruleCount;
+}
+
+uint32_t LexRuleGroups(const lex_scanner_t *scanner, uint32_t rule)
+{
+    if (!scanner->nfa || rule >= scanner->nfa->ruleCount)
+    {
+        return 0;
+    }
+    return scanner->nfa->ruleGroups.data[rule];
+}
+
+uint32_t LexStateCount(const lex_scanner_t *scanner)
+{
+    if (scanner->tagged)
+    {
+        return scanner->tagged->stateCount;
+    }
+    return scanner->tables ? scanner->tables->stateCount : 0;
+}
+
+const char *LexRuleAction(const lex_scanner_t *scanner, uint32_t rule, size_t *length)
+{
+    if (rule >= LexRuleCount(scanner))
+    {
+        return NULL;
+    }
+    if (scanner->keywords && rule >= scanner->keywords->firstRule)
+    {
+        const lex_keyword_info_t *info =
+            &scanner->keywords->keywords[rule - scanner->keywords->firstRule];
+        *length = info->actionLength;
+        return scanner->keywords->strings + info->actionOffset;
+    }
+    if (!scanner->tables)
+    {
+        const char *action = scanner->nfa->ruleEnds.data[rule]->acceptString;
+        *length = strlen(action);
+        return action;
+    }
+    const lex_rule_info_t *info = &scanner->tables->rules[rule];
+    *length = info->actionLength;
+    return scanner->tables->strings + info->actionOffset;
+}
+
+uint32_t LexConditionCount(const lex_scanner_t *scanner)
+{
+    return scanner->tables ? scanner->tables->conditionCount
+                           : (uint32_t)scanner->nfa->conditions.length;
+}
+
+const char *LexConditionName(const lex_scanner_t *scanner, uint32_t condition)
+{
+    if (condition >= LexConditionCount(scanner))
+    {
+        return NULL;
+    }
+    if (!scanner->tables)
+    {
+        return scanner->nfa->conditions.data[condition]->name;
+    }
+    return scanner->tables->strings + scanner->tables->conditions[condition].nameOffset;
+}
+
+uint32_t LexFindCondition(const lex_scanner_t *scanner, const char *name)
+{
+    for (uint32_t c = 0; c < LexConditionCount(scanner); ++c)
+    {
+        if (strcmp(LexConditionName(scanner, c), name) == 0)
+        {
+            return c;
+        }
+    }
+    return LEX_NO_CONDITION;
+}
+
+bool LexScan(const lex_scanner_t *scanner, const unsigned char *input, size_t length,
+             bool atLineStart, lex_match_t *match)
+{
+    return LexScanIn(scanner, 0, input, length, atLineStart, match, NULL, 0);
+}
+
+bool LexScanCaptures(const lex_scanner_t *scanner, const unsigned char *input, size_t length,
+                     bool atLineStart, lex_match_t *match, size_t *offsets, size_t offsetCount)
+{
+    return LexScanIn(scanner, 0, input, length, atLineStart, match, offsets, offsetCount);
+}
+
+bool LexScanIn(const lex_scanner_t *scanner, uint32_t condition, const unsigned char *input,
+               size_t length, bool atLineStart, lex_match_t *match, size_t *offsets,
+               size_t offsetCount)
+{
+    RegisterCollectorThread();
+    bool matched;
+    if (scanner->tagged)
+    {
+        matched = ScanTaggedToken(scanner->tagged, condition, input, length, atLineStart, match,
+                                  offsets, offsetCount);
+    }
+    else if (scanner->tables)
+    {
+#ifdef LEX_PROFILE
+        matched = ProfileScanToken(scanner->tables, scanner->profile, condition, input, length,
+                                   atLineStart, match);
+#else
+        matched = ScanToken(scanner->tables, condition, input, length, atLineStart, match);
+#endif
+    }
+    else if (scanner->shiftAnd)
+    {
+        matched = ShiftAndScan(scanner->shiftAnd, condition, input, length, atLineStart, match);
+    }
+    else
+    {
+        pike_vm_t *vm = atomic_exchange(scanner->spareVm, NULL);
+        if (!vm)
+        {
+            vm = CreatePikeVm(scanner->nfa);
+        }
+        matched = SimulateNfa(scanner->nfa, vm, condition, input, length, atLineStart, match);
+        pike_vm_t *empty = NULL;
+        if (!atomic_compare_exchange_strong(scanner->spareVm, &empty, vm))
+        {
+            DestroyPikeVm(vm);
+        }
+    }
+    if (!scanner->tagged)
+    {
+        for (size_t slot = 0; slot < offsetCount; ++slot)
+        {
+            offsets[slot] = LEX_NO_OFFSET;
+        }
+        if (matched && offsetCount >= 2)
+        {
+            offsets[0] = 0;
+            offsets[1] = match->length;
+        }
+    }
+    // A keyword's rule has no groups of its own.
+    if (matched && scanner->keywords && match->rule == scanner->keywords->rule)
+    {
+        uint32_t keyword = FindKeyword(scanner->keywords, input, match->length);
+        if (keyword != LEX_NO_RULE)
+        {
+            match->rule = keyword;
+            for (size_t slot = 2; slot < offsetCount; ++slot)
+            {
+                offsets[slot] = LEX_NO_OFFSET;
+            }
+        }
+    }
+    return matched;
+}
+
+static void SetError(lex_context_t *context, const char *format, const char *detail)
+{
+    int length = snprintf(NULL, 0, format, detail);
+    context->error.message = GC_malloc_atomic(length + 1);
+    snprintf(context->error.message, length + 1, format, detail);
+    context->error.offset = 0;
+    context->error.line = 0;
+    context->error.column = 0;
+}
+
+static lex_stats_t *ActiveStats(lex_context_t *context)
+{
+    return context->collectStats ? &context->stats : NULL;
+}
+
+// The spare VM slot lives outside the scanner so that scans, which only see a
+// const scanner, can still swap it.
+static lex_scanner_t *CreateScanner(void)
+{
+    lex_scanner_t *scanner = GC_malloc_uncollectable(sizeof(lex_scanner_t));
+    scanner->tables = NULL;
+    scanner->keywords = NULL;
+    scanner->tagged = NULL;
+    scanner->shiftAnd = NULL;
+    scanner->nfa = NULL;
+    scanner->spareVm = malloc(sizeof(*scanner->spareVm));
+    atomic_init(scanner->spareVm, NULL);
+    scanner->spec = NULL;
+    scanner->mapped = false;
+#ifdef LEX_PROFILE
+    scanner->profile = NULL;
+#endif
+    return scanner;
+}
+
+static void SetTables(lex_scanner_t *scanner, const dfa_tables_t *tables)
+{
+    scanner->tables = tables;
+#ifdef LEX_PROFILE
+    scanner->profile = CreateDfaProfile(tables->stateCount, tables->classCount);
+#endif
+}
+
+static bool RequireTables(lex_context_t *context, const lex_scanner_t *scanner)
+{
+    if (!scanner->tables)
+    {
+        SetError(context, "%s", "only a plain DFA scanner has tables to write");
+        return false;
+    }
+    return true;
+}
+
+static const shift_and_t *TryShiftAnd(nfa_t *nfa, lex_stats_t *stats)
+{
+    if (CountNfaPositions(nfa) > SHIFT_AND_MAX_POSITIONS)
+    {
+        return NULL;
+    }
+    return BuildShiftAnd(nfa->positional ? nfa : ConstructPositionAutomaton(nfa, stats));
+}
+
+// Past the budget, Shift-And is preferred to the NFA engine when it fits:
+// rules whose DFA explodes can still have few positions.
+static lex_scanner_t *CompileDfaOrFallBack(lex_context_t *context, lex_scanner_t *scanner,
+                                           lex_stats_t *stats)
+{
+    nfa_t *nfa = (nfa_t *)scanner->nfa;
+    dfa_overflow_t overflow;
+    dfa_tables_t *tables = CompileNfaTables(nfa, &context->budget, &overflow, stats);
+    if (tables)
+    {
+        tables->keywords = scanner->keywords;
+        SetTables(scanner, tables);
+    }
+    else
+    {
+        DescribeDfaOverflow(scanner->spec, nfa, &overflow, &context->fallback);
+        context->fellBack = true;
+        scanner->shiftAnd = TryShiftAnd(nfa, stats);
+    }
+    return scanner;
+}
+
+// The tagged DFA is not minimized: states that differ only in their register
+// ops cannot be merged by comparing transitions alone.
+static lex_scanner_t *CompileTaggedDfa(lex_context_t *context, lex_scanner_t *scanner,
+                                       lex_stats_t *stats)
+{
+    size_t states;
+    LexStatsBeginPhase(stats, LEX_PHASE_DFA);
+    scanner->tagged = ConstructTaggedDfa(scanner->nfa, &context->budget, &states, stats);
+    LexStatsEndPhase(stats, LEX_PHASE_DFA);
+    if (!scanner->tagged)
+    {
+        char count[32];
+        snprintf(count, sizeof(count), "%zu", states);
+        SetError(context, "tagged DFA exceeded its budget at %s states", count);
+        LexDestroyScanner(scanner);
+        return NULL;
+    }
+    return scanner;
+}
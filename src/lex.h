@@ -0,0 +1,179 @@
+#ifndef LEX_LEX_H
+#define LEX_LEX_H
+
+// Embedding interface. A context carries everything one caller's compiles
+// share (the last error, optional statistics) and no state is global, so
+// separate contexts can be used from separate threads. Any thread may call
+// in without registering with the garbage collector first; the library does
+// that on a thread's first call. Contexts and scanners are owned by the
+// caller until destroyed; they may be stored anywhere, including memory the
+// garbage collector does not scan.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LEX_NO_RULE UINT32_MAX
+#define LEX_NO_OFFSET SIZE_MAX
+#define LEX_NO_CONDITION UINT32_MAX
+
+// offset counts bytes into the compiled text; line and column are 1-based,
+// and line is 0 for errors that have no position, such as failed I/O.
+typedef struct
+{
+    char *message;
+    size_t offset;
+    size_t line;
+    size_t column;
+} lex_error_t;
+
+typedef struct
+{
+    size_t length;
+    uint32_t rule;
+} lex_match_t;
+
+// How rules become an automaton for subset construction. Both give the same
+// scanner; Glushkov's position automaton has no epsilon edges, so building
+// the DFA never computes a closure.
+typedef enum
+{
+    LEX_NFA_THOMPSON,
+    LEX_NFA_GLUSHKOV,
+} lex_nfa_construction_t;
+
+// What a compiled scanner runs. The DFA engine takes one table lookup per
+// byte. The NFA engine simulates the automaton directly: each byte costs time
+// proportional to the rules' size, but no DFA is ever built, so rules whose
+// DFA would be huge stay usable. The Shift-And engine keeps the live Glushkov
+// positions in one or two machine words and steps them with precomputed
+// masks; it needs no DFA either but only takes rules with at most 128
+// positions (roughly, bytes and classes written in the rules). Auto picks
+// Shift-And when the rules fit and the DFA engine otherwise.
+typedef enum
+{
+    LEX_ENGINE_DFA,
+    LEX_ENGINE_NFA,
+    LEX_ENGINE_SHIFT_AND,
+    LEX_ENGINE_AUTO,
+} lex_engine_t;
+
+typedef struct LEX_CONTEXT lex_context_t;
+typedef struct LEX_SCANNER lex_scanner_t;
+
+lex_context_t *LexCreateContext(void);
+void LexDestroyContext(lex_context_t *context);
+// Describes why the most recent failing call on this context failed.
+const lex_error_t *LexGetError(const lex_context_t *context);
+void LexEnableStats(lex_context_t *context, bool enabled);
+// These apply to later LexCompile calls. The defaults are LEX_NFA_THOMPSON
+// and LEX_ENGINE_DFA.
+void LexSetNfaConstruction(lex_context_t *context, lex_nfa_construction_t construction);
+void LexSetEngine(lex_context_t *context, lex_engine_t engine);
+// Stops subset construction once the DFA passes either limit; 0 leaves a
+// limit off, and both are off by default. LexCompile then returns a scanner
+// on the Shift-And engine if the rules fit and the NFA engine otherwise.
+void LexSetDfaBudget(lex_context_t *context, size_t maxStates, size_t maxBytes);
+// Compiles later scanners to a tagged DFA, which records where each rule's
+// capture groups begin and end during the same single pass that finds the
+// match. The engine and NFA construction settings are then ignored, a DFA
+// past the budget is an error rather than a fallback, and the scanner lives
+// in memory only. Off by default; a spec with a trailing context rule r/s
+// where neither r nor s has a fixed length is always compiled this way.
+void LexSetCaptures(lex_context_t *context, bool enabled);
+// After a LexCompile that fell back from the DFA engine, how large the DFA had
+// grown and which rules took part in the most states, positioned at the
+// worst of them. NULL when the last compile did not fall back.
+const lex_error_t *LexGetFallback(const lex_context_t *context);
+// After a LexCompile, a problem that did not stop it, such as a repetition
+// whose copies come to thousands of NFA nodes, positioned in the spec. NULL
+// when there was none.
+const lex_error_t *LexGetWarning(const lex_context_t *context);
+void LexWriteStats(const lex_context_t *context, FILE *out);
+bool LexWriteStatsTrace(const lex_context_t *context, const char *path);
+
+// Compiles a whole specification held in memory: macro definitions and start
+// conditions, %%, and one `[<conditions>]regex action` rule per line. Returns
+// NULL on error.
+lex_scanner_t *LexCompile(lex_context_t *context, const char *spec, size_t length);
+lex_scanner_t *LexLoadImage(lex_context_t *context, const char *path);
+// Images and generated C hold plain DFA tables, so both fail for any other
+// scanner, including every scanner for a spec with a trailing context rule
+// that needs a tagged DFA. A scanner loaded from an image has no prologue or
+// epilogue code to copy.
+bool LexSaveImage(lex_context_t *context, const lex_scanner_t *scanner, const char *path);
+bool LexEmitC(lex_context_t *context, const lex_scanner_t *scanner, const char *path);
+void LexDestroyScanner(lex_scanner_t *scanner);
+
+// With the library built with LEX_PROFILE defined, a DFA scanner counts how
+// often scans enter each of its states and take each transition, and this
+// writes the counts for `lex --profile PROFILE SPEC` to report or
+// `lex --reorder PROFILE` to lay the tables out by. Without it scanning
+// carries no counters at all and this fails.
+bool LexWriteProfile(lex_context_t *context, const lex_scanner_t *scanner, const char *path);
+// Never LEX_ENGINE_AUTO: the engine the scanner actually runs.
+lex_engine_t LexScannerEngine(const lex_scanner_t *scanner);
+// Rules are numbered in spec order, and the spec's %keywords follow them in
+// the order listed; a match of the rule that matches every keyword is reported
+// as the keyword's rule when its text is one.
+uint32_t LexRuleCount(const lex_scanner_t *scanner);
+// Capture groups in the rule, or 0 for a scanner loaded from an image.
+uint32_t LexRuleGroups(const lex_scanner_t *scanner, uint32_t rule);
+// DFA states including the dead state, or 0 for an NFA scanner.
+uint32_t LexStateCount(const lex_scanner_t *scanner);
+const char *LexRuleAction(const lex_scanner_t *scanner, uint32_t rule, size_t *length);
+// Start conditions are numbered from 0, INITIAL, in declaration order. Every
+// condition enters the same automaton at its own state, so switching between
+// them costs nothing.
+uint32_t LexConditionCount(const lex_scanner_t *scanner);
+const char *LexConditionName(const lex_scanner_t *scanner, uint32_t condition);
+// LEX_NO_CONDITION when the scanner has no condition of that name.
+uint32_t LexFindCondition(const lex_scanner_t *scanner, const char *name);
+
+// Finds the longest match at the start of input, preferring the earliest rule
+// on ties. Returns false when no rule matches a non-empty prefix. Scanning
+// only reads the scanner, so one scanner can serve many threads.
+bool LexScan(const lex_scanner_t *scanner, const unsigned char *input, size_t length,
+             bool atLineStart, lex_match_t *match);
+// LexScan that also reports where groups matched: offsets[2g] and
+// offsets[2g + 1] bracket group g of the matched rule, counted from input,
+// with group 0 the whole match. Slots for groups that did not take part, or
+// that the rule does not have, hold LEX_NO_OFFSET. Only a scanner compiled
+// with captures reports groups past 0.
+bool LexScanCaptures(const lex_scanner_t *scanner, const unsigned char *input, size_t length,
+                     bool atLineStart, lex_match_t *match, size_t *offsets, size_t offsetCount);
+// LexScanCaptures among the rules of a start condition, which must be below
+// LexConditionCount; the two above scan in INITIAL. offsets may be NULL when
+// offsetCount is 0.
+bool LexScanIn(const lex_scanner_t *scanner, uint32_t condition, const unsigned char *input,
+               size_t length, bool atLineStart, lex_match_t *match, size_t *offsets,
+               size_t offsetCount);
+
+// A slot holds the scanner a service is currently using and lets a new one be
+// published while other threads scan. Readers never block: each scanning
+// thread attaches a reader once, then brackets each batch of LexScan calls
+// with LexAcquireScanner and LexReleaseScanner. A publish swaps the pointer
+// atomically; the scanner it replaces is destroyed only after every reader
+// that could have acquired it has released. Acquires do not nest.
+typedef struct LEX_SLOT lex_slot_t;
+typedef struct LEX_READER lex_reader_t;
+
+// The slot takes ownership of scanner and of every scanner published to it.
+lex_slot_t *LexCreateSlot(lex_scanner_t *scanner);
+// No reader may hold a scanner and no publish may be running.
+void LexDestroySlot(lex_slot_t *slot);
+lex_reader_t *LexAttachReader(lex_slot_t *slot);
+void LexDetachReader(lex_reader_t *reader);
+const lex_scanner_t *LexAcquireScanner(lex_reader_t *reader);
+void LexReleaseScanner(lex_reader_t *reader);
+// Safe to call from several threads at once. Reclaims what it can without
+// waiting for readers, so a slow reader only delays freeing the scanners it
+// may still be using.
+void LexPublishScanner(lex_slot_t *slot, lex_scanner_t *scanner);
+// Destroys retired scanners no reader can still see and returns how many
+// remain retired. Publishing does this too; call it to drain after readers go
+// quiet.
+size_t LexReclaimScanners(lex_slot_t *slot);
+
+#endif // LEX_LEX_H
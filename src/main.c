@@ -1,10 +1,372 @@
-#include "dfa.h"
-#include "nfa.h"
+#include "cache.h"
+#include "compile.h"
+#include "emit.h"
+#include "image.h"
+#include "lex.h"
+#include "spec.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    const char *outputPath;
+    const char *cacheDirectory;
+    bool cacheStats;
+    bool emitC;
+    lex_nfa_construction_t construction;
+    dfa_budget_t budget;
+    bool stats;
+    const char *statsTracePath;
+    bool backingUpReport;
+    bool errorRules;
+    const char *profilePath;
+    const char *reorderPath;
+} lex_options_t;
+
+static int Compile(const char *specPath, const lex_options_t *options);
+static bool CompileSpec(const lex_spec_t *spec, const lex_options_t *options, lex_stats_t *stats);
+static void ReportError(const char *path, const lex_error_t *error);
+static void ReportWarning(const char *path, const lex_error_t *warning);
+static int ReportStats(const lex_stats_t *stats, const lex_options_t *options);
+static int ReportProfile(const char *specPath, const lex_options_t *options);
+static int Run(const char *imagePath, const char *inputPath, const char *profilePath);
+static int Usage(void);
 
 int main(int argc, char **argv)
 {
     GC_INIT();
-    nfa_t *nfa = ConstructNfa("test set", 8, NULL);
-    dfa_t *dfa = ConstructDfa(nfa);
+    lex_options_t options = {.outputPath = NULL,
+                             .cacheDirectory = getenv("LEX_CACHE_DIR"),
+                             .cacheStats = false,
+                             .emitC = false,
+                             .construction = LEX_NFA_THOMPSON,
+                             .budget = {.maxStates = 0, .maxBytes = 0},
+                             .stats = false,
+                             .statsTracePath = NULL,
+                             .backingUpReport = false,
+                             .errorRules = false,
+                             .profilePath = NULL,
+                             .reorderPath = NULL};
+    const char *imagePath = NULL;
+    const char *inputPath = NULL;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            options.outputPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc)
+        {
+            options.cacheDirectory = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            options.cacheDirectory = NULL;
+        }
+        else if (strcmp(argv[i], "--cache-stats") == 0)
+        {
+            options.cacheStats = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            options.stats = true;
+        }
+        else if (strcmp(argv[i], "--stats-trace") == 0 && i + 1 < argc)
+        {
+            options.stats = true;
+            options.statsTracePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            options.backingUpReport = true;
+        }
+        else if (strcmp(argv[i], "--error-rules") == 0)
+        {
+            options.errorRules = true;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "c") != 0 && strcmp(argv[i], "image") != 0)
+            {
+                return Usage();
+            }
+            options.emitC = strcmp(argv[i], "c") == 0;
+        }
+        else if (strcmp(argv[i], "--nfa") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "thompson") != 0 && strcmp(argv[i], "glushkov") != 0)
+            {
+                return Usage();
+            }
+            options.construction =
+                strcmp(argv[i], "glushkov") == 0 ? LEX_NFA_GLUSHKOV : LEX_NFA_THOMPSON;
+        }
+        else if (strcmp(argv[i], "--max-states") == 0 && i + 1 < argc)
+        {
+            options.budget.maxStates = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--max-dfa-bytes") == 0 && i + 1 < argc)
+        {
+            options.budget.maxBytes = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            imagePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            options.profilePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc)
+        {
+            options.reorderPath = argv[++i];
+        }
+        else
+        {
+            return Usage();
+        }
+    }
+
+    if (!options.outputPath)
+    {
+        options.outputPath = options.emitC ? "lex.yy.c" : "lex.yy.lexb";
+    }
+    if (imagePath)
+    {
+        if (i < argc)
+        {
+            inputPath = argv[i++];
+        }
+        return i == argc ? Run(imagePath, inputPath, options.profilePath) : Usage();
+    }
+    if (i + 1 != argc)
+    {
+        return Usage();
+    }
+    return options.profilePath ? ReportProfile(argv[i], &options) : Compile(argv[i], &options);
+}
+
+static int Compile(const char *specPath, const lex_options_t *options)
+{
+    lex_stats_t stats;
+    InitLexStats(&stats);
+    lex_stats_t *active = options->stats ? &stats : NULL;
+    LexStatsBeginPhase(active, LEX_PHASE_READ_SPEC);
+    lex_error_t error;
+    lex_spec_t *spec = ReadSpec(specPath, &error);
+    LexStatsEndPhase(active, LEX_PHASE_READ_SPEC);
+    if (!spec)
+    {
+        ReportError(specPath, &error);
+        return 1;
+    }
+    // The cache key does not cover the profile a reordering follows.
+    if (!options->cacheDirectory || options->reorderPath)
+    {
+        return CompileSpec(spec, options, active) ? ReportStats(&stats, options) : 1;
+    }
+
+    // The constructions yield equivalent scanners but may number states
+    // differently, so Glushkov output is cached apart. A budget decides
+    // whether the spec compiles at all, so it is part of the key too.
+    char variant[128];
+    snprintf(variant, sizeof(variant), "format=%s%s%s max-states=%zu max-dfa-bytes=%zu",
+             options->emitC ? "c" : "image",
+             options->construction == LEX_NFA_GLUSHKOV ? " nfa=glushkov" : "",
+             options->errorRules ? " error-rules" : "", options->budget.maxStates,
+             options->budget.maxBytes);
+    lex_cache_key_t *key = MakeCacheKey(spec, variant, options->emitC);
+    // The backing-up report comes out of compiling, so it skips the lookup.
+    if (options->backingUpReport || !LookupCache(options->cacheDirectory, key, options->outputPath))
+    {
+        if (!CompileSpec(spec, options, active))
+        {
+            return 1;
+        }
+        StoreCache(options->cacheDirectory, key, options->outputPath);
+    }
+    if (options->cacheStats)
+    {
+        size_t hits;
+        size_t misses;
+        ReadCacheStats(options->cacheDirectory, &hits, &misses);
+        fprintf(stderr, "cache %s: %zu hits, %zu misses\n", options->cacheDirectory, hits, misses);
+    }
+    return ReportStats(&stats, options);
+}
+
+static bool CompileSpec(const lex_spec_t *spec, const lex_options_t *options, lex_stats_t *stats)
+{
+    lex_error_t warning;
+    lex_error_t error;
+    backing_up_options_t backingUp = {.report = options->backingUpReport ? stderr : NULL,
+                                      .errorRules = options->errorRules};
+    dfa_tables_t *tables = CompileSpecTables(spec, options->construction, &options->budget,
+                                             &backingUp, stats, &warning, &error);
+    if (warning.message)
+    {
+        ReportWarning(spec->path, &warning);
+    }
+    if (!tables)
+    {
+        ReportError(spec->path, &error);
+        return false;
+    }
+    if (options->reorderPath)
+    {
+        const char *problem;
+        dfa_profile_t *profile = ReadDfaProfile(options->reorderPath, tables, &problem);
+        if (!profile)
+        {
+            fprintf(stderr, "%s: %s\n", options->reorderPath, problem);
+            return false;
+        }
+        LexStatsBeginPhase(stats, LEX_PHASE_REORDER);
+        tables = ReorderDfaTables(tables, profile);
+        LexStatsEndPhase(stats, LEX_PHASE_REORDER);
+    }
+    LexStatsBeginPhase(stats, LEX_PHASE_EMIT);
+    bool written = options->emitC ? EmitScanner(tables, spec, options->outputPath)
+                                  : WriteLexImage(tables, options->outputPath);
+    LexStatsEndPhase(stats, LEX_PHASE_EMIT);
+    if (!written)
+    {
+        fprintf(stderr, "cannot write '%s'\n", options->outputPath);
+    }
+    return written;
+}
+
+static void ReportWarning(const char *path, const lex_error_t *warning)
+{
+    fprintf(stderr, "%s:%zu:%zu: warning: %s\n", path, warning->line, warning->column,
+            warning->message);
+}
+
+static void ReportError(const char *path, const lex_error_t *error)
+{
+    if (error->line > 0)
+    {
+        fprintf(stderr, "%s:%zu:%zu: %s\n", path, error->line, error->column, error->message);
+    }
+    else
+    {
+        fprintf(stderr, "%s\n", error->message);
+    }
+}
+
+static int ReportStats(const lex_stats_t *stats, const lex_options_t *options)
+{
+    if (!options->stats)
+    {
+        return 0;
+    }
+    PrintLexStats(stats, stderr);
+    if (options->statsTracePath && !WriteLexStatsTrace(stats, options->statsTracePath))
+    {
+        fprintf(stderr, "cannot write '%s'\n", options->statsTracePath);
+        return 1;
+    }
+    return 0;
+}
+
+// Describes a profile counted on the tables the spec compiles to.
+static int ReportProfile(const char *specPath, const lex_options_t *options)
+{
+    lex_error_t error;
+    lex_spec_t *spec = ReadSpec(specPath, &error);
+    if (!spec)
+    {
+        ReportError(specPath, &error);
+        return 1;
+    }
+    if (!ReportSpecProfile(spec, options->construction, options->errorRules, options->profilePath,
+                           stdout, &error))
+    {
+        ReportError(specPath, &error);
+        return 1;
+    }
     return 0;
 }
+
+// Tokenizes a file with a compiled image, printing one `rule<TAB>lexeme` line
+// per token. Bytes no rule matches are reported with a rule of `-`. With a
+// profile path, the state counts are written there afterwards.
+static int Run(const char *imagePath, const char *inputPath, const char *profilePath)
+{
+    lex_context_t *context = LexCreateContext();
+    lex_scanner_t *scanner = LexLoadImage(context, imagePath);
+    if (!scanner)
+    {
+        fprintf(stderr, "%s: %s\n", imagePath, LexGetError(context)->message);
+        LexDestroyContext(context);
+        return 1;
+    }
+
+    FILE *input = inputPath ? fopen(inputPath, "rb") : stdin;
+    if (!input)
+    {
+        fprintf(stderr, "cannot read '%s'\n", inputPath);
+        LexDestroyScanner(scanner);
+        LexDestroyContext(context);
+        return 1;
+    }
+    vec_char_t text;
+    vec_init(&text);
+    int c;
+    while ((c = fgetc(input)) != EOF)
+    {
+        vec_push(&text, c);
+    }
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+
+    const unsigned char *p = (const unsigned char *)text.data;
+    size_t remaining = text.length;
+    bool atLineStart = true;
+    while (remaining > 0)
+    {
+        lex_match_t match;
+        if (LexScan(scanner, p, remaining, atLineStart, &match) && match.length > 0)
+        {
+            printf("%u\t%.*s\n", match.rule, (int)match.length, (const char *)p);
+        }
+        else
+        {
+            match.length = 1;
+            printf("-\t%c\n", p[0]);
+        }
+        atLineStart = p[match.length - 1] == '\n';
+        p += match.length;
+        remaining -= match.length;
+    }
+    vec_deinit(&text);
+    bool profiled = !profilePath || LexWriteProfile(context, scanner, profilePath);
+    if (!profiled)
+    {
+        fprintf(stderr, "%s\n", LexGetError(context)->message);
+    }
+    LexDestroyScanner(scanner);
+    LexDestroyContext(context);
+    return profiled ? 0 : 1;
+}
+
+static int Usage(void)
+{
+    fprintf(stderr, "usage: lex [-o OUTPUT] [-t image|c] [--cache-dir DIR | --no-cache]\n"
+                    "           [--cache-stats] [--stats] [--stats-trace FILE]\n"
+                    "           [--nfa thompson|glushkov] [--max-states N] [--max-dfa-bytes N]\n"
+                    "           [-b] [--error-rules] [--reorder PROFILE]\n"
+                    "           SPEC\n"
+                    "       lex [--nfa thompson|glushkov] [--error-rules] --profile PROFILE SPEC\n"
+                    "       lex -r IMAGE [--profile PROFILE] [INPUT]\n"
+                    "A trailing context rule r/s needs r or s of fixed length here; only\n"
+                    "the library, which can compile to a tagged DFA, takes both variable.\n");
+    return 2;
+}
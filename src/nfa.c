@@ -1,9 +1,19 @@
 #include "nfa.h"
+#include "stats.h"
+#include "utf8.h"
 #include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <threads.h>
 
-typedef vec_t(size_t) vec_size_t;
+// Bounds above this are rejected outright; a repetition whose copies come to
+// more than kRepetitionNodeWarning NFA nodes is built but reported. That
+// counts the NFA only and says nothing certain about the DFA's size.
+#define REPETITION_MAX 10000
+#define REPETITION_UNBOUNDED SIZE_MAX
+static const size_t kRepetitionNodeWarning = 4096;
 
 typedef struct {
   size_t start;
@@ -26,37 +36,97 @@ typedef enum {
   TOK_DOLLAR,
   TOK_LEFT_PAREN,
   TOK_RIGHT_PAREN,
+  TOK_CODE_POINT,
+  TOK_PROPERTY,
+  TOK_REPETITION,
+  TOK_MACRO,
+  TOK_SLASH,
 } token_t;
 
+// How each byte reads outside quotes and escapes. TOK_LITERAL is zero, so
+// every byte not listed stands for itself; '{' never reaches the table since
+// Advance turns it into a repetition or a macro reference first.
+static const token_t kMetaTokens[256] = {
+    ['{'] = TOK_LEFT_BRACE,    ['}'] = TOK_RIGHT_BRACE, ['('] = TOK_LEFT_PAREN,
+    [')'] = TOK_RIGHT_PAREN,   ['['] = TOK_LEFT_BRACKET,
+    [']'] = TOK_RIGHT_BRACKET, ['|'] = TOK_PIPE,        ['.'] = TOK_DOT,
+    ['$'] = TOK_DOLLAR,        ['^'] = TOK_CARAT,       ['*'] = TOK_STAR,
+    ['+'] = TOK_PLUS,          ['?'] = TOK_QUESTION,    ['-'] = TOK_DASH,
+    ['/'] = TOK_SLASH,
+};
+
+// A macro's definition is parsed once into a template fragment that no rule
+// links to; every reference splices in a fresh clone of the template.
 typedef struct {
-  char key;
-  token_t token;
+  const macro_t *macro;
+  size_t start;
+  size_t end;
+  vec_size_t nodes;
+  size_t *map;
+  bool building;
   UT_hash_handle hh;
-} token_map_entry_t;
+} macro_fragment_t;
 
+// Everything the parser touches lives here, so independent ConstructNfa
+// calls can run on different threads. An error longjmps back to
+// ConstructNfa through failure.
 typedef struct {
   vec_nfa_node_t nodes;
   vec_size_t discardedNodes;
   char *inputBuf;
   char *input;
-  char lexeme;
+  char *tokenStart;
+  unsigned char lexeme;
   macro_t *macros;
+  // Indexed by caseless, since a macro compiles differently when it
+  // ignores case.
+  macro_fragment_t *fragments[2];
+  const macro_t *macro;
   bool inQuote;
-  vec_str_t inputStack;
   token_t currentTok;
+  size_t ruleCount;
+  size_t groupCount;
+  const vec_start_condition_t *conditions;
+  // Whether letters parsed now match either case: set for the whole spec, or
+  // inside (?i:...).
+  bool caseless;
+  // Row r, one byte per condition, says where rule r is active.
+  vec_char_t ruleConditions;
+  vec_size_t ruleStarts;
+  uint32_t codePoint;
+  vec_code_point_range_t property;
+  size_t repetitionMin;
+  size_t repetitionMax;
+  vec_code_point_range_t classRanges;
+  const macro_t *expanding;
+  char *expansionSite;
+  lex_stats_t *stats;
+  lex_error_t *warning;
+  lex_error_t *error;
+  jmp_buf failure;
 } regex_parser_state_t;
 
-static thread_local token_map_entry_t *sTokenMap = NULL;
-
-static void CleanupTokenMap(void);
+static void RaiseError(regex_parser_state_t *state, const char *format, ...);
+static void Warn(regex_parser_state_t *state, const char *format, ...);
+static void Describe(regex_parser_state_t *state, lex_error_t *error,
+                     const char *format, va_list args);
+static void ReleaseParserState(regex_parser_state_t *state);
 static size_t AllocateNfaNode(regex_parser_state_t *state);
 static void DiscardNfaNode(regex_parser_state_t *state, size_t node);
-static char *ExpandMacro(regex_parser_state_t *state);
-static char HexToBinary(char c);
-static char OctalToBinary(char c);
-static char ProcessEscapeCodes(regex_parser_state_t *state);
+static token_t AdvanceMacro(regex_parser_state_t *state);
+static unsigned char HexToBinary(char c);
+static unsigned char OctalToBinary(char c);
+static unsigned char ProcessEscapeCodes(regex_parser_state_t *state);
 static token_t Advance(regex_parser_state_t *state);
-static int ThompsonConstruct(regex_parser_state_t *state);
+static token_t AdvanceUnicodeEscape(regex_parser_state_t *state);
+static token_t AdvanceRepetition(regex_parser_state_t *state);
+static size_t ReadBound(char **p);
+static void SkipBlankLines(regex_parser_state_t *state);
+static void ParseConditionPrefix(regex_parser_state_t *state);
+static bool IsConditionList(const char *p);
+static size_t ChainRules(regex_parser_state_t *state, const nfa_t *nfa,
+                         size_t condition, bool atLineStart);
+static size_t ThompsonConstruct(regex_parser_state_t *state, size_t *pEnd);
 static void ConcatenateExpressions(regex_parser_state_t *state, size_t *pStart,
                                    size_t *pEnd);
 static void ParseExpression(regex_parser_state_t *state, size_t *pStart,
@@ -65,40 +135,412 @@ static void ParseTerm(regex_parser_state_t *state, size_t *pStart,
                       size_t *pEnd);
 static void ParseFactor(regex_parser_state_t *state, size_t *pStart,
                         size_t *pEnd);
-static bool CanBeExpressionStart(token_t token);
-static void DoDash(regex_parser_state_t *state, bitset_t *bitset);
+static void ParseGroup(regex_parser_state_t *state, size_t *pStart,
+                       size_t *pEnd);
+static void BuildRepetition(regex_parser_state_t *state, size_t *pStart,
+                            size_t *pEnd);
+static void CollectFragment(regex_parser_state_t *state, size_t start,
+                            size_t end, vec_size_t *fragment);
+static size_t FixedLength(regex_parser_state_t *state, size_t start,
+                          size_t end);
+static void CloneFragment(regex_parser_state_t *state,
+                          const vec_size_t *fragment, size_t *map,
+                          size_t start, size_t end, size_t *pStart,
+                          size_t *pEnd);
+static void SpliceMacro(regex_parser_state_t *state, size_t *pStart,
+                        size_t *pEnd);
+static macro_fragment_t *CompileMacro(regex_parser_state_t *state,
+                                      const macro_t *macro);
+static bool CanBeExpressionStart(regex_parser_state_t *state);
+static void ParseCharacterClass(regex_parser_state_t *state, size_t *pStart,
+                                size_t *pEnd);
+static void DoDash(regex_parser_state_t *state, bitset_t *bitset,
+                   vec_code_point_range_t *ranges);
+static void AddClassRange(bitset_t *bytes, vec_code_point_range_t *ranges,
+                          uint32_t first, uint32_t last, bool codePoints);
+static void FoldClassCase(bitset_t *bytes, vec_code_point_range_t *ranges);
+static void BuildCharacterClass(regex_parser_state_t *state, bitset_t *bytes,
+                                vec_code_point_range_t *ranges, bool negated,
+                                size_t *pStart, size_t *pEnd);
+static void BuildUtf8Fragment(regex_parser_state_t *state,
+                              const vec_code_point_range_t *ranges,
+                              size_t *pStart, size_t *pEnd);
+static bool IsPosition(const nfa_node_t *node);
+static bool *MarkLive(const nfa_t *nfa);
+static void AssignRepresentatives(nfa_t *positions);
+static void FollowEpsilons(const nfa_t *nfa, size_t from, const size_t *position,
+                           size_t *visited, size_t stamp, vec_size_t *stack,
+                           nfa_node_t *target);
 
 void NfaNodeInit(nfa_node_t *node) {
   node->acceptString = NULL;
   node->anchor = ANCHOR_NONE;
-  node->edge = EDGE_EMPTY;
+  node->trail = TRAIL_NONE;
+  node->fixedLength = 0;
+  node->edge = EDGE_EPSILON;
   node->characterClass = bitset_create();
+  node->inverted = false;
   node->next[0] = NULL;
   node->next[1] = NULL;
+  node->rule = 0;
+  node->follow = NULL;
+  node->representative = 0;
+  node->tag = 0;
+}
+
+bool NfaEdgeMatches(const nfa_node_t *node, int c) {
+  if (node->edge == EDGE_CHARACTER_CLASS) {
+    return bitset_get(node->characterClass, c) != node->inverted;
+  }
+  return node->edge == (edge_t)c;
 }
 
-nfa_t *ConstructNfa(const char *regex, size_t len, macro_t *macros) {
-  regex_parser_state_t parserState = {.input = NULL,
-                                      .inputBuf = GC_malloc(len),
-                                      .lexeme = '\0',
-                                      .macros = NULL};
-  strncpy(parserState.inputBuf, regex, len);
-  parserState.input = parserState.inputBuf;
-  vec_init(&parserState.nodes);
-  vec_init(&parserState.discardedNodes);
-  parserState.inQuote = false;
-  vec_init(&parserState.inputStack);
+size_t TokenLength(trail_t trail, size_t fixedLength, size_t end) {
+  switch (trail) {
+  case TRAIL_FIXED_TRAIL:
+    return end - fixedLength;
+  case TRAIL_FIXED_HEAD:
+    return fixedLength;
+  default:
+    return end;
+  }
+}
+
+bool AtLineEnd(const unsigned char *input, size_t length, size_t end) {
+  return end == length || input[end] == '\n' || input[end] == '\r';
+}
+
+nfa_t *ConstructNfa(const char *regex, size_t len, macro_t *macros,
+                    const vec_start_condition_t *conditions, bool caseless,
+                    lex_stats_t *stats, lex_error_t *warning,
+                    lex_error_t *error) {
+  regex_parser_state_t *state = GC_malloc(sizeof(regex_parser_state_t));
+  state->inputBuf = GC_malloc_atomic(len + 1);
+  memcpy(state->inputBuf, regex, len);
+  state->inputBuf[len] = '\0';
+  state->input = state->inputBuf;
+  state->tokenStart = state->inputBuf;
+  state->lexeme = '\0';
+  state->macros = macros;
+  state->fragments[0] = NULL;
+  state->fragments[1] = NULL;
+  state->inQuote = false;
+  state->ruleCount = 0;
+  state->groupCount = 0;
+  state->conditions = conditions;
+  state->caseless = caseless;
+  state->expanding = NULL;
+  state->expansionSite = NULL;
+  state->stats = stats;
+  state->warning = warning;
+  state->error = error;
+  if (warning) {
+    warning->message = NULL;
+  }
+  vec_init(&state->nodes);
+  vec_init(&state->discardedNodes);
+  vec_init(&state->property);
+  vec_init(&state->classRanges);
+  vec_init(&state->ruleConditions);
+  vec_init(&state->ruleStarts);
   nfa_t *nfa = GC_malloc(sizeof(nfa_t));
-  nfa->start = ThompsonConstruct(&parserState);
-  nfa->nodes = parserState.nodes;
-  vec_deinit(&parserState.discardedNodes);
+  vec_init(&nfa->ruleEnds);
+  vec_init(&nfa->ruleOffsets);
+  vec_init(&nfa->ruleGroups);
+  vec_init(&nfa->starts);
+  nfa->conditions = *conditions;
+  if (setjmp(state->failure)) {
+    vec_deinit(&state->nodes);
+    vec_deinit(&nfa->ruleEnds);
+    vec_deinit(&nfa->ruleOffsets);
+    vec_deinit(&nfa->ruleGroups);
+    ReleaseParserState(state);
+    return NULL;
+  }
+
+  SkipBlankLines(state);
+  while (state->input[0] != '\0') {
+    size_t end;
+    vec_push(&nfa->ruleOffsets, state->input - state->inputBuf);
+    ParseConditionPrefix(state);
+    Advance(state);
+    size_t rule = ThompsonConstruct(state, &end);
+    vec_push(&state->ruleStarts, rule);
+    vec_push(&nfa->ruleEnds, state->nodes.data[end]);
+    vec_push(&nfa->ruleGroups, state->groupCount);
+  }
+  // A ^ rule is only chained into the line-start entry, so nothing has to
+  // check the line position once scanning is under way. Conditions without
+  // one enter the same way at either position.
+  size_t count = conditions->length;
+  for (size_t c = 0; c < count; ++c) {
+    bool anchored = false;
+    for (int r = 0; r < state->ruleStarts.length; ++r) {
+      anchored |= state->ruleConditions.data[r * count + c] &&
+                  (nfa->ruleEnds.data[r]->anchor & ANCHOR_LINE_START);
+    }
+    size_t start = ChainRules(state, nfa, c, false);
+    vec_push(&nfa->starts, start);
+    vec_push(&nfa->starts, anchored ? ChainRules(state, nfa, c, true) : start);
+  }
+
+  nfa->nodes = state->nodes;
+  nfa->ruleCount = state->ruleCount;
+  nfa->positional = false;
+  ReleaseParserState(state);
   return nfa;
 }
 
-static void CleanupTokenMap() { HASH_CLEAR(hh, sTokenMap); }
+size_t CountNfaPositions(const nfa_t *nfa) {
+  if (nfa->positional) {
+    return nfa->nodes.length;
+  }
+  bool *live = MarkLive(nfa);
+  size_t count = nfa->starts.length;
+  for (int i = 0; i < nfa->nodes.length; ++i) {
+    count += live[i] && IsPosition(nfa->nodes.data[i]);
+  }
+  return count;
+}
+
+// Positions 0 to C - 1 are the starts of the C start conditions, and
+// position C + i stands for the Thompson node origin[i], reached by taking its
+// edge. Only nodes a start reaches become positions, which leaves out the
+// macro templates that expansions are cloned from. The epsilon closure of
+// whatever an edge leads to gives that position's follow set (the edged nodes
+// in it) and its acceptance (the best rule ending in it), so subset
+// construction over positions never computes a closure.
+nfa_t *ConstructPositionAutomaton(const nfa_t *nfa, lex_stats_t *stats) {
+  size_t count = nfa->nodes.length;
+  size_t initial = nfa->starts.length;
+  size_t *position = GC_malloc_atomic(count * sizeof(size_t));
+  bool *live = MarkLive(nfa);
+  vec_size_t origin;
+  vec_init(&origin);
+  for (size_t i = 0; i < count; ++i) {
+    if (live[i] && IsPosition(nfa->nodes.data[i])) {
+      position[i] = initial + origin.length;
+      vec_push(&origin, i);
+    }
+  }
+
+  nfa_t *positions = GC_malloc(sizeof(nfa_t));
+  vec_init(&positions->nodes);
+  vec_reserve(&positions->nodes, initial + origin.length);
+  positions->ruleEnds = nfa->ruleEnds;
+  positions->ruleOffsets = nfa->ruleOffsets;
+  positions->ruleGroups = nfa->ruleGroups;
+  positions->conditions = nfa->conditions;
+  vec_init(&positions->starts);
+  for (size_t c = 0; c < initial; ++c) {
+    vec_push(&positions->starts, c);
+  }
+  positions->ruleCount = nfa->ruleCount;
+  positions->positional = true;
+  for (size_t i = 0; i < initial + origin.length; ++i) {
+    nfa_node_t *node = GC_malloc(sizeof(nfa_node_t));
+    const nfa_node_t *source =
+        i >= initial ? nfa->nodes.data[origin.data[i - initial]] : NULL;
+    node->acceptString = NULL;
+    node->next[0] = NULL;
+    node->next[1] = NULL;
+    node->edge = source ? source->edge : EDGE_EMPTY;
+    node->anchor = ANCHOR_NONE;
+    node->trail = TRAIL_NONE;
+    node->fixedLength = 0;
+    node->characterClass = source ? source->characterClass : NULL;
+    node->inverted = source ? source->inverted : false;
+    node->index = i;
+    node->rule = source ? source->rule : 0;
+    node->follow = bitset_create();
+    node->representative = i;
+    node->tag = 0;
+    vec_push(&positions->nodes, node);
+  }
+  LexStatsCount(stats, LEX_COUNTER_NFA_POSITIONS, positions->nodes.length);
+  LexStatsCount(stats, LEX_COUNTER_BITSETS, positions->nodes.length);
+
+  size_t *visited = GC_malloc_atomic(count * sizeof(size_t));
+  memset(visited, 0, count * sizeof(size_t));
+  vec_size_t stack;
+  vec_init(&stack);
+  for (size_t i = 0; i < (size_t)positions->nodes.length; ++i) {
+    size_t from = i >= initial
+                      ? nfa->nodes.data[origin.data[i - initial]]->next[0]->index
+                      : nfa->starts.data[i];
+    FollowEpsilons(nfa, from, position, visited, i + 1, &stack,
+                   positions->nodes.data[i]);
+    LexStatsCount(stats, LEX_COUNTER_CLOSURES, 1);
+  }
+  vec_deinit(&stack);
+  vec_deinit(&origin);
+  AssignRepresentatives(positions);
+  return positions;
+}
+
+// Keys each position by its rule, anchor and follow set words (trailing zero
+// words dropped so equal sets compare equal) and maps it to the first
+// position with the same key.
+static void AssignRepresentatives(nfa_t *positions) {
+  typedef struct {
+    size_t position;
+    UT_hash_handle hh;
+  } position_key_t;
+  position_key_t *keys = NULL;
+  for (int i = 0; i < positions->nodes.length; ++i) {
+    nfa_node_t *node = positions->nodes.data[i];
+    size_t words = node->follow->arraysize;
+    while (words > 0 && node->follow->array[words - 1] == 0) {
+      --words;
+    }
+    uint64_t *key = GC_malloc_atomic((words + 2) * sizeof(uint64_t));
+    key[0] = node->acceptString ? node->rule + 1 : 0;
+    key[1] = node->anchor;
+    memcpy(key + 2, node->follow->array, words * sizeof(uint64_t));
+    size_t keyLength = (words + 2) * sizeof(uint64_t);
+    position_key_t *entry;
+    HASH_FIND(hh, keys, key, keyLength, entry);
+    if (entry) {
+      node->representative = entry->position;
+      continue;
+    }
+    entry = GC_malloc(sizeof(position_key_t));
+    entry->position = i;
+    HASH_ADD_KEYPTR(hh, keys, key, keyLength, entry);
+  }
+}
+
+static bool IsPosition(const nfa_node_t *node) {
+  return node->edge != EDGE_EPSILON && node->edge != EDGE_EMPTY;
+}
+
+// Flags the nodes some start of nfa reaches.
+static bool *MarkLive(const nfa_t *nfa) {
+  bool *live = GC_malloc_atomic(nfa->nodes.length);
+  memset(live, 0, nfa->nodes.length);
+  vec_size_t stack;
+  vec_init(&stack);
+  for (int c = 0; c < nfa->starts.length; ++c) {
+    vec_push(&stack, nfa->starts.data[c]);
+  }
+  while (stack.length > 0) {
+    size_t i = vec_pop(&stack);
+    if (live[i]) {
+      continue;
+    }
+    live[i] = true;
+    for (int k = 0; k < 2; ++k) {
+      if (nfa->nodes.data[i]->next[k]) {
+        vec_push(&stack, nfa->nodes.data[i]->next[k]->index);
+      }
+    }
+  }
+  vec_deinit(&stack);
+  return live;
+}
+
+// Walks the epsilon edges from `from`, adding every edged node reached to the
+// target's follow set and taking the earliest rule accepted along the way.
+// visited[i] == stamp marks nodes already seen in this walk.
+static void FollowEpsilons(const nfa_t *nfa, size_t from, const size_t *position,
+                           size_t *visited, size_t stamp, vec_size_t *stack,
+                           nfa_node_t *target) {
+  visited[from] = stamp;
+  vec_push(stack, from);
+  while (stack->length > 0) {
+    nfa_node_t *node = nfa->nodes.data[vec_pop(stack)];
+    if (node->acceptString &&
+        (!target->acceptString || node->rule < target->rule)) {
+      target->acceptString = node->acceptString;
+      target->anchor = node->anchor;
+      target->rule = node->rule;
+    }
+    if (IsPosition(node)) {
+      bitset_set(target->follow, position[node->index]);
+      continue;
+    }
+    for (int i = 0; i < 2; ++i) {
+      nfa_node_t *next = node->next[i];
+      if (next && visited[next->index] != stamp) {
+        visited[next->index] = stamp;
+        vec_push(stack, next->index);
+      }
+    }
+  }
+}
+
+// Records the error at the token being read (or, inside a macro, at the
+// reference that expanded it) and unwinds to ConstructNfa.
+static void RaiseError(regex_parser_state_t *state, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  Describe(state, state->error, format, args);
+  va_end(args);
+  longjmp(state->failure, 1);
+}
+
+// Records a warning where RaiseError would record an error, unless the
+// caller asked for none or one is already recorded, and carries on.
+static void Warn(regex_parser_state_t *state, const char *format, ...) {
+  if (!state->warning || state->warning->message) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  Describe(state, state->warning, format, args);
+  va_end(args);
+}
+
+static void Describe(regex_parser_state_t *state, lex_error_t *error,
+                     const char *format, va_list args) {
+  va_list copy;
+  va_copy(copy, args);
+  int length = vsnprintf(NULL, 0, format, copy);
+  va_end(copy);
+  char *message = GC_malloc_atomic(length + 1);
+  vsnprintf(message, length + 1, format, args);
+  if (state->expanding) {
+    const char *suffix = " in macro ";
+    char *full = GC_malloc_atomic(length + strlen(suffix) +
+                                  strlen(state->expanding->name) + 3);
+    sprintf(full, "%s%s'%s'", message, suffix, state->expanding->name);
+    message = full;
+  }
+
+  const char *at = state->expansionSite ? state->expansionSite
+                                        : state->tokenStart;
+  error->message = message;
+  error->offset = at - state->inputBuf;
+  error->line = 1;
+  error->column = 1;
+  for (const char *p = state->inputBuf; p < at; ++p) {
+    if (*p == '\n') {
+      ++error->line;
+      error->column = 1;
+    } else {
+      ++error->column;
+    }
+  }
+}
+
+static void ReleaseParserState(regex_parser_state_t *state) {
+  macro_fragment_t *fragment;
+  macro_fragment_t *tmp;
+  for (int i = 0; i < 2; ++i) {
+    HASH_ITER(hh, state->fragments[i], fragment, tmp) {
+      vec_deinit(&fragment->nodes);
+    }
+  }
+  vec_deinit(&state->discardedNodes);
+  vec_deinit(&state->property);
+  vec_deinit(&state->classRanges);
+  vec_deinit(&state->ruleConditions);
+  vec_deinit(&state->ruleStarts);
+}
 
 static size_t AllocateNfaNode(regex_parser_state_t *state) {
   if (state->discardedNodes.length > 0) {
+    LexStatsCount(state->stats, LEX_COUNTER_NFA_NODES_REUSED, 1);
     return vec_pop(&state->discardedNodes);
   }
 
@@ -106,34 +548,37 @@ static size_t AllocateNfaNode(regex_parser_state_t *state) {
   NfaNodeInit(node);
   node->index = state->nodes.length;
   vec_push(&state->nodes, node);
+  LexStatsCount(state->stats, LEX_COUNTER_NFA_NODES, 1);
+  LexStatsCount(state->stats, LEX_COUNTER_BITSETS, 1);
   return node->index;
 }
 
 static void DiscardNfaNode(regex_parser_state_t *state, size_t node) {
   vec_push(&state->discardedNodes, node);
   NfaNodeInit(state->nodes.data[node]);
+  LexStatsCount(state->stats, LEX_COUNTER_BITSETS, 1);
 }
 
-static char *ExpandMacro(regex_parser_state_t *state) {
-  char *p = strchr(state->input, '}');
+static token_t AdvanceMacro(regex_parser_state_t *state) {
+  char *name = state->input + 1;
+  char *p = strchr(name, '}');
   if (!p) {
-    fprintf(stderr, "in '%s': missing '}'", state->inputBuf);
-    exit(1);
+    RaiseError(state, "missing '}'");
   }
 
-  *p++ = '\0';
   macro_t *macro;
-  HASH_FIND_STR(state->macros, state->input, macro);
+  HASH_FIND(hh, state->macros, name, p - name, macro);
   if (!macro) {
-    fprintf(stderr, "in '%s': unknown macro '%s'", state->inputBuf,
-            state->input);
-    exit(1);
+    RaiseError(state, "unknown macro '%.*s'", (int)(p - name), name);
   }
-  state->input = p;
-  return macro->definition;
+  state->macro = macro;
+  state->input = p + 1;
+  state->lexeme = '{';
+  state->currentTok = TOK_MACRO;
+  return state->currentTok;
 }
 
-static char HexToBinary(char c) {
+static unsigned char HexToBinary(char c) {
   if (c >= '0' && c <= '9') {
     return c - '0';
   }
@@ -141,17 +586,17 @@ static char HexToBinary(char c) {
   return toupper(c) - 'A' + 10;
 }
 
-static char OctalToBinary(char c) { return c - '0'; }
+static unsigned char OctalToBinary(char c) { return c - '0'; }
 
-static char ProcessEscapeCodes(regex_parser_state_t *state) {
+static unsigned char ProcessEscapeCodes(regex_parser_state_t *state) {
   if (state->input[0] != '\\') {
-    char c = state->input[0];
+    unsigned char c = state->input[0];
     ++state->input;
     return c;
   }
 
   ++state->input;
-  char c;
+  unsigned char c;
   switch (tolower(state->input[0])) {
   case '\0':
     return '\\';
@@ -202,9 +647,8 @@ static char ProcessEscapeCodes(regex_parser_state_t *state) {
 #define IS_OCT_DIGIT(c) ((c) >= '0' && (c) <= '7')
 
     if (!IS_OCT_DIGIT(state->input[0])) {
-      return state->input[0];
+      c = state->input[0];
     } else {
-      ++state->input;
       c = OctalToBinary(state->input[0]);
       ++state->input;
       if (IS_OCT_DIGIT(state->input[0])) {
@@ -228,57 +672,23 @@ static char ProcessEscapeCodes(regex_parser_state_t *state) {
 }
 
 static token_t Advance(regex_parser_state_t *state) {
-  if (!sTokenMap) {
-#define ADD_TOKEN_MAP_ENTRY(k, t)                                              \
-  do {                                                                         \
-    token_map_entry_t *entry = GC_malloc(sizeof(token_map_entry_t));           \
-    entry->key = k;                                                            \
-    entry->token = t;                                                          \
-    HASH_ADD(hh, sTokenMap, key, sizeof(char), entry);                         \
-  } while (0)
-    ADD_TOKEN_MAP_ENTRY('{', TOK_LEFT_BRACE);
-    ADD_TOKEN_MAP_ENTRY('}', TOK_RIGHT_BRACE);
-    ADD_TOKEN_MAP_ENTRY('(', TOK_LEFT_PAREN);
-    ADD_TOKEN_MAP_ENTRY(')', TOK_RIGHT_PAREN);
-    ADD_TOKEN_MAP_ENTRY('[', TOK_LEFT_BRACKET);
-    ADD_TOKEN_MAP_ENTRY(']', TOK_RIGHT_BRACKET);
-    ADD_TOKEN_MAP_ENTRY('|', TOK_PIPE);
-    ADD_TOKEN_MAP_ENTRY('.', TOK_DOT);
-    ADD_TOKEN_MAP_ENTRY('$', TOK_DOLLAR);
-    ADD_TOKEN_MAP_ENTRY('^', TOK_CARAT);
-    ADD_TOKEN_MAP_ENTRY('*', TOK_STAR);
-    ADD_TOKEN_MAP_ENTRY('+', TOK_PLUS);
-    ADD_TOKEN_MAP_ENTRY('?', TOK_QUESTION);
-    ADD_TOKEN_MAP_ENTRY('-', TOK_DASH);
-    atexit(CleanupTokenMap);
-#undef ADD_TOKEN_MAP_ENTRY
-  }
-
-  while (state->input[0] == '\0') {
-    if (state->inputStack.length > 0) {
-      state->input = vec_pop(&state->inputStack);
-      continue;
-    }
-
-    state->currentTok = TOK_EOS;
-    state->lexeme = '\0';
-    return state->currentTok;
-  }
-
-  if (!state->inQuote) {
-    while (state->input[0] == '{') {
-      vec_push(&state->inputStack, state->input);
-      state->input = ExpandMacro(state);
-    }
-  }
-  if (state->input[0] == '"') {
-    state->inQuote = !state->inQuote;
-    ++state->input;
+  for (;;) {
+    state->tokenStart = state->input;
     if (state->input[0] == '\0') {
       state->currentTok = TOK_EOS;
       state->lexeme = '\0';
       return state->currentTok;
     }
+
+    if (!state->inQuote && state->input[0] == '{') {
+      return isdigit((unsigned char)state->input[1]) ? AdvanceRepetition(state)
+                                                     : AdvanceMacro(state);
+    } else if (state->input[0] == '"') {
+      state->inQuote = !state->inQuote;
+      ++state->input;
+    } else {
+      break;
+    }
   }
   bool sawEsc = state->input[0] == '\\';
   if (!state->inQuote) {
@@ -287,6 +697,11 @@ static token_t Advance(regex_parser_state_t *state) {
       state->lexeme = '\0';
       return state->currentTok;
     }
+    if ((sawEsc && (state->input[1] == 'u' || state->input[1] == 'p' ||
+                    state->input[1] == 'P')) ||
+        (unsigned char)state->input[0] >= 0x80) {
+      return AdvanceUnicodeEscape(state);
+    }
     state->lexeme = ProcessEscapeCodes(state);
   } else {
     if (sawEsc && state->input[1] == '"') {
@@ -298,24 +713,122 @@ static token_t Advance(regex_parser_state_t *state) {
     }
   }
 
-  if (state->inQuote || sawEsc) {
-    state->currentTok = TOK_LITERAL;
+  state->currentTok =
+      state->inQuote || sawEsc ? TOK_LITERAL : kMetaTokens[state->lexeme];
+  return state->currentTok;
+}
+
+// Handles the tokens that denote code points rather than bytes: a raw UTF-8
+// sequence, \u{hex} or \uXXXX, and the general categories \p{Name}, \pL and
+// their negations \P{Name}, \PL.
+static token_t AdvanceUnicodeEscape(regex_parser_state_t *state) {
+  state->lexeme = state->input[0];
+  if (state->input[0] != '\\') {
+    const char *p = state->input;
+    if (!DecodeUtf8(&p, &state->codePoint)) {
+      RaiseError(state, "invalid UTF-8 sequence");
+    }
+    state->input = (char *)p;
+    state->currentTok = TOK_CODE_POINT;
+    return state->currentTok;
+  }
+
+  char kind = state->input[1];
+  state->input += 2;
+  const char *name = state->input;
+  size_t length = 1;
+  if (state->input[0] == '{') {
+    char *close = strchr(state->input, '}');
+    if (!close) {
+      RaiseError(state, "missing '}'");
+    }
+    name = state->input + 1;
+    length = close - name;
+    state->input = close + 1;
+  } else if (kind == 'u') {
+    length = 4;
+    for (size_t i = 0; i < length; ++i) {
+      if (!isxdigit((unsigned char)name[i])) {
+        RaiseError(state, "\\u needs four hex digits or braces");
+      }
+    }
+    state->input += length;
   } else {
-    token_map_entry_t *entry;
-    HASH_FIND(hh, sTokenMap, &state->lexeme, sizeof(char), entry);
-    if (entry == NULL) {
-      state->currentTok = TOK_LITERAL;
-    } else {
-      state->currentTok = entry->token;
+    ++state->input;
+  }
+
+  if (kind == 'u') {
+    state->codePoint = 0;
+    for (size_t i = 0; i < length; ++i) {
+      if (!isxdigit((unsigned char)name[i]) || i >= 6) {
+        RaiseError(state, "bad code point '%.*s'", (int)length, name);
+      }
+      state->codePoint = (state->codePoint << 4) | HexToBinary(name[i]);
     }
+    if (length == 0 || state->codePoint > UNICODE_MAX_CODE_POINT ||
+        (state->codePoint >= 0xD800 && state->codePoint <= 0xDFFF)) {
+      RaiseError(state, "bad code point '%.*s'", (int)length, name);
+    }
+    state->currentTok = TOK_CODE_POINT;
+    return state->currentTok;
+  }
+
+  vec_clear(&state->property);
+  if (!AddUnicodeCategory(&state->property, name, length)) {
+    RaiseError(state, "unknown Unicode category '%.*s'", (int)length, name);
   }
+  NormalizeCodePointRanges(&state->property);
+  if (kind == 'P') {
+    NegateCodePointRanges(&state->property);
+  }
+  state->currentTok = TOK_PROPERTY;
+  return state->currentTok;
+}
+
+// Reads {n}, {n,} or {n,m}. A brace followed by anything but a digit is a
+// macro reference and never gets here.
+static token_t AdvanceRepetition(regex_parser_state_t *state) {
+  char *p = state->input + 1;
+  state->repetitionMin = ReadBound(&p);
+  state->repetitionMax = state->repetitionMin;
+  if (*p == ',') {
+    ++p;
+    state->repetitionMax = isdigit((unsigned char)*p) ? ReadBound(&p)
+                                                      : REPETITION_UNBOUNDED;
+  }
+  if (*p != '}') {
+    RaiseError(state, "malformed repetition");
+  }
+  if (state->repetitionMin > REPETITION_MAX ||
+      state->repetitionMax < state->repetitionMin ||
+      (state->repetitionMax != REPETITION_UNBOUNDED &&
+       state->repetitionMax > REPETITION_MAX)) {
+    RaiseError(state, "repetition bounds must satisfy n <= m <= %d",
+               REPETITION_MAX);
+  }
+  state->input = p + 1;
+  state->lexeme = '{';
+  state->currentTok = TOK_REPETITION;
   return state->currentTok;
 }
 
-static int ThompsonConstruct(regex_parser_state_t *state) {
+// Reads a repetition bound, stopping at REPETITION_MAX + 1 for anything
+// larger so that no number of digits can overflow.
+static size_t ReadBound(char **p) {
+  size_t bound = 0;
+  for (; isdigit((unsigned char)**p); ++*p) {
+    if (bound <= REPETITION_MAX) {
+      bound = bound * 10 + (**p - '0');
+    }
+  }
+  return bound <= REPETITION_MAX ? bound : REPETITION_MAX + 1;
+}
+
+static size_t ThompsonConstruct(regex_parser_state_t *state, size_t *pEnd) {
   size_t start = 0;
   size_t end = 0;
   anchor_t anchor = ANCHOR_NONE;
+  state->groupCount = 0;
   if (state->currentTok == TOK_CARAT) {
     start = AllocateNfaNode(state);
     anchor |= ANCHOR_LINE_START;
@@ -327,37 +840,192 @@ static int ThompsonConstruct(regex_parser_state_t *state) {
     ParseExpression(state, &start, &end);
   }
 
+  trail_t trail = TRAIL_NONE;
+  size_t fixedLength = 0;
+  size_t boundary = 0;
+  if (state->currentTok == TOK_SLASH) {
+    size_t headLength = FixedLength(state, start, end);
+    Advance(state);
+    size_t trailStart;
+    size_t trailEnd;
+    ParseExpression(state, &trailStart, &trailEnd);
+    size_t trailLength = FixedLength(state, trailStart, trailEnd);
+    state->nodes.data[end]->next[0] = state->nodes.data[trailStart];
+    boundary = end;
+    end = trailEnd;
+    if (trailLength != SIZE_MAX) {
+      trail = TRAIL_FIXED_TRAIL;
+      fixedLength = trailLength;
+    } else if (headLength != SIZE_MAX) {
+      trail = TRAIL_FIXED_HEAD;
+      fixedLength = headLength;
+    } else {
+      trail = TRAIL_VARIABLE;
+    }
+  }
+  if (state->currentTok == TOK_SLASH) {
+    RaiseError(state, "a rule can only have one '/'");
+  }
+  if (state->currentTok != TOK_EOS && state->currentTok != TOK_DOLLAR) {
+    RaiseError(state, "unexpected '%c'", state->lexeme);
+  }
+
   if (state->currentTok == TOK_DOLLAR) {
+    if (trail != TRAIL_NONE) {
+      RaiseError(state, "'$' cannot follow trailing context");
+    }
     Advance(state);
-    size_t endNext = AllocateNfaNode(state);
-    state->nodes.data[end]->next[0] = state->nodes.data[endNext];
-    state->nodes.data[end]->edge = EDGE_CHARACTER_CLASS;
-    bitset_set(state->nodes.data[end]->characterClass, '\n');
-    bitset_set(state->nodes.data[end]->characterClass, '\r');
-    end = endNext;
+    if (state->currentTok != TOK_EOS) {
+      RaiseError(state, "'$' is only allowed at the end of a rule");
+    }
+    // The accepting node itself carries the condition, so every engine
+    // checks the byte after the match instead of matching the terminator.
     anchor |= ANCHOR_LINE_END;
   }
 
-  while (isspace(state->input[0])) {
+  while (state->input[0] == ' ' || state->input[0] == '\t') {
     ++state->input;
   }
-  state->nodes.data[end]->acceptString = strdup(state->input);
+  char *eol = strchr(state->input, '\n');
+  if (!eol) {
+    eol = state->input + strlen(state->input);
+  }
+  state->nodes.data[end]->acceptString =
+      GC_strndup(state->input, eol - state->input);
   state->nodes.data[end]->anchor = anchor;
-  Advance(state);
+  state->nodes.data[end]->trail = trail;
+  state->nodes.data[end]->fixedLength = fixedLength;
+  if (trail == TRAIL_VARIABLE) {
+    state->nodes.data[boundary]->tag = 2 * state->groupCount + 1;
+  }
+  vec_size_t fragment;
+  vec_init(&fragment);
+  CollectFragment(state, start, end, &fragment);
+  for (int i = 0; i < fragment.length; ++i) {
+    state->nodes.data[fragment.data[i]]->rule = state->ruleCount;
+  }
+  vec_deinit(&fragment);
+  ++state->ruleCount;
+  state->input = eol;
+  SkipBlankLines(state);
+  *pEnd = end;
+  return start;
+}
+
+static void SkipBlankLines(regex_parser_state_t *state) {
+  while (isspace(state->input[0])) {
+    ++state->input;
+  }
+}
+
+// Reads the <...> prefix starting a rule, if there is one, and appends the
+// rule's row of ruleConditions. A '<' that does not open a list of names
+// ending in '>' is part of the pattern.
+static void ParseConditionPrefix(regex_parser_state_t *state) {
+  const vec_start_condition_t *conditions = state->conditions;
+  size_t row = state->ruleConditions.length;
+  bool prefixed = state->input[0] == '<' && IsConditionList(state->input + 1);
+  for (int c = 0; c < conditions->length; ++c) {
+    vec_push(&state->ruleConditions,
+             !prefixed && !conditions->data[c]->exclusive);
+  }
+  if (!prefixed) {
+    return;
+  }
+
+  char *active = state->ruleConditions.data + row;
+  char *p = state->input + 1;
+  while (*p != '>') {
+    char *name = p;
+    if (*p == '*') {
+      memset(active, true, conditions->length);
+      ++p;
+    } else {
+      while (isalnum((unsigned char)*p) || *p == '_') {
+        ++p;
+      }
+      int c = 0;
+      while (c < conditions->length &&
+             (strlen(conditions->data[c]->name) != (size_t)(p - name) ||
+              strncmp(conditions->data[c]->name, name, p - name) != 0)) {
+        ++c;
+      }
+      if (c == conditions->length) {
+        state->tokenStart = name;
+        RaiseError(state, "unknown start condition '%.*s'", (int)(p - name),
+                   name);
+      }
+      active[c] = true;
+    }
+    p += *p == ',';
+  }
+  state->input = p + 1;
+}
+
+// Whether p, just past a '<', holds names or '*' separated by commas and
+// then '>'.
+static bool IsConditionList(const char *p) {
+  for (;;) {
+    if (*p == '*') {
+      ++p;
+    } else if (isalpha((unsigned char)*p) || *p == '_') {
+      while (isalnum((unsigned char)*p) || *p == '_') {
+        ++p;
+      }
+    } else {
+      return false;
+    }
+    if (*p == '>') {
+      return true;
+    }
+    if (*p++ != ',') {
+      return false;
+    }
+  }
+}
+
+// Hangs each rule active in the condition off its own epsilon node, chained
+// through next[1] in rule order, so the condition's machine is an alternation
+// of its rules; ^ rules only take part at the start of a line. Returns the
+// first node, which has no edges when no rule takes part.
+static size_t ChainRules(regex_parser_state_t *state, const nfa_t *nfa,
+                         size_t condition, bool atLineStart) {
+  size_t count = state->conditions->length;
+  size_t start = AllocateNfaNode(state);
+  size_t p = start;
+  bool linked = false;
+  for (int r = 0; r < state->ruleStarts.length; ++r) {
+    if (!state->ruleConditions.data[r * count + condition] ||
+        (!atLineStart &&
+         (nfa->ruleEnds.data[r]->anchor & ANCHOR_LINE_START))) {
+      continue;
+    }
+    if (linked) {
+      size_t next = AllocateNfaNode(state);
+      state->nodes.data[p]->next[1] = state->nodes.data[next];
+      p = next;
+    }
+    state->nodes.data[p]->next[0] =
+        state->nodes.data[state->ruleStarts.data[r]];
+    linked = true;
+  }
   return start;
 }
 
 static void ConcatenateExpressions(regex_parser_state_t *state, size_t *pStart,
                                    size_t *pEnd) {
   nfa_node_pair_t expr2;
-  if (CanBeExpressionStart(state->currentTok)) {
-    ParseFactor(state, pStart, pEnd);
+  if (!CanBeExpressionStart(state)) {
+    RaiseError(state, "expected an expression");
   }
+  ParseFactor(state, pStart, pEnd);
 
-  while (CanBeExpressionStart(state->currentTok)) {
+  while (CanBeExpressionStart(state)) {
     ParseFactor(state, &expr2.start, &expr2.end);
+    size_t index = state->nodes.data[*pEnd]->index;
     memcpy(state->nodes.data[*pEnd], state->nodes.data[expr2.start],
            sizeof(nfa_node_t));
+    state->nodes.data[*pEnd]->index = index;
     DiscardNfaNode(state, expr2.start);
     *pEnd = expr2.end;
   }
@@ -385,65 +1053,119 @@ static void ParseExpression(regex_parser_state_t *state, size_t *pStart,
 static void ParseTerm(regex_parser_state_t *state, size_t *pStart,
                       size_t *pEnd) {
   if (state->currentTok == TOK_LEFT_PAREN) {
+    ParseGroup(state, pStart, pEnd);
+  } else if (state->currentTok == TOK_MACRO) {
+    SpliceMacro(state, pStart, pEnd);
     Advance(state);
-    ParseExpression(state, pStart, pEnd);
-    if (state->currentTok == TOK_RIGHT_PAREN) {
-      Advance(state);
+  } else if (state->currentTok == TOK_LEFT_BRACKET) {
+    ParseCharacterClass(state, pStart, pEnd);
+  } else if (state->currentTok == TOK_PROPERTY ||
+             (state->currentTok == TOK_CODE_POINT && state->codePoint >= 0x80)) {
+    vec_code_point_range_t ranges;
+    vec_init(&ranges);
+    if (state->currentTok == TOK_PROPERTY) {
+      vec_extend(&ranges, &state->property);
     } else {
-      fprintf(stderr, "missing close parenthesis in regex\n");
-      exit(1);
+      code_point_range_t range = {state->codePoint, state->codePoint};
+      vec_push(&ranges, range);
     }
+    LexStatsCount(state->stats, LEX_COUNTER_BITSETS, 1);
+    bitset_t *bytes = bitset_create();
+    if (state->caseless) {
+      FoldClassCase(bytes, &ranges);
+    }
+    BuildCharacterClass(state, bytes, &ranges, false, pStart, pEnd);
+    vec_deinit(&ranges);
+    Advance(state);
   } else {
     size_t start = AllocateNfaNode(state);
     *pStart = start;
     *pEnd = AllocateNfaNode(state);
     state->nodes.data[start]->next[0] = state->nodes.data[*pEnd];
-    if (state->currentTok != TOK_DOT && state->currentTok != TOK_LEFT_BRACKET) {
+    if (state->currentTok == TOK_CODE_POINT) {
+      state->nodes.data[start]->edge = state->codePoint;
+    } else if (state->currentTok != TOK_DOT) {
       state->nodes.data[start]->edge = state->lexeme;
-      Advance(state);
     } else {
       state->nodes.data[start]->edge = EDGE_CHARACTER_CLASS;
-      if (state->currentTok == TOK_DOT) {
-        bitset_set(state->nodes.data[start]->characterClass, '\n');
-        bitset_set(state->nodes.data[start]->characterClass, '\r');
-        state->nodes.data[start]->inverted = true;
-      } else {
-        Advance(state);
-        if (state->currentTok == TOK_CARAT) {
-          Advance(state);
-          bitset_set(state->nodes.data[start]->characterClass, '\n');
-          bitset_set(state->nodes.data[start]->characterClass, '\r');
-          state->nodes.data[start]->inverted = true;
-        }
-        if (state->currentTok == TOK_RIGHT_BRACKET) {
-          for (char c = 0; c <= ' '; ++c) {
-            bitset_set(state->nodes.data[start]->characterClass, c);
-          }
-        } else {
-          DoDash(state, state->nodes.data[start]->characterClass);
-        }
-      }
-      Advance(state);
+      bitset_set(state->nodes.data[start]->characterClass, '\n');
+      bitset_set(state->nodes.data[start]->characterClass, '\r');
+      state->nodes.data[start]->inverted = true;
+    }
+    // A letter that ignores case becomes a class of both; byte classes
+    // merge the two back into one column wherever no rule tells them apart.
+    edge_t edge = state->nodes.data[start]->edge;
+    if (state->caseless && edge < EDGE_EMPTY && isalpha(edge)) {
+      bitset_set(state->nodes.data[start]->characterClass, tolower(edge));
+      bitset_set(state->nodes.data[start]->characterClass, toupper(edge));
+      state->nodes.data[start]->edge = EDGE_CHARACTER_CLASS;
     }
+    Advance(state);
   }
 }
 
+// A capture group is bracketed by a node recording its open tag and one
+// recording its close tag, followed by a plain end node so that
+// concatenation, which merges the next fragment into the end node, never
+// overwrites a tag. (?i:...) groups like (?:...) and also ignores case.
+static void ParseGroup(regex_parser_state_t *state, size_t *pStart,
+                       size_t *pEnd) {
+  bool capturing = !state->expanding;
+  bool caseless = state->caseless;
+  if (!state->inQuote && state->input[0] == '?' && state->input[1] == ':') {
+    state->input += 2;
+    capturing = false;
+  } else if (!state->inQuote && state->input[0] == '?' &&
+             state->input[1] == 'i' && state->input[2] == ':') {
+    state->input += 3;
+    capturing = false;
+    state->caseless = true;
+  }
+  size_t group = capturing ? state->groupCount++ : 0;
+  Advance(state);
+  ParseExpression(state, pStart, pEnd);
+  if (state->currentTok != TOK_RIGHT_PAREN) {
+    RaiseError(state, "missing close parenthesis");
+  }
+  state->caseless = caseless;
+  Advance(state);
+  if (!capturing) {
+    return;
+  }
+
+  size_t open = AllocateNfaNode(state);
+  size_t close = AllocateNfaNode(state);
+  size_t end = AllocateNfaNode(state);
+  state->nodes.data[open]->tag = 2 * group + 1;
+  state->nodes.data[open]->next[0] = state->nodes.data[*pStart];
+  state->nodes.data[*pEnd]->next[0] = state->nodes.data[close];
+  state->nodes.data[close]->tag = 2 * group + 2;
+  state->nodes.data[close]->next[0] = state->nodes.data[end];
+  *pStart = open;
+  *pEnd = end;
+}
+
 static void ParseFactor(regex_parser_state_t *state, size_t *pStart,
                         size_t *pEnd) {
   ParseTerm(state, pStart, pEnd);
-  if (state->currentTok == TOK_STAR || state->currentTok == TOK_PLUS ||
+  if (state->currentTok == TOK_REPETITION) {
+    BuildRepetition(state, pStart, pEnd);
+    Advance(state);
+  } else if (state->currentTok == TOK_STAR || state->currentTok == TOK_PLUS ||
       state->currentTok == TOK_QUESTION) {
     size_t start = AllocateNfaNode(state);
     size_t end = AllocateNfaNode(state);
     state->nodes.data[start]->next[0] = state->nodes.data[*pStart];
-    state->nodes.data[*pEnd]->next[0] = state->nodes.data[end];
 
     if (state->currentTok == TOK_STAR || state->currentTok == TOK_QUESTION) {
       state->nodes.data[start]->next[1] = state->nodes.data[end];
     }
 
     if (state->currentTok == TOK_STAR || state->currentTok == TOK_PLUS) {
-      state->nodes.data[*pEnd]->next[1] = state->nodes.data[*pStart];
+      state->nodes.data[*pEnd]->next[0] = state->nodes.data[*pStart];
+      state->nodes.data[*pEnd]->next[1] = state->nodes.data[end];
+    } else {
+      state->nodes.data[*pEnd]->next[0] = state->nodes.data[end];
     }
 
     *pStart = start;
@@ -452,41 +1174,388 @@ static void ParseFactor(regex_parser_state_t *state, size_t *pStart,
   }
 }
 
-static bool CanBeExpressionStart(token_t token) {
-  switch (token) {
+// Expands the fragment just parsed into repetitionMax copies: the first
+// repetitionMin are chained, each later one can be skipped straight to the
+// end, and an unbounded repetition loops on its last copy. Copies are cloned
+// from the parsed fragment rather than re-parsed, so x{1,1000} costs one parse
+// and a linear number of node copies.
+static void BuildRepetition(regex_parser_state_t *state, size_t *pStart,
+                            size_t *pEnd) {
+  size_t min = state->repetitionMin;
+  size_t max = state->repetitionMax;
+  size_t copies = max != REPETITION_UNBOUNDED ? max : (min > 0 ? min : 1);
+  vec_size_t fragment;
+  vec_init(&fragment);
+  CollectFragment(state, *pStart, *pEnd, &fragment);
+  if (fragment.length * copies > kRepetitionNodeWarning) {
+    Warn(state, "repetition copies its operand into %zu NFA nodes",
+         fragment.length * copies);
+  }
+
+  size_t *map = GC_malloc_atomic(state->nodes.length * sizeof(size_t));
+  size_t start = AllocateNfaNode(state);
+  size_t end = AllocateNfaNode(state);
+  size_t tail = start;
+  size_t copyStart = *pStart;
+  for (size_t i = 0; i < copies; ++i) {
+    size_t copyEnd = *pEnd;
+    if (i == 0) {
+      copyStart = *pStart;
+    } else {
+      CloneFragment(state, &fragment, map, *pStart, *pEnd, &copyStart,
+                    &copyEnd);
+    }
+    state->nodes.data[tail]->next[0] = state->nodes.data[copyStart];
+    if (i >= min) {
+      state->nodes.data[tail]->next[1] = state->nodes.data[end];
+    }
+    tail = copyEnd;
+  }
+  if (max == REPETITION_UNBOUNDED) {
+    state->nodes.data[tail]->next[0] = state->nodes.data[copyStart];
+    state->nodes.data[tail]->next[1] = state->nodes.data[end];
+  } else {
+    state->nodes.data[tail]->next[0] = state->nodes.data[end];
+  }
+  vec_deinit(&fragment);
+  *pStart = start;
+  *pEnd = end;
+}
+
+// Lists the nodes reachable from start without passing through end.
+static void CollectFragment(regex_parser_state_t *state, size_t start,
+                            size_t end, vec_size_t *fragment) {
+  bitset_t *seen = bitset_create();
+  LexStatsCount(state->stats, LEX_COUNTER_BITSETS, 1);
+  vec_size_t stack;
+  vec_init(&stack);
+  vec_push(&stack, start);
+  bitset_set(seen, start);
+  while (stack.length > 0) {
+    size_t index = vec_pop(&stack);
+    vec_push(fragment, index);
+    for (int i = 0; i < 2 && index != end; ++i) {
+      nfa_node_t *next = state->nodes.data[index]->next[i];
+      if (next && !bitset_get(seen, next->index)) {
+        bitset_set(seen, next->index);
+        vec_push(&stack, next->index);
+      }
+    }
+  }
+  vec_deinit(&stack);
+}
+
+// The number of bytes every path from start to end consumes, or SIZE_MAX when
+// paths differ. A loop that consumes anything makes the length vary, since
+// the second time round reaches a node at a new distance.
+static size_t FixedLength(regex_parser_state_t *state, size_t start,
+                          size_t end) {
+  size_t *distance = GC_malloc_atomic(state->nodes.length * sizeof(size_t));
+  memset(distance, 0xFF, state->nodes.length * sizeof(size_t));
+  vec_size_t stack;
+  vec_init(&stack);
+  distance[start] = 0;
+  vec_push(&stack, start);
+  size_t length = 0;
+  while (stack.length > 0 && length != SIZE_MAX) {
+    size_t index = vec_pop(&stack);
+    const nfa_node_t *node = state->nodes.data[index];
+    size_t next = distance[index] + IsPosition(node);
+    for (int i = 0; i < 2 && index != end; ++i) {
+      if (!node->next[i]) {
+        continue;
+      }
+      size_t target = node->next[i]->index;
+      if (distance[target] == SIZE_MAX) {
+        distance[target] = next;
+        vec_push(&stack, target);
+      } else if (distance[target] != next) {
+        length = SIZE_MAX;
+      }
+    }
+  }
+  vec_deinit(&stack);
+  return length == SIZE_MAX ? SIZE_MAX : distance[end];
+}
+
+// Copies every node of a fragment and rewires the copies to each other. The
+// copy of end gets no edges, since the original's may already lead onward.
+static void CloneFragment(regex_parser_state_t *state,
+                          const vec_size_t *fragment, size_t *map,
+                          size_t start, size_t end, size_t *pStart,
+                          size_t *pEnd) {
+  for (int i = 0; i < fragment->length; ++i) {
+    map[fragment->data[i]] = AllocateNfaNode(state);
+  }
+  for (int i = 0; i < fragment->length; ++i) {
+    nfa_node_t *original = state->nodes.data[fragment->data[i]];
+    nfa_node_t *copy = state->nodes.data[map[original->index]];
+    if (original->index == end) {
+      continue;
+    }
+    copy->edge = original->edge;
+    copy->characterClass = original->characterClass;
+    copy->inverted = original->inverted;
+    copy->tag = original->tag;
+    for (int j = 0; j < 2; ++j) {
+      if (original->next[j]) {
+        copy->next[j] = state->nodes.data[map[original->next[j]->index]];
+      }
+    }
+  }
+  *pStart = map[start];
+  *pEnd = map[end];
+}
+
+// A reference behaves like the parenthesized definition, as in flex, so
+// {NAME}* repeats the whole definition.
+static void SpliceMacro(regex_parser_state_t *state, size_t *pStart,
+                        size_t *pEnd) {
+  macro_fragment_t *fragment;
+  HASH_FIND(hh, state->fragments[state->caseless], &state->macro,
+            sizeof(macro_t *), fragment);
+  if (!fragment) {
+    fragment = CompileMacro(state, state->macro);
+  } else if (fragment->building) {
+    RaiseError(state, "macro '%s' refers to itself", state->macro->name);
+  }
+  CloneFragment(state, &fragment->nodes, fragment->map, fragment->start,
+                fragment->end, pStart, pEnd);
+}
+
+static macro_fragment_t *CompileMacro(regex_parser_state_t *state,
+                                      const macro_t *macro) {
+  macro_fragment_t *fragment = GC_malloc(sizeof(macro_fragment_t));
+  fragment->macro = macro;
+  fragment->building = true;
+  HASH_ADD(hh, state->fragments[state->caseless], macro, sizeof(macro_t *),
+           fragment);
+
+  char *input = state->input;
+  const macro_t *expanding = state->expanding;
+  char *expansionSite = state->expansionSite;
+  if (!expansionSite) {
+    state->expansionSite = state->tokenStart;
+  }
+  state->expanding = macro;
+  state->input = macro->definition;
+  Advance(state);
+  ParseExpression(state, &fragment->start, &fragment->end);
+  if (state->currentTok != TOK_EOS || state->input[0] != '\0' ||
+      state->inQuote) {
+    RaiseError(state, "not a complete regular expression");
+  }
+  state->input = input;
+  state->expanding = expanding;
+  state->expansionSite = expansionSite;
+
+  vec_init(&fragment->nodes);
+  CollectFragment(state, fragment->start, fragment->end, &fragment->nodes);
+  fragment->map = GC_malloc_atomic(state->nodes.length * sizeof(size_t));
+  fragment->building = false;
+  return fragment;
+}
+
+static bool CanBeExpressionStart(regex_parser_state_t *state) {
+  switch (state->currentTok) {
   case TOK_RIGHT_PAREN:
   case TOK_DOLLAR:
+  case TOK_SLASH:
   case TOK_PIPE:
   case TOK_EOS:
     return false;
   case TOK_STAR:
   case TOK_PLUS:
   case TOK_QUESTION:
-    fprintf(stderr, "found closure symbol in invalid position\n");
-    exit(1);
+  case TOK_REPETITION:
+    RaiseError(state, "'%c' does not follow anything it could repeat",
+               state->lexeme);
+    return false;
   case TOK_RIGHT_BRACKET:
-    fprintf(stderr, "found unmatched closing bracket\n");
-    exit(1);
+    RaiseError(state, "unmatched ']'");
+    return false;
   case TOK_CARAT:
-    fprintf(stderr, "found invalid ^ symbol not at start of regex\n");
-    exit(1);
+    RaiseError(state, "'^' is only allowed at the start of a rule");
+    return false;
   default:
     return true;
   }
 }
 
-static void DoDash(regex_parser_state_t *state, bitset_t *bitset) {
-  char first;
+static void ParseCharacterClass(regex_parser_state_t *state, size_t *pStart,
+                                size_t *pEnd) {
+  bitset_t *bytes = bitset_create();
+  LexStatsCount(state->stats, LEX_COUNTER_BITSETS, 1);
+  vec_code_point_range_t *ranges = &state->classRanges;
+  vec_clear(ranges);
+  bool negated = false;
+  Advance(state);
+  if (state->currentTok == TOK_CARAT) {
+    Advance(state);
+    AddClassRange(bytes, ranges, '\n', '\n', true);
+    AddClassRange(bytes, ranges, '\r', '\r', true);
+    negated = true;
+  }
+  if (state->currentTok == TOK_RIGHT_BRACKET) {
+    AddClassRange(bytes, ranges, 0, ' ', true);
+  } else {
+    DoDash(state, bytes, ranges);
+  }
+  if (state->currentTok != TOK_RIGHT_BRACKET) {
+    RaiseError(state, "missing ']'");
+  }
+  if (state->caseless) {
+    FoldClassCase(bytes, ranges);
+  }
+  BuildCharacterClass(state, bytes, ranges, negated, pStart, pEnd);
+  Advance(state);
+}
+
+static void DoDash(regex_parser_state_t *state, bitset_t *bitset,
+                   vec_code_point_range_t *ranges) {
+  uint32_t first = 0;
+  bool firstIsCodePoint = false;
   while (state->currentTok != TOK_EOS &&
          state->currentTok != TOK_RIGHT_BRACKET) {
-    if (state->currentTok != TOK_DASH) {
-      first = state->lexeme;
-      bitset_set(bitset, first);
+    if (state->currentTok == TOK_MACRO) {
+      RaiseError(state, "macro '%s' used inside a character class",
+                 state->macro->name);
+    } else if (state->currentTok == TOK_PROPERTY) {
+      code_point_range_t range;
+      int i;
+      vec_foreach(&state->property, range, i) {
+        AddClassRange(bitset, ranges, range.first, range.last, true);
+      }
+    } else if (state->currentTok != TOK_DASH) {
+      firstIsCodePoint = state->currentTok == TOK_CODE_POINT;
+      first = firstIsCodePoint ? state->codePoint : state->lexeme;
+      AddClassRange(bitset, ranges, first, first, firstIsCodePoint);
     } else {
       Advance(state);
-      for (; first <= state->lexeme; ++first) {
-        bitset_set(bitset, first);
+      bool lastIsCodePoint = state->currentTok == TOK_CODE_POINT;
+      uint32_t last = lastIsCodePoint ? state->codePoint : state->lexeme;
+      AddClassRange(bitset, ranges, first, last,
+                    firstIsCodePoint || lastIsCodePoint);
+    }
+    Advance(state);
+  }
+}
+
+// A class is kept both as a byte set and as code point ranges. ASCII goes in
+// both; code points above ASCII only exist as ranges and bytes above ASCII
+// (written with \x escapes) only in the byte set.
+static void AddClassRange(bitset_t *bytes, vec_code_point_range_t *ranges,
+                          uint32_t first, uint32_t last, bool codePoints) {
+  uint32_t byteLimit = codePoints ? 0x80 : 0x100;
+  for (uint32_t c = first; c <= last && c < byteLimit; ++c) {
+    bitset_set(bytes, c);
+  }
+  if (codePoints || first < 0x80) {
+    code_point_range_t range = {first, codePoints || last < 0x80 ? last : 0x7F};
+    vec_push(ranges, range);
+  }
+}
+
+// Adds the other case of each ASCII letter in a class. A negated class is
+// folded before it is negated, so it excludes both cases.
+static void FoldClassCase(bitset_t *bytes, vec_code_point_range_t *ranges) {
+  int count = ranges->length;
+  for (int i = 0; i < count; ++i) {
+    code_point_range_t range = ranges->data[i];
+    for (uint32_t c = range.first; c <= range.last && c < 0x80; ++c) {
+      if (isalpha(c)) {
+        int other = islower(c) ? toupper(c) : tolower(c);
+        AddClassRange(bytes, ranges, other, other, true);
+      }
+    }
+  }
+}
+
+// Classes that stay within ASCII (or only add raw bytes) become a single
+// class edge as before. Anything with a code point above ASCII is compiled to
+// the byte automaton of its UTF-8 encodings, so the scanner still takes one
+// byte per step and never decodes.
+static void BuildCharacterClass(regex_parser_state_t *state, bitset_t *bytes,
+                                vec_code_point_range_t *ranges, bool negated,
+                                size_t *pStart, size_t *pEnd) {
+  NormalizeCodePointRanges(ranges);
+  if (ranges->length == 0 || vec_last(ranges).last < 0x80) {
+    *pStart = AllocateNfaNode(state);
+    *pEnd = AllocateNfaNode(state);
+    nfa_node_t *start = state->nodes.data[*pStart];
+    start->next[0] = state->nodes.data[*pEnd];
+    start->edge = EDGE_CHARACTER_CLASS;
+    start->characterClass = bytes;
+    start->inverted = negated;
+    return;
+  }
+
+  bitset_t *rawBytes = bitset_create();
+  LexStatsCount(state->stats, LEX_COUNTER_BITSETS, 1);
+  for (int c = 0x80; c < 0x100; ++c) {
+    if (bitset_get(bytes, c)) {
+      bitset_set(rawBytes, c);
+    }
+  }
+  if (negated) {
+    if (bitset_count(rawBytes) > 0) {
+      RaiseError(state, "raw bytes cannot appear in a negated Unicode class");
+    }
+    NegateCodePointRanges(ranges);
+  }
+  BuildUtf8Fragment(state, ranges, pStart, pEnd);
+  if (bitset_count(rawBytes) > 0) {
+    size_t start = AllocateNfaNode(state);
+    size_t byteNode = AllocateNfaNode(state);
+    state->nodes.data[byteNode]->edge = EDGE_CHARACTER_CLASS;
+    state->nodes.data[byteNode]->characterClass = rawBytes;
+    state->nodes.data[byteNode]->next[0] = state->nodes.data[*pEnd];
+    state->nodes.data[start]->next[0] = state->nodes.data[byteNode];
+    state->nodes.data[start]->next[1] = state->nodes.data[*pStart];
+    *pStart = start;
+  }
+}
+
+static void BuildUtf8Fragment(regex_parser_state_t *state,
+                              const vec_code_point_range_t *ranges,
+                              size_t *pStart, size_t *pEnd) {
+  if (ranges->length == 0) {
+    // Nothing to match: a class edge over the empty set.
+    *pStart = AllocateNfaNode(state);
+    *pEnd = AllocateNfaNode(state);
+    state->nodes.data[*pStart]->edge = EDGE_CHARACTER_CLASS;
+    state->nodes.data[*pStart]->next[0] = state->nodes.data[*pEnd];
+    return;
+  }
+
+  utf8_automaton_t *automaton = CompileUtf8Ranges(ranges);
+  size_t *entry =
+      GC_malloc_atomic(automaton->states.length * sizeof(size_t));
+  // Transitions always target lower-numbered states, so each state's targets
+  // already have nodes by the time it is built. A state with several
+  // transitions becomes a chain of epsilon splits, one class edge per arm.
+  for (int s = 0; s < automaton->states.length; ++s) {
+    vec_utf8_transition_t *transitions = &automaton->states.data[s];
+    entry[s] = AllocateNfaNode(state);
+    size_t node = entry[s];
+    for (int t = 0; t < transitions->length; ++t) {
+      utf8_transition_t *transition = &transitions->data[t];
+      size_t arm = node;
+      if (t + 1 < transitions->length) {
+        arm = AllocateNfaNode(state);
+        size_t rest = AllocateNfaNode(state);
+        state->nodes.data[node]->next[0] = state->nodes.data[arm];
+        state->nodes.data[node]->next[1] = state->nodes.data[rest];
+        node = rest;
+      }
+      nfa_node_t *armNode = state->nodes.data[arm];
+      armNode->edge = EDGE_CHARACTER_CLASS;
+      for (int c = transition->first; c <= transition->last; ++c) {
+        bitset_set(armNode->characterClass, c);
       }
+      armNode->next[0] = state->nodes.data[entry[transition->target]];
     }
   }
+  *pStart = entry[automaton->start];
+  *pEnd = entry[automaton->final];
 }
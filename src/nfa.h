@@ -4,16 +4,20 @@
 #define uthash_malloc(sz) GC_malloc(sz)
 #define uthash_free(ptr, sz)
 
+#include "lex.h"
+#include "stats.h"
 #include <bitset.h>
 #include <gc.h>
 #include <stdbool.h>
 #include <uthash.h>
 #include <vec.h>
 
+// Values 0x00-0xFF are literal bytes; the special edges sit above the byte
+// range so no input byte can be mistaken for one.
 typedef enum {
-  EDGE_EMPTY = -3,
-  EDGE_CHARACTER_CLASS = -2,
-  EDGE_EPSILON = -1,
+  EDGE_EMPTY = 0x100,
+  EDGE_CHARACTER_CLASS,
+  EDGE_EPSILON,
 } edge_t;
 
 typedef enum {
@@ -23,23 +27,90 @@ typedef enum {
   ANCHOR_BOTH = ANCHOR_LINE_START | ANCHOR_LINE_END,
 } anchor_t;
 
+// How a rule with trailing context r/s finds where its token, r, ends. An s
+// of fixed length is cut off the end of the match and an r of fixed length is
+// kept from its start, so neither records anything while scanning; only when
+// both vary does the scan record, as a tag, where r ended.
+typedef enum {
+  TRAIL_NONE,
+  TRAIL_FIXED_TRAIL,
+  TRAIL_FIXED_HEAD,
+  TRAIL_VARIABLE,
+} trail_t;
+
 typedef struct NFA {
   char *acceptString;
   struct NFA *next[2];
   edge_t edge;
   anchor_t anchor;
+  // Set on a rule's accepting node: fixedLength is the length of s for
+  // TRAIL_FIXED_TRAIL and of r for TRAIL_FIXED_HEAD.
+  trail_t trail;
+  size_t fixedLength;
   bitset_t *characterClass;
   bool inverted;
   size_t index;
+  // The rule whose pattern this node belongs to, which is also the rule an
+  // accepting node accepts.
+  size_t rule;
+  // Only used in a position automaton: the positions that may come next, and
+  // the first position with the same follow set and acceptance. Such
+  // positions behave identically once entered, so DFA states record the
+  // representative instead.
+  bitset_t *follow;
+  size_t representative;
+  // Zero, or one more than the capture tag this epsilon node records: tag
+  // 2g opens the rule's group g + 1 and tag 2g + 1 closes it. With n groups,
+  // tag 2n marks where r ends in a TRAIL_VARIABLE rule.
+  size_t tag;
 } nfa_node_t;
 
 void NfaNodeInit(nfa_node_t *node);
+// Whether taking node's edge consumes byte c. Epsilon edges consume nothing.
+bool NfaEdgeMatches(const nfa_node_t *node, int c);
+// The length of the token when a rule with this trail accepts end bytes into
+// the input. TRAIL_VARIABLE is left to the caller, which recorded the length.
+size_t TokenLength(trail_t trail, size_t fixedLength, size_t end);
+// Whether a trailing $ holds end bytes into input: the next byte ends a line,
+// or there is none. $ only looks at that byte and never consumes it.
+bool AtLineEnd(const unsigned char *input, size_t length, size_t end);
 
 typedef vec_t(nfa_node_t *) vec_nfa_node_t;
+typedef vec_t(size_t) vec_size_t;
+
+// A start condition. Condition 0 is INITIAL; the rest are declared with %s
+// (inclusive) or %x (exclusive). A rule without a <...> prefix is active in
+// every inclusive condition, and an exclusive one has only the rules that
+// name it or <*>.
+typedef struct {
+  char *name;
+  bool exclusive;
+} start_condition_t;
+
+typedef vec_t(start_condition_t *) vec_start_condition_t;
 
+// A positional NFA has no epsilon edges. Each node is a position, entered by
+// matching its edge and accepting on its own; its follow set replaces next.
+// ruleEnds holds the node where each rule's Thompson machine accepts, which
+// carries the rule's action and anchors in either form; ruleOffsets holds
+// where each rule starts in the text it was parsed from, and ruleGroups how
+// many capture groups it has. starts[2c] is the node where start condition c
+// begins mid-line and starts[2c + 1] where it begins at the start of a line,
+// the only place its ^ rules are reachable from: an alternation of rules, or
+// in a positional NFA the initial position of the same number.
+//
+// In a Thompson NFA, next[0] is the preferred edge out of a split: the left
+// alternative, and another pass through a loop. Only capture extraction
+// cares, and it reads groups the way a backtracking matcher would.
 typedef struct {
   vec_nfa_node_t nodes;
-  size_t start;
+  vec_nfa_node_t ruleEnds;
+  vec_size_t ruleOffsets;
+  vec_size_t ruleGroups;
+  vec_start_condition_t conditions;
+  vec_size_t starts;
+  size_t ruleCount;
+  bool positional;
 } nfa_t;
 
 typedef struct {
@@ -48,6 +119,26 @@ typedef struct {
   UT_hash_handle hh;
 } macro_t;
 
-nfa_t *ConstructNfa(const char *regex, size_t len, macro_t *macros);
+// Builds one NFA for a block of rules, one `[<conditions>]regex action` per
+// line, where conditions is * or a comma-separated list of names from
+// conditions. Earlier rules take priority over later ones when both accept.
+// Each (...) in a rule is a capture group numbered from 1 by its opening
+// parenthesis; (?:...) and parentheses inside macro definitions only group. A
+// rule r/s matches r only when s follows, and s counts towards the longest
+// match. Letters in (?i:...) match either case, as do all letters when
+// caseless is set. Nothing is printed: on a syntax error it returns NULL and
+// describes the error in *error, and a repetition whose copies come to
+// thousands of NFA nodes is described in *warning, whose message is NULL
+// otherwise. Either is positioned relative to regex; warning may be
+// NULL.
+nfa_t *ConstructNfa(const char *regex, size_t len, macro_t *macros,
+                    const vec_start_condition_t *conditions, bool caseless,
+                    lex_stats_t *stats, lex_error_t *warning,
+                    lex_error_t *error);
+// The number of states ConstructPositionAutomaton would make from nfa.
+size_t CountNfaPositions(const nfa_t *nfa);
+// Derives Glushkov's position automaton from a Thompson NFA: one position per
+// byte or class edge plus the initial position, and no epsilon edges.
+nfa_t *ConstructPositionAutomaton(const nfa_t *nfa, lex_stats_t *stats);
 
 #endif // LEX_NFA_H
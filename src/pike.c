@@ -0,0 +1,157 @@
+#include "pike.h"
+#include <stdlib.h>
+
+static void ClearSet(pike_set_t *set);
+static bool AddToSet(pike_set_t *set, size_t index);
+static void AddThread(const nfa_t *nfa, pike_vm_t *vm, pike_set_t *set, size_t index);
+static void Step(const nfa_t *nfa, pike_vm_t *vm, const pike_set_t *current, pike_set_t *next,
+                 unsigned char c);
+static const nfa_node_t *BestAccepting(const nfa_t *nfa, const pike_set_t *set, bool atLineEnd);
+
+// The sparse arrays are allocated zeroed once; after that a set is cleared by
+// resetting its count, and stale sparse entries are told apart by checking
+// them against dense.
+pike_vm_t *CreatePikeVm(const nfa_t *nfa)
+{
+    pike_vm_t *vm = malloc(sizeof(pike_vm_t));
+    vm->capacity = nfa->nodes.length;
+    for (int i = 0; i < 2; ++i)
+    {
+        vm->threads[i].dense = malloc(vm->capacity * sizeof(size_t));
+        vm->threads[i].sparse = calloc(vm->capacity, sizeof(size_t));
+        vm->threads[i].count = 0;
+    }
+    vm->stack = malloc(vm->capacity * sizeof(size_t));
+    return vm;
+}
+
+void DestroyPikeVm(pike_vm_t *vm)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        free(vm->threads[i].dense);
+        free(vm->threads[i].sparse);
+    }
+    free(vm->stack);
+    free(vm);
+}
+
+// Every thread is at the same input offset and no captures are tracked, so a
+// thread is just an NFA node and priority only matters when choosing the rule:
+// the match is the last offset at which any thread accepted.
+bool SimulateNfa(const nfa_t *nfa, pike_vm_t *vm, uint32_t condition,
+                 const unsigned char *input, size_t length, bool atLineStart,
+                 lex_match_t *match)
+{
+    pike_set_t *current = &vm->threads[0];
+    pike_set_t *next = &vm->threads[1];
+    ClearSet(current);
+    AddThread(nfa, vm, current, nfa->starts.data[2 * condition + atLineStart]);
+    match->length = 0;
+    match->rule = LEX_NO_RULE;
+    for (size_t i = 0; i < length && current->count > 0; ++i)
+    {
+        Step(nfa, vm, current, next, input[i]);
+        pike_set_t *swap = current;
+        current = next;
+        next = swap;
+
+        const nfa_node_t *accepting =
+            BestAccepting(nfa, current, AtLineEnd(input, length, i + 1));
+        if (!accepting)
+        {
+            continue;
+        }
+        const nfa_node_t *end = nfa->ruleEnds.data[accepting->rule];
+        match->rule = accepting->rule;
+        match->length = TokenLength(end->trail, end->fixedLength, i + 1);
+    }
+    return match->rule != LEX_NO_RULE;
+}
+
+static void ClearSet(pike_set_t *set)
+{
+    set->count = 0;
+}
+
+static bool AddToSet(pike_set_t *set, size_t index)
+{
+    size_t slot = set->sparse[index];
+    if (slot < set->count && set->dense[slot] == index)
+    {
+        return false;
+    }
+    set->sparse[index] = set->count;
+    set->dense[set->count++] = index;
+    return true;
+}
+
+// Adds a node and, in a Thompson NFA, everything its epsilon edges reach. A
+// node enters the set before it is expanded, so each is expanded at most once
+// per step and the stack never holds more than every node.
+static void AddThread(const nfa_t *nfa, pike_vm_t *vm, pike_set_t *set, size_t index)
+{
+    if (!AddToSet(set, index) || nfa->positional)
+    {
+        return;
+    }
+    size_t depth = 0;
+    vm->stack[depth++] = index;
+    while (depth > 0)
+    {
+        const nfa_node_t *node = nfa->nodes.data[vm->stack[--depth]];
+        if (node->edge != EDGE_EPSILON)
+        {
+            continue;
+        }
+        for (int j = 1; j >= 0; --j)
+        {
+            if (node->next[j] && AddToSet(set, node->next[j]->index))
+            {
+                vm->stack[depth++] = node->next[j]->index;
+            }
+        }
+    }
+}
+
+static void Step(const nfa_t *nfa, pike_vm_t *vm, const pike_set_t *current, pike_set_t *next,
+                 unsigned char c)
+{
+    ClearSet(next);
+    for (size_t k = 0; k < current->count; ++k)
+    {
+        const nfa_node_t *node = nfa->nodes.data[current->dense[k]];
+        if (!nfa->positional)
+        {
+            if (node->edge != EDGE_EPSILON && NfaEdgeMatches(node, c))
+            {
+                AddThread(nfa, vm, next, node->next[0]->index);
+            }
+            continue;
+        }
+        for (size_t q = 0; nextSetBit(node->follow, &q); ++q)
+        {
+            const nfa_node_t *position = nfa->nodes.data[q];
+            if (NfaEdgeMatches(position, c))
+            {
+                AddToSet(next, position->representative);
+            }
+        }
+    }
+}
+
+// A node whose rule ends in $ only accepts when atLineEnd.
+static const nfa_node_t *BestAccepting(const nfa_t *nfa, const pike_set_t *set, bool atLineEnd)
+{
+    const nfa_node_t *best = NULL;
+    for (size_t k = 0; k < set->count; ++k)
+    {
+        const nfa_node_t *node = nfa->nodes.data[set->dense[k]];
+        if (node->acceptString && (atLineEnd || !(node->anchor & ANCHOR_LINE_END)) &&
+            (!best || node->rule < best->rule))
+        {
+            best = node;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,39 @@
+#ifndef LEX_PIKE_H
+#define LEX_PIKE_H
+
+#include "lex.h"
+#include "nfa.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// A sparse set over NFA node indices: constant-time insert, membership and
+// clear, and iteration in insertion order.
+typedef struct
+{
+    size_t *dense;
+    size_t *sparse;
+    size_t count;
+} pike_set_t;
+
+// Scratch space for simulating one NFA: the threads alive before and after
+// the current byte, and a stack for following epsilon edges. A VM is reused
+// across scans but must not be shared by concurrent scans.
+typedef struct
+{
+    size_t capacity;
+    pike_set_t threads[2];
+    size_t *stack;
+} pike_vm_t;
+
+pike_vm_t *CreatePikeVm(const nfa_t *nfa);
+void DestroyPikeVm(pike_vm_t *vm);
+
+// Same contract as ScanToken: the longest match at the start of input, the
+// earliest rule among those accepting it, and false when nothing matches.
+// Runs in time linear in the length scanned for a fixed NFA, in either the
+// Thompson or the positional form.
+bool SimulateNfa(const nfa_t *nfa, pike_vm_t *vm, uint32_t condition,
+                 const unsigned char *input, size_t length, bool atLineStart,
+                 lex_match_t *match);
+
+#endif // LEX_PIKE_H
@@ -0,0 +1,250 @@
+#include "profile.h"
+#include <gc.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PROFILE_FORMAT_VERSION 2
+#define UNPLACED UINT32_MAX
+
+typedef struct
+{
+    uint32_t state;
+    uint64_t visits;
+} ranked_state_t;
+
+static bool ReadCounts(FILE *file, dfa_profile_t *profile);
+static uint32_t HottestSuccessor(const dfa_tables_t *tables, const dfa_profile_t *profile,
+                                 const uint32_t *order, uint32_t state, uint32_t *targets,
+                                 uint64_t *counts);
+static int CompareRankedStates(const void *a, const void *b);
+
+dfa_profile_t *CreateDfaProfile(uint32_t stateCount, uint32_t classCount)
+{
+    dfa_profile_t *profile = GC_malloc(sizeof(dfa_profile_t));
+    size_t cells = (size_t)stateCount * classCount;
+    profile->stateCount = stateCount;
+    profile->classCount = classCount;
+    profile->visits = GC_malloc_atomic(stateCount * sizeof(_Atomic uint64_t));
+    profile->transitions = GC_malloc_atomic(cells * sizeof(_Atomic uint64_t));
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        atomic_init(&profile->visits[s], 0);
+    }
+    for (size_t cell = 0; cell < cells; ++cell)
+    {
+        atomic_init(&profile->transitions[cell], 0);
+    }
+    return profile;
+}
+
+// States are written in canonical order, so the same counts on differently
+// laid out tables give the same file.
+bool WriteDfaProfile(const dfa_profile_t *profile, const dfa_tables_t *tables, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        return false;
+    }
+    uint32_t *numbers = NumberStatesCanonically(tables);
+    uint32_t *byNumber = GC_malloc_atomic(profile->stateCount * sizeof(uint32_t));
+    for (uint32_t s = 0; s < profile->stateCount; ++s)
+    {
+        byNumber[numbers[s]] = s;
+    }
+    fprintf(file, "lex profile %d %u %u\n", PROFILE_FORMAT_VERSION, profile->stateCount,
+            profile->classCount);
+    for (uint32_t n = 0; n < profile->stateCount; ++n)
+    {
+        uint64_t visits =
+            atomic_load_explicit(&profile->visits[byNumber[n]], memory_order_relaxed);
+        if (visits > 0)
+        {
+            fprintf(file, "v %u %" PRIu64 "\n", n, visits);
+        }
+    }
+    for (uint32_t n = 0; n < profile->stateCount; ++n)
+    {
+        for (uint32_t k = 0; k < profile->classCount; ++k)
+        {
+            uint64_t count = atomic_load_explicit(
+                &profile->transitions[(size_t)byNumber[n] * profile->classCount + k],
+                memory_order_relaxed);
+            if (count > 0)
+            {
+                fprintf(file, "t %u %u %" PRIu64 "\n", n, k, count);
+            }
+        }
+    }
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+dfa_profile_t *ReadDfaProfile(const char *path, const dfa_tables_t *tables, const char **error)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        *error = "cannot read profile";
+        return NULL;
+    }
+    int version;
+    uint32_t stateCount;
+    uint32_t classCount;
+    dfa_profile_t *profile = NULL;
+    if (fscanf(file, "lex profile %d %" SCNu32 " %" SCNu32, &version, &stateCount,
+               &classCount) != 3)
+    {
+        *error = "not a lex profile";
+    }
+    else if (version != PROFILE_FORMAT_VERSION)
+    {
+        *error = "unsupported profile version";
+    }
+    else if (stateCount != tables->stateCount || classCount != tables->classCount)
+    {
+        *error = "profile was counted on other tables";
+    }
+    else
+    {
+        profile = CreateDfaProfile(stateCount, classCount);
+        if (!ReadCounts(file, profile))
+        {
+            *error = "corrupt profile";
+            profile = NULL;
+        }
+    }
+    fclose(file);
+    if (!profile)
+    {
+        return NULL;
+    }
+
+    uint32_t *numbers = NumberStatesCanonically(tables);
+    dfa_profile_t *renumbered = CreateDfaProfile(stateCount, classCount);
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        atomic_store(&renumbered->visits[s], atomic_load(&profile->visits[numbers[s]]));
+        for (uint32_t k = 0; k < classCount; ++k)
+        {
+            atomic_store(&renumbered->transitions[(size_t)s * classCount + k],
+                         atomic_load(&profile->transitions[(size_t)numbers[s] * classCount + k]));
+        }
+    }
+    return renumbered;
+}
+
+// Greedy chaining: starting from the hottest state not yet placed, keep
+// placing the hottest unplaced successor of the state just placed until the
+// chain runs into placed or unvisited states.
+dfa_tables_t *ReorderDfaTables(const dfa_tables_t *tables, const dfa_profile_t *profile)
+{
+    const uint32_t stateCount = tables->stateCount;
+    ranked_state_t *ranked = GC_malloc_atomic(stateCount * sizeof(ranked_state_t));
+    uint32_t *order = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        ranked[s] = (ranked_state_t){.state = s, .visits = atomic_load(&profile->visits[s])};
+        order[s] = UNPLACED;
+    }
+    qsort(ranked, stateCount, sizeof(ranked_state_t), CompareRankedStates);
+
+    uint32_t *targets = GC_malloc_atomic(tables->classCount * sizeof(uint32_t));
+    uint64_t *counts = GC_malloc_atomic(tables->classCount * sizeof(uint64_t));
+    order[LEX_DEAD_STATE] = LEX_DEAD_STATE;
+    uint32_t next = 1;
+    for (uint32_t k = 0; k < stateCount && ranked[k].visits > 0; ++k)
+    {
+        for (uint32_t s = ranked[k].state; s != UNPLACED && order[s] == UNPLACED;
+             s = HottestSuccessor(tables, profile, order, s, targets, counts))
+        {
+            order[s] = next++;
+        }
+    }
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        if (order[s] == UNPLACED)
+        {
+            order[s] = next++;
+        }
+    }
+    return RenumberDfaStates(tables, order);
+}
+
+static bool ReadCounts(FILE *file, dfa_profile_t *profile)
+{
+    char kind;
+    while (fscanf(file, " %c", &kind) == 1)
+    {
+        uint32_t s;
+        uint32_t k;
+        uint64_t count;
+        if (kind == 'v' && fscanf(file, "%" SCNu32 " %" SCNu64, &s, &count) == 2 &&
+            s < profile->stateCount)
+        {
+            atomic_store(&profile->visits[s], count);
+        }
+        else if (kind == 't' &&
+                 fscanf(file, "%" SCNu32 " %" SCNu32 " %" SCNu64, &s, &k, &count) == 3 &&
+                 s < profile->stateCount && k < profile->classCount)
+        {
+            atomic_store(&profile->transitions[(size_t)s * profile->classCount + k], count);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return !ferror(file);
+}
+
+// The unplaced state entered most often from state, adding up the classes
+// that lead to it, or UNPLACED when state went on to none.
+static uint32_t HottestSuccessor(const dfa_tables_t *tables, const dfa_profile_t *profile,
+                                 const uint32_t *order, uint32_t state, uint32_t *targets,
+                                 uint64_t *counts)
+{
+    uint32_t targetCount = 0;
+    uint32_t hottest = UNPLACED;
+    uint64_t hottestCount = 0;
+    for (uint32_t k = 0; k < tables->classCount; ++k)
+    {
+        uint64_t taken =
+            atomic_load(&profile->transitions[(size_t)state * tables->classCount + k]);
+        uint32_t next = DfaTransition(tables, state, k);
+        if (taken == 0 || order[next] != UNPLACED)
+        {
+            continue;
+        }
+        uint32_t j = 0;
+        while (j < targetCount && targets[j] != next)
+        {
+            ++j;
+        }
+        if (j == targetCount)
+        {
+            targets[targetCount] = next;
+            counts[targetCount++] = 0;
+        }
+        counts[j] += taken;
+        if (counts[j] > hottestCount || (counts[j] == hottestCount && next < hottest))
+        {
+            hottest = next;
+            hottestCount = counts[j];
+        }
+    }
+    return hottest;
+}
+
+// Most visited first, then in table order.
+static int CompareRankedStates(const void *a, const void *b)
+{
+    const ranked_state_t *x = a;
+    const ranked_state_t *y = b;
+    if (x->visits != y->visits)
+    {
+        return x->visits > y->visits ? -1 : 1;
+    }
+    return (x->state > y->state) - (x->state < y->state);
+}
@@ -0,0 +1,42 @@
+#ifndef LEX_PROFILE_H
+#define LEX_PROFILE_H
+
+#include "tables.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// How often scans entered each state of one DFA's tables and took each
+// transition: visits[s] counts entries into state s, including a scan's first
+// state, and transitions[s * classCount + k] the steps from s on class k,
+// into the dead state too. Counters are relaxed atomics so scans on several
+// threads can share them.
+//
+// The text form, which generated scanners built with YY_PROFILE write too, is
+// a `lex profile 2 STATES CLASSES` line and then a `v STATE COUNT` line for
+// each state and a `t STATE CLASS COUNT` line for each transition counted at
+// least once. It numbers states as NumberStatesCanonically does, so a profile
+// still applies once the tables are reordered or built another way.
+typedef struct
+{
+    uint32_t stateCount;
+    uint32_t classCount;
+    _Atomic uint64_t *visits;
+    _Atomic uint64_t *transitions;
+} dfa_profile_t;
+
+dfa_profile_t *CreateDfaProfile(uint32_t stateCount, uint32_t classCount);
+// profile must have been counted on tables.
+bool WriteDfaProfile(const dfa_profile_t *profile, const dfa_tables_t *tables, const char *path);
+// Reads a profile of the automaton that tables hold, numbered as tables number
+// it. Returns NULL with *error naming the problem when path holds no profile
+// or one of other tables.
+dfa_profile_t *ReadDfaProfile(const char *path, const dfa_tables_t *tables, const char **error);
+
+// Renumbers the states of tables so that hot states sit next to the states
+// they most often go on to, hottest chains first and unvisited states last,
+// which packs the rows a scan actually reads into as few cache lines as
+// possible.
+dfa_tables_t *ReorderDfaTables(const dfa_tables_t *tables, const dfa_profile_t *profile);
+
+#endif // LEX_PROFILE_H
@@ -0,0 +1,103 @@
+#include "scan.h"
+
+static inline bool Scan(const dfa_tables_t *tables, uint32_t width, dfa_profile_t *profile,
+                        uint32_t condition, const unsigned char *input, size_t length,
+                        bool atLineStart, lex_match_t *match);
+static inline uint32_t Step(const dfa_tables_t *tables, uint32_t width, size_t cell);
+
+bool ScanToken(const dfa_tables_t *tables, uint32_t condition, const unsigned char *input,
+               size_t length, bool atLineStart, lex_match_t *match)
+{
+    switch (tables->transitionWidth)
+    {
+    case 1:
+        return Scan(tables, 1, NULL, condition, input, length, atLineStart, match);
+    case 2:
+        return Scan(tables, 2, NULL, condition, input, length, atLineStart, match);
+    default:
+        return Scan(tables, 4, NULL, condition, input, length, atLineStart, match);
+    }
+}
+
+#ifdef LEX_PROFILE
+bool ProfileScanToken(const dfa_tables_t *tables, dfa_profile_t *profile, uint32_t condition,
+                      const unsigned char *input, size_t length, bool atLineStart,
+                      lex_match_t *match)
+{
+    return Scan(tables, tables->transitionWidth, profile, condition, input, length, atLineStart,
+                match);
+}
+#endif
+
+// Both callers pass profile as a constant, so ScanToken keeps no counting
+// code even when profiling is built in, and ScanToken passes width as one
+// too, giving a loop per transition width with no width test in it.
+static inline bool Scan(const dfa_tables_t *tables, uint32_t width, dfa_profile_t *profile,
+                        uint32_t condition, const unsigned char *input, size_t length,
+                        bool atLineStart, lex_match_t *match)
+{
+    const uint32_t classCount = tables->classCount;
+    const lex_condition_info_t *entry = &tables->conditions[condition];
+    uint32_t state = atLineStart ? entry->lineStart : entry->start;
+    match->length = 0;
+    match->rule = LEX_NO_RULE;
+#ifdef LEX_PROFILE
+    if (profile)
+    {
+        atomic_fetch_add_explicit(&profile->visits[state], 1, memory_order_relaxed);
+    }
+#else
+    (void)profile;
+#endif
+    for (size_t i = 0; i < length; ++i)
+    {
+        size_t cell = (size_t)state * classCount + tables->classMap[input[i]];
+        state = Step(tables, width, cell);
+#ifdef LEX_PROFILE
+        if (profile)
+        {
+            atomic_fetch_add_explicit(&profile->transitions[cell], 1, memory_order_relaxed);
+            if (state != LEX_DEAD_STATE)
+            {
+                atomic_fetch_add_explicit(&profile->visits[state], 1, memory_order_relaxed);
+            }
+        }
+#endif
+        if (state == LEX_DEAD_STATE)
+        {
+            break;
+        }
+
+        uint32_t rule = tables->accept[state];
+        if (rule == LEX_NO_RULE)
+        {
+            continue;
+        }
+        const lex_rule_info_t *info = &tables->rules[rule];
+        if ((info->anchor & ANCHOR_LINE_END) && !AtLineEnd(input, length, i + 1))
+        {
+            rule = tables->fallback[state];
+            if (rule == LEX_NO_RULE)
+            {
+                continue;
+            }
+            info = &tables->rules[rule];
+        }
+        match->rule = rule;
+        match->length = TokenLength(info->trail, info->fixedLength, i + 1);
+    }
+    return match->rule != LEX_NO_RULE;
+}
+
+static inline uint32_t Step(const dfa_tables_t *tables, uint32_t width, size_t cell)
+{
+    switch (width)
+    {
+    case 1:
+        return ((const uint8_t *)tables->transitions)[cell];
+    case 2:
+        return ((const uint16_t *)tables->transitions)[cell];
+    default:
+        return ((const uint32_t *)tables->transitions)[cell];
+    }
+}
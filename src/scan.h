@@ -0,0 +1,24 @@
+#ifndef LEX_SCAN_H
+#define LEX_SCAN_H
+
+#include "lex.h"
+#include "profile.h"
+#include "tables.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Finds the longest match at the start of input among the rules of the start
+// condition, preferring the earliest rule on ties. Returns false when no rule
+// matches a non-empty prefix.
+bool ScanToken(const dfa_tables_t *tables, uint32_t condition, const unsigned char *input,
+               size_t length, bool atLineStart, lex_match_t *match);
+
+#ifdef LEX_PROFILE
+// ScanToken that also counts the states it enters and the transitions it
+// takes in profile, which must have the tables' dimensions.
+bool ProfileScanToken(const dfa_tables_t *tables, dfa_profile_t *profile, uint32_t condition,
+                      const unsigned char *input, size_t length, bool atLineStart,
+                      lex_match_t *match);
+#endif
+
+#endif // LEX_SCAN_H
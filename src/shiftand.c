@@ -0,0 +1,161 @@
+#include "shiftand.h"
+#include <gc.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static void SetBit(shift_and_mask_t *mask, size_t bit);
+static unsigned LowestBit(uint64_t bits);
+static const nfa_node_t *BestAccepting(const shift_and_t *machine, const shift_and_mask_t *live,
+                                       bool atLineEnd);
+
+shift_and_t *BuildShiftAnd(const nfa_t *nfa)
+{
+    size_t count = nfa->nodes.length;
+    if (!nfa->positional || count > SHIFT_AND_MAX_POSITIONS)
+    {
+        return NULL;
+    }
+
+    shift_and_t *machine = GC_malloc(sizeof(shift_and_t));
+    machine->words = count > 64 ? 2 : 1;
+    machine->positionCount = count;
+    machine->positions = (const nfa_node_t *const *)nfa->nodes.data;
+    machine->ruleEnds = (const nfa_node_t *const *)nfa->ruleEnds.data;
+    memset(machine->byteMasks, 0, sizeof(machine->byteMasks));
+    memset(&machine->accepting, 0, sizeof(machine->accepting));
+    shift_and_mask_t single[SHIFT_AND_MAX_POSITIONS];
+    memset(single, 0, sizeof(single));
+    for (size_t p = 0; p < count; ++p)
+    {
+        const nfa_node_t *position = nfa->nodes.data[p];
+        for (int c = 0; c < 256; ++c)
+        {
+            if (NfaEdgeMatches(position, c))
+            {
+                SetBit(&machine->byteMasks[c], p);
+            }
+        }
+        if (position->acceptString)
+        {
+            SetBit(&machine->accepting, p);
+        }
+        for (size_t q = 0; nextSetBit(position->follow, &q); ++q)
+        {
+            SetBit(&single[p], q);
+        }
+    }
+
+    // Each entry is the previous entry without its lowest bit, plus that bit's
+    // follow set, so every table costs 256 unions.
+    size_t chunks = machine->words * 8;
+    machine->follow = GC_malloc_atomic(chunks * 256 * sizeof(shift_and_mask_t));
+    for (size_t k = 0; k < chunks; ++k)
+    {
+        shift_and_mask_t *table = machine->follow + k * 256;
+        memset(&table[0], 0, sizeof(shift_and_mask_t));
+        for (int b = 1; b < 256; ++b)
+        {
+            size_t p = k * 8 + LowestBit(b);
+            table[b] = table[b & (b - 1)];
+            if (p < count)
+            {
+                for (uint32_t w = 0; w < machine->words; ++w)
+                {
+                    table[b].word[w] |= single[p].word[w];
+                }
+            }
+        }
+    }
+    return machine;
+}
+
+bool ShiftAndScan(const shift_and_t *machine, uint32_t condition, const unsigned char *input,
+                  size_t length, bool atLineStart, lex_match_t *match)
+{
+    const uint32_t words = machine->words;
+    shift_and_mask_t live = {{0}};
+    SetBit(&live, 2 * condition + atLineStart);
+    match->length = 0;
+    match->rule = LEX_NO_RULE;
+    for (size_t i = 0; i < length; ++i)
+    {
+        shift_and_mask_t next = {{0}};
+        for (uint32_t w = 0; w < words; ++w)
+        {
+            const shift_and_mask_t *tables = machine->follow + w * 8 * 256;
+            for (uint64_t bits = live.word[w], k = 0; bits; bits >>= 8, ++k)
+            {
+                const shift_and_mask_t *entry = &tables[k * 256 + (bits & 0xFF)];
+                for (uint32_t v = 0; v < words; ++v)
+                {
+                    next.word[v] |= entry->word[v];
+                }
+            }
+        }
+        uint64_t any = 0;
+        uint64_t accepting = 0;
+        for (uint32_t w = 0; w < words; ++w)
+        {
+            live.word[w] = next.word[w] & machine->byteMasks[input[i]].word[w];
+            any |= live.word[w];
+            accepting |= live.word[w] & machine->accepting.word[w];
+        }
+        if (!any)
+        {
+            break;
+        }
+        if (!accepting)
+        {
+            continue;
+        }
+
+        const nfa_node_t *best = BestAccepting(machine, &live, AtLineEnd(input, length, i + 1));
+        if (!best)
+        {
+            continue;
+        }
+        const nfa_node_t *end = machine->ruleEnds[best->rule];
+        match->rule = best->rule;
+        match->length = TokenLength(end->trail, end->fixedLength, i + 1);
+    }
+    return match->rule != LEX_NO_RULE;
+}
+
+static void SetBit(shift_and_mask_t *mask, size_t bit)
+{
+    mask->word[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+// bits must not be zero.
+static unsigned LowestBit(uint64_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return index;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+// A position whose rule ends in $ only accepts when atLineEnd.
+static const nfa_node_t *BestAccepting(const shift_and_t *machine, const shift_and_mask_t *live,
+                                       bool atLineEnd)
+{
+    const nfa_node_t *best = NULL;
+    for (uint32_t w = 0; w < machine->words; ++w)
+    {
+        for (uint64_t bits = live->word[w] & machine->accepting.word[w]; bits; bits &= bits - 1)
+        {
+            const nfa_node_t *position = machine->positions[w * 64 + LowestBit(bits)];
+            if ((atLineEnd || !(position->anchor & ANCHOR_LINE_END)) &&
+                (!best || position->rule < best->rule))
+            {
+                best = position;
+            }
+        }
+    }
+    return best;
+}
@@ -0,0 +1,41 @@
+#ifndef LEX_SHIFTAND_H
+#define LEX_SHIFTAND_H
+
+#include "lex.h"
+#include "nfa.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bit-parallel simulation of a position automaton whose positions fit in one
+// or two 64-bit words. Bit p of a mask stands for position p.
+#define SHIFT_AND_MAX_WORDS 2
+#define SHIFT_AND_MAX_POSITIONS (64 * SHIFT_AND_MAX_WORDS)
+
+typedef struct
+{
+    uint64_t word[SHIFT_AND_MAX_WORDS];
+} shift_and_mask_t;
+
+// A step from the live set D on byte c is follow(D) & byteMasks[c]. follow(D)
+// is the union of one table entry per byte of D: follow[k * 256 + b] is the
+// union of the follow sets of the positions set in b when b is D's byte k.
+typedef struct
+{
+    uint32_t words;
+    uint32_t positionCount;
+    shift_and_mask_t byteMasks[256];
+    shift_and_mask_t *follow;
+    shift_and_mask_t accepting;
+    const nfa_node_t *const *positions;
+    const nfa_node_t *const *ruleEnds;
+} shift_and_t;
+
+// Returns NULL when nfa, which must be positional, has too many positions.
+shift_and_t *BuildShiftAnd(const nfa_t *nfa);
+
+// Same contract as ScanToken. Condition c starts from position 2c alone, or
+// 2c + 1 at the start of a line.
+bool ShiftAndScan(const shift_and_t *machine, uint32_t condition, const unsigned char *input,
+                  size_t length, bool atLineStart, lex_match_t *match);
+
+#endif // LEX_SHIFTAND_H
@@ -0,0 +1,181 @@
+#include "lex.h"
+#include "collector.h"
+#include <gc.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// Epoch-based reclamation. The slot's epoch only grows and starts at 1. A
+// reader publishes the epoch it saw before loading the scanner and clears it
+// to 0 on release. A publish swaps the scanner first and bumps the epoch
+// second, tagging the old scanner with the new epoch e: a reader whose epoch
+// is already >= e loaded the pointer after the swap, so the old scanner can be
+// destroyed once no reader holds an epoch in [1, e). All operations are
+// sequentially consistent, which is what this argument relies on.
+
+struct LEX_READER
+{
+    _Atomic uint64_t epoch;
+    atomic_bool attached;
+    lex_slot_t *slot;
+    lex_reader_t *next;
+};
+
+typedef struct LEX_RETIRED
+{
+    lex_scanner_t *scanner;
+    uint64_t epoch;
+    struct LEX_RETIRED *next;
+} lex_retired_t;
+
+struct LEX_SLOT
+{
+    _Atomic(lex_scanner_t *) current;
+    _Atomic uint64_t epoch;
+    // Reader records are reused after detaching and only freed with the slot,
+    // so walking this list never races with a free.
+    _Atomic(lex_reader_t *) readers;
+    _Atomic(lex_retired_t *) retired;
+    atomic_flag reclaiming;
+};
+
+static void PushRetired(lex_slot_t *slot, lex_retired_t *retired);
+static uint64_t OldestActiveEpoch(lex_slot_t *slot);
+
+lex_slot_t *LexCreateSlot(lex_scanner_t *scanner)
+{
+    RegisterCollectorThread();
+    lex_slot_t *slot = GC_malloc_uncollectable(sizeof(lex_slot_t));
+    atomic_init(&slot->current, scanner);
+    atomic_init(&slot->epoch, 1);
+    atomic_init(&slot->readers, NULL);
+    atomic_init(&slot->retired, NULL);
+    atomic_flag_clear(&slot->reclaiming);
+    return slot;
+}
+
+void LexDestroySlot(lex_slot_t *slot)
+{
+    RegisterCollectorThread();
+    LexDestroyScanner(atomic_load(&slot->current));
+    lex_retired_t *retired = atomic_load(&slot->retired);
+    while (retired)
+    {
+        lex_retired_t *next = retired->next;
+        LexDestroyScanner(retired->scanner);
+        free(retired);
+        retired = next;
+    }
+    lex_reader_t *reader = atomic_load(&slot->readers);
+    while (reader)
+    {
+        lex_reader_t *next = reader->next;
+        free(reader);
+        reader = next;
+    }
+    GC_free(slot);
+}
+
+// Reader records come from malloc, so attaching and detaching never touch
+// the collector.
+lex_reader_t *LexAttachReader(lex_slot_t *slot)
+{
+    for (lex_reader_t *reader = atomic_load(&slot->readers); reader; reader = reader->next)
+    {
+        bool attached = false;
+        if (atomic_compare_exchange_strong(&reader->attached, &attached, true))
+        {
+            return reader;
+        }
+    }
+
+    lex_reader_t *reader = malloc(sizeof(lex_reader_t));
+    atomic_init(&reader->epoch, 0);
+    atomic_init(&reader->attached, true);
+    reader->slot = slot;
+    reader->next = atomic_load(&slot->readers);
+    while (!atomic_compare_exchange_weak(&slot->readers, &reader->next, reader))
+    {
+    }
+    return reader;
+}
+
+void LexDetachReader(lex_reader_t *reader)
+{
+    atomic_store(&reader->epoch, 0);
+    atomic_store(&reader->attached, false);
+}
+
+const lex_scanner_t *LexAcquireScanner(lex_reader_t *reader)
+{
+    atomic_store(&reader->epoch, atomic_load(&reader->slot->epoch));
+    return atomic_load(&reader->slot->current);
+}
+
+void LexReleaseScanner(lex_reader_t *reader)
+{
+    atomic_store(&reader->epoch, 0);
+}
+
+void LexPublishScanner(lex_slot_t *slot, lex_scanner_t *scanner)
+{
+    RegisterCollectorThread();
+    lex_retired_t *retired = malloc(sizeof(lex_retired_t));
+    retired->scanner = atomic_exchange(&slot->current, scanner);
+    retired->epoch = atomic_fetch_add(&slot->epoch, 1) + 1;
+    PushRetired(slot, retired);
+    LexReclaimScanners(slot);
+}
+
+size_t LexReclaimScanners(lex_slot_t *slot)
+{
+    RegisterCollectorThread();
+    // Only writers come through here, and a reclaim never waits on readers,
+    // so spinning behind another writer is brief.
+    while (atomic_flag_test_and_set(&slot->reclaiming))
+    {
+    }
+    lex_retired_t *retired = atomic_exchange(&slot->retired, NULL);
+    uint64_t oldest = OldestActiveEpoch(slot);
+    size_t pending = 0;
+    while (retired)
+    {
+        lex_retired_t *next = retired->next;
+        if (retired->epoch <= oldest)
+        {
+            LexDestroyScanner(retired->scanner);
+            free(retired);
+        }
+        else
+        {
+            PushRetired(slot, retired);
+            ++pending;
+        }
+        retired = next;
+    }
+    atomic_flag_clear(&slot->reclaiming);
+    return pending;
+}
+
+static void PushRetired(lex_slot_t *slot, lex_retired_t *retired)
+{
+    retired->next = atomic_load(&slot->retired);
+    while (!atomic_compare_exchange_weak(&slot->retired, &retired->next, retired))
+    {
+    }
+}
+
+// Returns the smallest epoch a reader currently holds, or UINT64_MAX when no
+// reader holds a scanner.
+static uint64_t OldestActiveEpoch(lex_slot_t *slot)
+{
+    uint64_t oldest = UINT64_MAX;
+    for (lex_reader_t *reader = atomic_load(&slot->readers); reader; reader = reader->next)
+    {
+        uint64_t epoch = atomic_load(&reader->epoch);
+        if (epoch != 0 && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
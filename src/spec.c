@@ -0,0 +1,382 @@
+#include "spec.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *ReadFile(const char *path, size_t *length);
+static char *NextLine(char *line);
+static bool IsSectionSeparator(const char *line);
+static bool IsDirective(const char *line, const char *directive);
+static bool AddMacro(lex_spec_t *spec, char *line);
+static bool AddConditions(lex_spec_t *spec, const char *text, char *line, lex_error_t *error);
+static bool SetOptions(lex_spec_t *spec, const char *text, char *line, lex_error_t *error);
+static char *AddKeywords(lex_spec_t *spec, const char *text, char *line);
+static start_condition_t *NewCondition(const char *name, size_t length, bool exclusive);
+static void SetSpecError(lex_error_t *error, const char *text, const char *at,
+                         const char *message, const char *detail, int detailLength);
+static void Locate(const char *text, const char *at, lex_error_t *error);
+
+lex_spec_t *ReadSpec(const char *path, lex_error_t *error)
+{
+    size_t length;
+    char *text = ReadFile(path, &length);
+    if (!text)
+    {
+        SetSpecError(error, "", "", "cannot read '%.*s'", path, (int)strlen(path));
+        error->line = 0;
+        error->column = 0;
+        return NULL;
+    }
+    return ParseSpec(path, text, length, error);
+}
+
+lex_spec_t *ParseSpec(const char *path, const char *source, size_t length, lex_error_t *error)
+{
+    char *text = GC_malloc_atomic(length + 1);
+    memcpy(text, source, length);
+    text[length] = '\0';
+
+    lex_spec_t *spec = GC_malloc(sizeof(lex_spec_t));
+    spec->path = path;
+    spec->macros = NULL;
+    spec->caseless = false;
+    vec_init(&spec->keywords);
+    vec_init(&spec->conditions);
+    vec_push(&spec->conditions, NewCondition("INITIAL", strlen("INITIAL"), false));
+    vec_char_t prologue;
+    vec_init(&prologue);
+    char *line = text;
+    while (*line && !IsSectionSeparator(line))
+    {
+        char *next = NextLine(line);
+        if (IsDirective(line, "%{"))
+        {
+            char *code = next;
+            while (*next && !IsDirective(next, "%}"))
+            {
+                next = NextLine(next);
+            }
+            vec_pusharr(&prologue, code, next - code);
+            next = NextLine(next);
+        }
+        else if (line[0] == ' ' || line[0] == '\t')
+        {
+            vec_pusharr(&prologue, line, next - line);
+        }
+        else if (line[0] == '%' && (line[1] == 's' || line[1] == 'x') &&
+                 (line[2] == ' ' || line[2] == '\t'))
+        {
+            if (!AddConditions(spec, text, line, error))
+            {
+                vec_deinit(&prologue);
+                return NULL;
+            }
+        }
+        else if (strncmp(line, "%option", strlen("%option")) == 0 &&
+                 (line[7] == ' ' || line[7] == '\t'))
+        {
+            if (!SetOptions(spec, text, line, error))
+            {
+                vec_deinit(&prologue);
+                return NULL;
+            }
+        }
+        else if (IsDirective(line, "%keywords"))
+        {
+            next = AddKeywords(spec, text, next);
+        }
+        else if (!isspace(line[0]) && line[0] != '%' && !AddMacro(spec, line))
+        {
+            int nameLength = 0;
+            while (line[nameLength] && !isspace(line[nameLength]))
+            {
+                ++nameLength;
+            }
+            SetSpecError(error, text, line, "macro '%.*s' has no definition", line, nameLength);
+            vec_deinit(&prologue);
+            return NULL;
+        }
+        line = next;
+    }
+    vec_push(&prologue, '\0');
+    spec->prologue = GC_strdup(prologue.data);
+    vec_deinit(&prologue);
+    if (!*line)
+    {
+        SetSpecError(error, text, line, "missing %%%% before the rules section", "", 0);
+        return NULL;
+    }
+
+    char *rules = NextLine(line);
+    spec->rulesOffset = rules - text;
+    spec->rulesLine = 1;
+    for (const char *p = text; p < rules; ++p)
+    {
+        spec->rulesLine += *p == '\n';
+    }
+    char *end = rules;
+    while (*end && !IsSectionSeparator(end))
+    {
+        end = NextLine(end);
+    }
+    spec->rulesLength = end - rules;
+    spec->rules = GC_strndup(rules, spec->rulesLength);
+    spec->epilogue = GC_strdup(NextLine(end));
+    return spec;
+}
+
+static char *ReadFile(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+    size_t capacity = 4096;
+    char *text = GC_malloc_atomic(capacity);
+    *length = 0;
+    size_t n;
+    while ((n = fread(text + *length, 1, capacity - *length - 1, file)) > 0)
+    {
+        *length += n;
+        if (capacity - *length == 1)
+        {
+            capacity *= 2;
+            text = GC_realloc(text, capacity);
+        }
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    if (failed)
+    {
+        return NULL;
+    }
+    text[*length] = '\0';
+    return text;
+}
+
+static char *NextLine(char *line)
+{
+    char *eol = strchr(line, '\n');
+    return eol ? eol + 1 : line + strlen(line);
+}
+
+static bool IsSectionSeparator(const char *line)
+{
+    return line[0] == '%' && line[1] == '%' &&
+           (line[2] == '\n' || line[2] == '\r' || line[2] == '\0');
+}
+
+static bool IsDirective(const char *line, const char *directive)
+{
+    size_t length = strlen(directive);
+    return strncmp(line, directive, length) == 0 &&
+           (line[length] == '\n' || line[length] == '\r' || line[length] == '\0');
+}
+
+static bool AddMacro(lex_spec_t *spec, char *line)
+{
+    char *nameEnd = line;
+    while (*nameEnd && !isspace(*nameEnd))
+    {
+        ++nameEnd;
+    }
+    char *definition = nameEnd;
+    while (*definition == ' ' || *definition == '\t')
+    {
+        ++definition;
+    }
+    char *definitionEnd = definition;
+    while (*definitionEnd && *definitionEnd != '\n' && *definitionEnd != '\r')
+    {
+        ++definitionEnd;
+    }
+    while (definitionEnd > definition && isspace(definitionEnd[-1]))
+    {
+        --definitionEnd;
+    }
+    if (definitionEnd == definition)
+    {
+        return false;
+    }
+
+    macro_t *macro = GC_malloc(sizeof(macro_t));
+    macro->name = GC_strndup(line, nameEnd - line);
+    macro->definition = GC_strndup(definition, definitionEnd - definition);
+    HASH_ADD_KEYPTR(hh, spec->macros, macro->name, strlen(macro->name), macro);
+    return true;
+}
+
+// Declares each name on a %s or %x line, which must be a C identifier not
+// yet declared.
+static bool AddConditions(lex_spec_t *spec, const char *text, char *line, lex_error_t *error)
+{
+    bool exclusive = line[1] == 'x';
+    char *p = line + 2;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t')
+        {
+            ++p;
+        }
+        char *name = p;
+        while (*p && !isspace(*p))
+        {
+            ++p;
+        }
+        int length = p - name;
+        if (length == 0)
+        {
+            return true;
+        }
+        bool identifier = isalpha(name[0]) || name[0] == '_';
+        for (int i = 1; i < length; ++i)
+        {
+            identifier = identifier && (isalnum(name[i]) || name[i] == '_');
+        }
+        if (!identifier)
+        {
+            SetSpecError(error, text, name, "start condition '%.*s' is not an identifier", name,
+                         length);
+            return false;
+        }
+        start_condition_t *condition;
+        int i;
+        vec_foreach(&spec->conditions, condition, i)
+        {
+            if (strlen(condition->name) == (size_t)length &&
+                strncmp(condition->name, name, length) == 0)
+            {
+                SetSpecError(error, text, name, "start condition '%.*s' is already declared",
+                             name, length);
+                return false;
+            }
+        }
+        vec_push(&spec->conditions, NewCondition(name, length, exclusive));
+    }
+}
+
+// Applies each option named on a %option line. case-insensitive (or its
+// synonym caseless) makes every rule ignore case; case-sensitive undoes it.
+static bool SetOptions(lex_spec_t *spec, const char *text, char *line, lex_error_t *error)
+{
+    char *p = line + strlen("%option");
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t')
+        {
+            ++p;
+        }
+        char *name = p;
+        while (*p && !isspace(*p))
+        {
+            ++p;
+        }
+        int length = p - name;
+        if (length == 0)
+        {
+            return true;
+        }
+        if ((length == 16 && strncmp(name, "case-insensitive", 16) == 0) ||
+            (length == 8 && strncmp(name, "caseless", 8) == 0))
+        {
+            spec->caseless = true;
+        }
+        else if (length == 14 && strncmp(name, "case-sensitive", 14) == 0)
+        {
+            spec->caseless = false;
+        }
+        else
+        {
+            SetSpecError(error, text, name, "unknown option '%.*s'", name, length);
+            return false;
+        }
+    }
+}
+
+// Adds one keyword per `word action` line from line up to the next line that
+// starts with %, skipping blank lines, and returns that line.
+static char *AddKeywords(lex_spec_t *spec, const char *text, char *line)
+{
+    for (; *line && *line != '%'; line = NextLine(line))
+    {
+        char *word = line;
+        while (*word == ' ' || *word == '\t')
+        {
+            ++word;
+        }
+        char *wordEnd = word;
+        while (*wordEnd && !isspace(*wordEnd))
+        {
+            ++wordEnd;
+        }
+        if (wordEnd == word)
+        {
+            continue;
+        }
+        char *action = wordEnd;
+        while (*action == ' ' || *action == '\t')
+        {
+            ++action;
+        }
+        char *actionEnd = action;
+        while (*actionEnd && *actionEnd != '\n')
+        {
+            ++actionEnd;
+        }
+        while (actionEnd > action && isspace(actionEnd[-1]))
+        {
+            --actionEnd;
+        }
+
+        keyword_t *keyword = GC_malloc(sizeof(keyword_t));
+        keyword->word = GC_strndup(word, wordEnd - word);
+        keyword->action = GC_strndup(action, actionEnd - action);
+        lex_error_t at;
+        Locate(text, word, &at);
+        keyword->offset = at.offset;
+        keyword->line = at.line;
+        keyword->column = at.column;
+        vec_push(&spec->keywords, keyword);
+    }
+    return line;
+}
+
+static start_condition_t *NewCondition(const char *name, size_t length, bool exclusive)
+{
+    start_condition_t *condition = GC_malloc(sizeof(start_condition_t));
+    condition->name = GC_strndup(name, length);
+    condition->exclusive = exclusive;
+    return condition;
+}
+
+// message has one %.*s, filled from detail.
+static void SetSpecError(lex_error_t *error, const char *text, const char *at,
+                         const char *message, const char *detail, int detailLength)
+{
+    int length = snprintf(NULL, 0, message, detailLength, detail);
+    error->message = GC_malloc_atomic(length + 1);
+    snprintf(error->message, length + 1, message, detailLength, detail);
+    Locate(text, at, error);
+}
+
+// Fills in where at, which points into text, is.
+static void Locate(const char *text, const char *at, lex_error_t *error)
+{
+    error->offset = at - text;
+    error->line = 1;
+    error->column = 1;
+    for (const char *p = text; p < at; ++p)
+    {
+        if (*p == '\n')
+        {
+            ++error->line;
+            error->column = 1;
+        }
+        else
+        {
+            ++error->column;
+        }
+    }
+}
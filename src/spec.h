@@ -0,0 +1,50 @@
+#ifndef LEX_SPEC_H
+#define LEX_SPEC_H
+
+#include "nfa.h"
+
+// A %keywords entry. line and column place word in the spec text.
+typedef struct
+{
+    char *word;
+    char *action;
+    size_t offset;
+    size_t line;
+    size_t column;
+} keyword_t;
+
+typedef vec_t(keyword_t *) vec_keyword_t;
+
+// A specification is a definitions section of `NAME definition` macro lines,
+// `%s NAME...` or `%x NAME...` start condition declarations, `%option
+// NAME...` lines and `%keywords` blocks of `word action` lines, a line
+// holding only %%, and then one `[<conditions>]regex action` rule per line up
+// to an optional second %% line. Code in %{ %} blocks or on indented lines of
+// the definitions section, and everything after the second %%, is copied into
+// a generated scanner as is.
+typedef struct
+{
+    const char *path;
+    macro_t *macros;
+    // INITIAL first, then the declared conditions in order.
+    vec_start_condition_t conditions;
+    // Set by %option case-insensitive.
+    bool caseless;
+    // Words a rule matches that take their own actions instead; see
+    // CompileKeywords.
+    vec_keyword_t keywords;
+    char *rules;
+    size_t rulesLength;
+    // Where rules begins in the spec text, for error positions.
+    size_t rulesOffset;
+    size_t rulesLine;
+    char *prologue;
+    char *epilogue;
+} lex_spec_t;
+
+// Both return NULL and fill *error when the text is not a specification.
+// path only labels the spec; ParseSpec copies the text it is given.
+lex_spec_t *ReadSpec(const char *path, lex_error_t *error);
+lex_spec_t *ParseSpec(const char *path, const char *text, size_t length, lex_error_t *error);
+
+#endif // LEX_SPEC_H
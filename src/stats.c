@@ -0,0 +1,117 @@
+#include "stats.h"
+#include <gc.h>
+#include <time.h>
+
+static const char *const kPhaseNames[LEX_PHASE_COUNT] = {
+    "read spec", "nfa construction", "subset construction", "minimization", "tables",
+    "reordering", "emission",
+};
+
+static const char *const kCounterNames[LEX_COUNTER_COUNT] = {
+    "nfa nodes", "nfa nodes reused", "nfa positions", "dfa states", "minimized states",
+    "closures",  "bitsets",
+};
+
+static double NowMicroseconds(void);
+
+void InitLexStats(lex_stats_t *stats)
+{
+    *stats = (lex_stats_t){.origin = NowMicroseconds()};
+}
+
+void LexStatsBeginPhase(lex_stats_t *stats, lex_phase_t phase)
+{
+    if (stats)
+    {
+        lex_phase_record_t *record = &stats->phases[phase];
+        record->resumed = NowMicroseconds() - stats->origin;
+        if (!record->ran)
+        {
+            record->ran = true;
+            record->start = record->resumed;
+        }
+    }
+}
+
+void LexStatsEndPhase(lex_stats_t *stats, lex_phase_t phase)
+{
+    if (stats)
+    {
+        lex_phase_record_t *record = &stats->phases[phase];
+        record->duration += NowMicroseconds() - stats->origin - record->resumed;
+        record->heapSize = GC_get_heap_size();
+        record->collections = GC_get_gc_no();
+    }
+}
+
+void LexStatsCount(lex_stats_t *stats, lex_counter_t counter, size_t amount)
+{
+    if (stats)
+    {
+        stats->counters[counter] += amount;
+    }
+}
+
+void PrintLexStats(const lex_stats_t *stats, FILE *out)
+{
+    fprintf(out, "%-20s %12s %12s %12s\n", "phase", "time (ms)", "heap (KiB)", "collections");
+    double total = 0;
+    for (int i = 0; i < LEX_PHASE_COUNT; ++i)
+    {
+        const lex_phase_record_t *record = &stats->phases[i];
+        if (record->ran)
+        {
+            total += record->duration;
+            fprintf(out, "%-20s %12.3f %12zu %12zu\n", kPhaseNames[i], record->duration / 1000,
+                    record->heapSize / 1024, record->collections);
+        }
+    }
+    fprintf(out, "%-20s %12.3f\n\n", "total", total / 1000);
+    for (int i = 0; i < LEX_COUNTER_COUNT; ++i)
+    {
+        fprintf(out, "%-20s %12zu\n", kCounterNames[i], stats->counters[i]);
+    }
+}
+
+bool WriteLexStatsTrace(const lex_stats_t *stats, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        return false;
+    }
+
+    fputs("{\"traceEvents\":[", out);
+    const char *separator = "\n";
+    for (int i = 0; i < LEX_PHASE_COUNT; ++i)
+    {
+        const lex_phase_record_t *record = &stats->phases[i];
+        if (!record->ran)
+        {
+            continue;
+        }
+        fprintf(out,
+                "%s{\"name\":\"%s\",\"cat\":\"compile\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"collections\":%zu}},\n"
+                "{\"name\":\"heap\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+                "\"args\":{\"bytes\":%zu}}",
+                separator, kPhaseNames[i], record->start, record->duration, record->collections,
+                record->start + record->duration, record->heapSize);
+        separator = ",\n";
+    }
+    fputs("],\n\"otherData\":{", out);
+    for (int i = 0; i < LEX_COUNTER_COUNT; ++i)
+    {
+        fprintf(out, "%s\"%s\":%zu", i ? "," : "", kCounterNames[i], stats->counters[i]);
+    }
+    fputs("}}\n", out);
+    bool ok = !ferror(out);
+    return fclose(out) == 0 && ok;
+}
+
+static double NowMicroseconds(void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
@@ -0,0 +1,64 @@
+#ifndef LEX_STATS_H
+#define LEX_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum
+{
+    LEX_PHASE_READ_SPEC,
+    LEX_PHASE_NFA,
+    LEX_PHASE_DFA,
+    LEX_PHASE_MINIMIZE,
+    LEX_PHASE_TABLES,
+    LEX_PHASE_REORDER,
+    LEX_PHASE_EMIT,
+    LEX_PHASE_COUNT,
+} lex_phase_t;
+
+typedef enum
+{
+    LEX_COUNTER_NFA_NODES,
+    LEX_COUNTER_NFA_NODES_REUSED,
+    LEX_COUNTER_NFA_POSITIONS,
+    LEX_COUNTER_DFA_STATES,
+    LEX_COUNTER_MINIMIZED_STATES,
+    LEX_COUNTER_CLOSURES,
+    LEX_COUNTER_BITSETS,
+    LEX_COUNTER_COUNT,
+} lex_counter_t;
+
+typedef struct
+{
+    bool ran;
+    double start;
+    double resumed;
+    double duration;
+    size_t heapSize;
+    size_t collections;
+} lex_phase_record_t;
+
+// Times are in microseconds since the stats were enabled; heap size and
+// collection count are the Boehm GC's figures when the phase ended. A phase
+// begun again adds to its duration and keeps the start of its first run.
+typedef struct
+{
+    double origin;
+    lex_phase_record_t phases[LEX_PHASE_COUNT];
+    size_t counters[LEX_COUNTER_COUNT];
+} lex_stats_t;
+
+// Compile stages take a lex_stats_t pointer that may be NULL, in which case
+// every recording call is a no-op and nothing is collected.
+void InitLexStats(lex_stats_t *stats);
+void LexStatsBeginPhase(lex_stats_t *stats, lex_phase_t phase);
+void LexStatsEndPhase(lex_stats_t *stats, lex_phase_t phase);
+void LexStatsCount(lex_stats_t *stats, lex_counter_t counter, size_t amount);
+
+void PrintLexStats(const lex_stats_t *stats, FILE *out);
+// Writes the phases as complete ("X") events and the heap size as a counter
+// track in the Chrome trace-event format, for chrome://tracing or Perfetto.
+bool WriteLexStatsTrace(const lex_stats_t *stats, const char *path);
+
+#endif // LEX_STATS_H
@@ -0,0 +1,221 @@
+#include "tables.h"
+#include <string.h>
+
+#define UNNUMBERED UINT32_MAX
+
+static uint32_t *ComputeColumn(dfa_t *dfa, uint32_t stateCount, int c);
+static void Number(uint32_t state, uint32_t *numbers, uint32_t *byNumber, uint32_t *count);
+
+dfa_tables_t *BuildDfaTables(dfa_t *dfa, nfa_t *nfa)
+{
+    dfa_tables_t *tables = GC_malloc(sizeof(dfa_tables_t));
+    uint32_t stateCount = dfa->nodes.length + 1;
+    tables->stateCount = stateCount;
+    tables->ruleCount = nfa->ruleCount;
+
+    // Bytes whose columns are identical across every state share a class.
+    uint8_t *classMap = GC_malloc_atomic(LEX_BYTE_COUNT);
+    uint32_t *columns[LEX_BYTE_COUNT];
+    uint32_t classCount = 0;
+    for (int c = 0; c < LEX_BYTE_COUNT; ++c)
+    {
+        uint32_t *column = ComputeColumn(dfa, stateCount, c);
+        uint32_t k = 0;
+        while (k < classCount && memcmp(columns[k], column, stateCount * sizeof(uint32_t)) != 0)
+        {
+            ++k;
+        }
+        if (k == classCount)
+        {
+            columns[classCount++] = column;
+        }
+        classMap[c] = k;
+    }
+    tables->classCount = classCount;
+    tables->classMap = classMap;
+
+    uint32_t *transitions = GC_malloc_atomic((size_t)stateCount * classCount * sizeof(uint32_t));
+    uint32_t *accept = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    uint32_t *fallback = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    accept[LEX_DEAD_STATE] = LEX_NO_RULE;
+    fallback[LEX_DEAD_STATE] = LEX_NO_RULE;
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        for (uint32_t k = 0; k < classCount; ++k)
+        {
+            transitions[(size_t)s * classCount + k] = columns[k][s];
+        }
+        if (s != LEX_DEAD_STATE)
+        {
+            dfa_node_t *node = dfa->nodes.data[s - 1];
+            accept[s] = node->acceptString ? node->rule : LEX_NO_RULE;
+            fallback[s] = node->fallback == SIZE_MAX ? LEX_NO_RULE : node->fallback;
+        }
+    }
+    PackDfaTransitions(tables, transitions);
+    tables->accept = accept;
+    tables->fallback = fallback;
+
+    lex_rule_info_t *rules = GC_malloc_atomic(nfa->ruleCount * sizeof(lex_rule_info_t));
+    size_t stringsSize = 0;
+    nfa_node_t *node;
+    int i;
+    vec_foreach(&nfa->ruleEnds, node, i)
+    {
+        stringsSize += strlen(node->acceptString) + 1;
+    }
+    start_condition_t *condition;
+    vec_foreach(&nfa->conditions, condition, i)
+    {
+        stringsSize += strlen(condition->name) + 1;
+    }
+    char *strings = GC_malloc_atomic(stringsSize ? stringsSize : 1);
+    uint32_t offset = 0;
+    vec_foreach(&nfa->ruleEnds, node, i)
+    {
+        lex_rule_info_t *rule = &rules[node->rule];
+        rule->anchor = node->anchor;
+        rule->trail = node->trail;
+        rule->fixedLength = node->fixedLength;
+        rule->actionOffset = offset;
+        rule->actionLength = strlen(node->acceptString);
+        memcpy(strings + offset, node->acceptString, rule->actionLength + 1);
+        offset += rule->actionLength + 1;
+    }
+    tables->rules = rules;
+
+    lex_condition_info_t *conditions =
+        GC_malloc_atomic(nfa->conditions.length * sizeof(lex_condition_info_t));
+    vec_foreach(&nfa->conditions, condition, i)
+    {
+        conditions[i].start = dfa->starts.data[2 * i] + 1;
+        conditions[i].lineStart = dfa->starts.data[2 * i + 1] + 1;
+        conditions[i].nameOffset = offset;
+        conditions[i].nameLength = strlen(condition->name);
+        memcpy(strings + offset, condition->name, conditions[i].nameLength + 1);
+        offset += conditions[i].nameLength + 1;
+    }
+    tables->conditionCount = nfa->conditions.length;
+    tables->conditions = conditions;
+    tables->strings = strings;
+    tables->stringsSize = stringsSize;
+    return tables;
+}
+
+uint32_t *NumberStatesCanonically(const dfa_tables_t *tables)
+{
+    const uint32_t stateCount = tables->stateCount;
+    uint32_t *numbers = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    uint32_t *byNumber = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        numbers[s] = UNNUMBERED;
+    }
+    uint32_t count = 0;
+    Number(LEX_DEAD_STATE, numbers, byNumber, &count);
+    for (uint32_t c = 0; c < tables->conditionCount; ++c)
+    {
+        Number(tables->conditions[c].start, numbers, byNumber, &count);
+        Number(tables->conditions[c].lineStart, numbers, byNumber, &count);
+    }
+    for (uint32_t next = 1; next < count; ++next)
+    {
+        for (uint32_t k = 0; k < tables->classCount; ++k)
+        {
+            Number(DfaTransition(tables, byNumber[next], k), numbers, byNumber, &count);
+        }
+    }
+    // Minimized tables reach every state; any others keep their order.
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        Number(s, numbers, byNumber, &count);
+    }
+    return numbers;
+}
+
+dfa_tables_t *RenumberDfaStates(const dfa_tables_t *tables, const uint32_t *order)
+{
+    dfa_tables_t *result = GC_malloc(sizeof(dfa_tables_t));
+    *result = *tables;
+    const uint32_t stateCount = tables->stateCount;
+    const uint32_t classCount = tables->classCount;
+    uint32_t *transitions = GC_malloc_atomic((size_t)stateCount * classCount * sizeof(uint32_t));
+    uint32_t *accept = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    uint32_t *fallback = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    for (uint32_t s = 0; s < stateCount; ++s)
+    {
+        uint32_t *target = transitions + (size_t)order[s] * classCount;
+        for (uint32_t k = 0; k < classCount; ++k)
+        {
+            target[k] = order[DfaTransition(tables, s, k)];
+        }
+        accept[order[s]] = tables->accept[s];
+        fallback[order[s]] = tables->fallback[s];
+    }
+    PackDfaTransitions(result, transitions);
+    result->accept = accept;
+    result->fallback = fallback;
+
+    lex_condition_info_t *conditions =
+        GC_malloc_atomic(tables->conditionCount * sizeof(lex_condition_info_t));
+    for (uint32_t c = 0; c < tables->conditionCount; ++c)
+    {
+        conditions[c] = tables->conditions[c];
+        conditions[c].start = order[conditions[c].start];
+        conditions[c].lineStart = order[conditions[c].lineStart];
+    }
+    result->conditions = conditions;
+    return result;
+}
+
+void PackDfaTransitions(dfa_tables_t *tables, const uint32_t *transitions)
+{
+    const size_t cells = (size_t)tables->stateCount * tables->classCount;
+    tables->transitionWidth = tables->stateCount <= UINT8_MAX + 1    ? 1
+                              : tables->stateCount <= UINT16_MAX + 1 ? 2
+                                                                     : 4;
+    if (tables->transitionWidth == 4)
+    {
+        tables->transitions = transitions;
+        return;
+    }
+    void *packed = GC_malloc_atomic(cells * tables->transitionWidth);
+    for (size_t cell = 0; cell < cells; ++cell)
+    {
+        if (tables->transitionWidth == 1)
+        {
+            ((uint8_t *)packed)[cell] = transitions[cell];
+        }
+        else
+        {
+            ((uint16_t *)packed)[cell] = transitions[cell];
+        }
+    }
+    tables->transitions = packed;
+}
+
+// Gives state the next number unless it has one.
+static void Number(uint32_t state, uint32_t *numbers, uint32_t *byNumber, uint32_t *count)
+{
+    if (numbers[state] == UNNUMBERED)
+    {
+        numbers[state] = *count;
+        byNumber[(*count)++] = state;
+    }
+}
+
+static uint32_t *ComputeColumn(dfa_t *dfa, uint32_t stateCount, int c)
+{
+    uint32_t *column = GC_malloc_atomic(stateCount * sizeof(uint32_t));
+    column[LEX_DEAD_STATE] = LEX_DEAD_STATE;
+    for (uint32_t s = 1; s < stateCount; ++s)
+    {
+        dfa_node_t *next = NULL;
+        if (c < DFA_ALPHABET_SIZE)
+        {
+            next = DfaNodeFollowEdge(dfa->nodes.data[s - 1], c);
+        }
+        column[s] = next ? next->index + 1 : LEX_DEAD_STATE;
+    }
+    return column;
+}
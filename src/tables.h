@@ -0,0 +1,92 @@
+#ifndef LEX_TABLES_H
+#define LEX_TABLES_H
+
+#include "dfa.h"
+#include "keywords.h"
+#include "nfa.h"
+#include <stdint.h>
+
+// Row 0 of every transition table is the dead state, so a scanner indexes the
+// table for every byte and only has to compare the result against 0.
+#define LEX_DEAD_STATE 0
+#define LEX_BYTE_COUNT 0x100
+
+// trail and fixedLength describe trailing context as on the rule's NFA
+// accepting node; tables never hold a TRAIL_VARIABLE rule.
+typedef struct
+{
+    uint32_t anchor;
+    uint32_t actionOffset;
+    uint32_t actionLength;
+    uint32_t trail;
+    uint32_t fixedLength;
+} lex_rule_info_t;
+
+// Where a start condition enters the DFA mid-line and at the start of a line;
+// only the second reaches its ^ rules, so accepting never checks the line
+// position. Its name is nameLength bytes at nameOffset in strings.
+typedef struct
+{
+    uint32_t start;
+    uint32_t lineStart;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+} lex_condition_info_t;
+
+// Flat form of a DFA. Every pointer is const so the same view can describe
+// tables built in memory and tables mapped straight out of an image file.
+// A state whose accept rule ends in $ only accepts it when the next byte ends
+// a line or the input; otherwise it accepts fallback[state], which may be
+// LEX_NO_RULE. fallback is LEX_NO_RULE wherever accept is unconditional.
+// keywords, NULL without any, tells the spec's keywords apart from the other
+// matches of their rule.
+// Each transition takes transitionWidth bytes, 1, 2 or 4: the narrowest that
+// holds every state number, so a row of classCount of them spans as few cache
+// lines as it can. Read them with DfaTransition.
+typedef struct
+{
+    uint32_t stateCount;
+    uint32_t classCount;
+    uint32_t conditionCount;
+    uint32_t ruleCount;
+    uint32_t stringsSize;
+    uint32_t transitionWidth;
+    const uint8_t *classMap;
+    const void *transitions;
+    const uint32_t *accept;
+    const uint32_t *fallback;
+    const lex_rule_info_t *rules;
+    const lex_condition_info_t *conditions;
+    const char *strings;
+    const keyword_table_t *keywords;
+} dfa_tables_t;
+
+dfa_tables_t *BuildDfaTables(dfa_t *dfa, nfa_t *nfa);
+
+// The transition from state on class k.
+static inline uint32_t DfaTransition(const dfa_tables_t *tables, uint32_t state, uint32_t k)
+{
+    size_t cell = (size_t)state * tables->classCount + k;
+    switch (tables->transitionWidth)
+    {
+    case 1:
+        return ((const uint8_t *)tables->transitions)[cell];
+    case 2:
+        return ((const uint16_t *)tables->transitions)[cell];
+    default:
+        return ((const uint32_t *)tables->transitions)[cell];
+    }
+}
+// Stores stateCount * classCount transitions, already set in tables, at the
+// narrowest width that holds them.
+void PackDfaTransitions(dfa_tables_t *tables, const uint32_t *transitions);
+
+// Numbers the states breadth-first from the conditions' entries in order,
+// following transitions in class order, with the dead state 0. The numbering
+// depends only on the automaton, not on where the tables put each state.
+uint32_t *NumberStatesCanonically(const dfa_tables_t *tables);
+// Returns tables in which state s is numbered order[s], order being a
+// permutation that keeps the dead state 0.
+dfa_tables_t *RenumberDfaStates(const dfa_tables_t *tables, const uint32_t *order);
+
+#endif // LEX_TABLES_H
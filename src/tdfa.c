@@ -0,0 +1,555 @@
+#include "tdfa.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Scans whose DFA needs no more registers than this keep them on the stack.
+#define TDFA_STACK_REGISTERS 64
+
+// A configuration is an NFA node together with the value of each tag of the
+// node's rule: a register of the state being left, TDFA_POSITION for a tag
+// set on the way in, or TDFA_UNSET. NULL tags leave every tag unset.
+typedef struct
+{
+    size_t node;
+    const uint32_t *tags;
+} tdfa_config_t;
+
+typedef vec_t(tdfa_config_t) vec_tdfa_config_t;
+typedef vec_t(tdfa_transition_t) vec_tdfa_transition_t;
+typedef vec_t(tdfa_op_t) vec_tdfa_op_t;
+typedef vec_t(uint32_t) vec_uint32_t;
+
+// A state is identified by its configurations in priority order, with their
+// registers renumbered by first appearance. Two states that differ only in
+// which registers hold which tags then share one key, and the transition
+// into them carries the copies that line the registers up.
+typedef struct
+{
+    size_t *key;
+    size_t keyLength;
+    uint32_t index;
+    UT_hash_handle hh;
+} tdfa_state_t;
+
+typedef vec_t(tdfa_state_t *) vec_tdfa_state_t;
+
+typedef struct
+{
+    const nfa_t *nfa;
+    size_t *visited;
+    size_t stamp;
+    vec_tdfa_config_t stack;
+    tdfa_state_t *states;
+    vec_tdfa_state_t stateList;
+    uint32_t maxRegisters;
+    vec_uint32_t sources;
+    vec_tdfa_transition_t transitions;
+    vec_tdfa_op_t ops;
+    vec_uint32_t accept;
+    vec_uint32_t fallback;
+    vec_uint32_t finalOffset;
+    vec_uint32_t finals;
+    size_t bytes;
+    lex_stats_t *stats;
+} tdfa_builder_t;
+
+static uint32_t ComputeByteClasses(const nfa_t *nfa, uint8_t *classMap, int *representatives);
+static bool HasEdge(const nfa_node_t *node);
+static size_t TagCount(const tdfa_builder_t *builder, size_t node);
+static void CloseConfigs(tdfa_builder_t *builder, const vec_tdfa_config_t *kernel,
+                         vec_tdfa_config_t *closed);
+static tdfa_transition_t InternState(tdfa_builder_t *builder, const vec_tdfa_config_t *closed);
+static tdfa_state_t *AddState(tdfa_builder_t *builder, size_t *key, size_t keyLength,
+                              uint32_t registers);
+static void PushFinals(tdfa_builder_t *builder, size_t node, const size_t *tags);
+static void DecodeState(const tdfa_builder_t *builder, uint32_t state, vec_tdfa_config_t *configs);
+static void RunOps(const tagged_dfa_t *dfa, const tdfa_transition_t *transition, size_t position,
+                   size_t **current, size_t **next);
+static void RecordGroups(const tagged_dfa_t *dfa, const uint32_t *finals, uint32_t rule,
+                         const size_t *registers, size_t *offsets, size_t offsetCount);
+
+tagged_dfa_t *ConstructTaggedDfa(const nfa_t *nfa, const dfa_budget_t *budget, size_t *states,
+                                 lex_stats_t *stats)
+{
+    tagged_dfa_t *dfa = GC_malloc(sizeof(tagged_dfa_t));
+    int representatives[LEX_BYTE_COUNT];
+    dfa->classCount = ComputeByteClasses(nfa, dfa->classMap, representatives);
+    dfa->ruleCount = nfa->ruleCount;
+
+    tdfa_builder_t builder = {.nfa = nfa, .stamp = 0, .states = NULL,
+                              .maxRegisters = 0, .bytes = 0, .stats = stats};
+    builder.visited = GC_malloc_atomic(nfa->nodes.length * sizeof(size_t));
+    memset(builder.visited, 0, nfa->nodes.length * sizeof(size_t));
+    vec_init(&builder.stack);
+    vec_init(&builder.stateList);
+    vec_init(&builder.sources);
+    vec_init(&builder.transitions);
+    vec_init(&builder.ops);
+    vec_init(&builder.accept);
+    vec_init(&builder.fallback);
+    vec_init(&builder.finalOffset);
+    vec_init(&builder.finals);
+
+    // The dead state takes index 0 and row 0.
+    AddState(&builder, NULL, 0, 0);
+    tdfa_transition_t dead = {.state = LEX_DEAD_STATE, .opOffset = 0, .opCount = 0};
+    for (uint32_t k = 0; k < dfa->classCount; ++k)
+    {
+        vec_push(&builder.transitions, dead);
+    }
+
+    vec_tdfa_config_t kernel;
+    vec_tdfa_config_t closed;
+    vec_tdfa_config_t configs;
+    vec_init(&kernel);
+    vec_init(&closed);
+    vec_init(&configs);
+    dfa->conditionCount = nfa->conditions.length;
+    tdfa_transition_t *entries = GC_malloc_atomic(nfa->starts.length * sizeof(tdfa_transition_t));
+    for (int c = 0; c < nfa->starts.length; ++c)
+    {
+        tdfa_config_t initial = {.node = nfa->starts.data[c], .tags = NULL};
+        vec_clear(&kernel);
+        vec_push(&kernel, initial);
+        CloseConfigs(&builder, &kernel, &closed);
+        entries[c] = InternState(&builder, &closed);
+    }
+    dfa->entries = entries;
+
+    // States are numbered in the order they are found, so walking the numbers
+    // visits every state and lays the rows out in order.
+    for (uint32_t s = 1; s < (uint32_t)builder.stateList.length; ++s)
+    {
+        DecodeState(&builder, s, &configs);
+        for (uint32_t k = 0; k < dfa->classCount; ++k)
+        {
+            vec_clear(&kernel);
+            for (int i = 0; i < configs.length; ++i)
+            {
+                const nfa_node_t *node = nfa->nodes.data[configs.data[i].node];
+                if (HasEdge(node) && NfaEdgeMatches(node, representatives[k]))
+                {
+                    tdfa_config_t moved = {.node = node->next[0]->index,
+                                           .tags = configs.data[i].tags};
+                    vec_push(&kernel, moved);
+                }
+            }
+            tdfa_transition_t transition = dead;
+            if (kernel.length > 0)
+            {
+                CloseConfigs(&builder, &kernel, &closed);
+                transition = InternState(&builder, &closed);
+            }
+            vec_push(&builder.transitions, transition);
+        }
+        builder.bytes += dfa->classCount * sizeof(tdfa_transition_t);
+        size_t count = builder.stateList.length;
+        if (budget && ((budget->maxStates && count > budget->maxStates) ||
+                       (budget->maxBytes && builder.bytes > budget->maxBytes)))
+        {
+            *states = count;
+            LexStatsCount(stats, LEX_COUNTER_DFA_STATES, count);
+            return NULL;
+        }
+    }
+    vec_deinit(&kernel);
+    vec_deinit(&closed);
+    vec_deinit(&configs);
+    vec_deinit(&builder.stack);
+    LexStatsCount(stats, LEX_COUNTER_DFA_STATES, builder.stateList.length);
+
+    dfa->stateCount = builder.stateList.length;
+    dfa->maxRegisters = builder.maxRegisters;
+    dfa->transitions = builder.transitions.data;
+    dfa->ops = builder.ops.data;
+    dfa->accept = builder.accept.data;
+    dfa->fallback = builder.fallback.data;
+    dfa->finalOffset = builder.finalOffset.data;
+    dfa->finals = builder.finals.data;
+    uint32_t *ruleGroups = GC_malloc_atomic(nfa->ruleCount * sizeof(uint32_t));
+    for (size_t r = 0; r < nfa->ruleCount; ++r)
+    {
+        ruleGroups[r] = nfa->ruleGroups.data[r];
+    }
+    dfa->ruleGroups = ruleGroups;
+    dfa->ruleEnds = (const nfa_node_t *const *)nfa->ruleEnds.data;
+    *states = dfa->stateCount;
+    return dfa;
+}
+
+bool ScanTaggedToken(const tagged_dfa_t *dfa, uint32_t condition, const unsigned char *input,
+                     size_t length, bool atLineStart, lex_match_t *match, size_t *offsets,
+                     size_t offsetCount)
+{
+    size_t onStack[2 * TDFA_STACK_REGISTERS];
+    size_t *registers = onStack;
+    if (dfa->maxRegisters > TDFA_STACK_REGISTERS)
+    {
+        registers = malloc(2 * dfa->maxRegisters * sizeof(size_t));
+    }
+    size_t *current = registers;
+    size_t *next = registers + (dfa->maxRegisters > TDFA_STACK_REGISTERS ? dfa->maxRegisters
+                                                                         : TDFA_STACK_REGISTERS);
+    const tdfa_transition_t *entry = &dfa->entries[2 * condition + atLineStart];
+    if (entry->opCount > 0)
+    {
+        RunOps(dfa, entry, 0, &current, &next);
+    }
+
+    const uint32_t classCount = dfa->classCount;
+    uint32_t state = entry->state;
+    match->length = 0;
+    match->rule = LEX_NO_RULE;
+    for (size_t i = 0; i < length; ++i)
+    {
+        const tdfa_transition_t *transition =
+            &dfa->transitions[(size_t)state * classCount + dfa->classMap[input[i]]];
+        state = transition->state;
+        if (state == LEX_DEAD_STATE)
+        {
+            break;
+        }
+        if (transition->opCount > 0)
+        {
+            RunOps(dfa, transition, i + 1, &current, &next);
+        }
+
+        uint32_t rule = dfa->accept[state];
+        if (rule == LEX_NO_RULE)
+        {
+            continue;
+        }
+        const uint32_t *finals = dfa->finals + dfa->finalOffset[state];
+        const nfa_node_t *end = dfa->ruleEnds[rule];
+        if ((end->anchor & ANCHOR_LINE_END) && !AtLineEnd(input, length, i + 1))
+        {
+            // A $ rule has no trailing context, so only its groups precede
+            // the fallback's tags.
+            finals += 2 * (size_t)dfa->ruleGroups[rule];
+            rule = dfa->fallback[state];
+            if (rule == LEX_NO_RULE)
+            {
+                continue;
+            }
+            end = dfa->ruleEnds[rule];
+        }
+        match->rule = rule;
+        if (end->trail == TRAIL_VARIABLE)
+        {
+            match->length = current[finals[2 * dfa->ruleGroups[rule]]];
+        }
+        else
+        {
+            match->length = TokenLength(end->trail, end->fixedLength, i + 1);
+        }
+        RecordGroups(dfa, finals, rule, current, offsets, offsetCount);
+    }
+
+    // Slots past the matched rule's groups may hold an earlier candidate's.
+    bool matched = match->rule != LEX_NO_RULE;
+    size_t used = matched ? 2 + 2 * (size_t)dfa->ruleGroups[match->rule] : 0;
+    for (size_t slot = used; slot < offsetCount; ++slot)
+    {
+        offsets[slot] = LEX_NO_OFFSET;
+    }
+    if (matched && offsetCount >= 2)
+    {
+        offsets[0] = 0;
+        offsets[1] = match->length;
+    }
+    if (registers != onStack)
+    {
+        free(registers);
+    }
+    return matched;
+}
+
+// Two bytes fall in one class when every edge of the NFA matches both or
+// neither. Each edge splits the classes so far in two; the running split is
+// renumbered in order of first byte, so class k's first byte is its
+// representative.
+static uint32_t ComputeByteClasses(const nfa_t *nfa, uint8_t *classMap, int *representatives)
+{
+    uint32_t classCount = 1;
+    memset(classMap, 0, LEX_BYTE_COUNT);
+    for (int i = 0; i < nfa->nodes.length; ++i)
+    {
+        const nfa_node_t *node = nfa->nodes.data[i];
+        if (!HasEdge(node))
+        {
+            continue;
+        }
+        uint32_t split[2 * LEX_BYTE_COUNT];
+        memset(split, 0xFF, 2 * classCount * sizeof(uint32_t));
+        uint32_t splitCount = 0;
+        for (int c = 0; c < LEX_BYTE_COUNT; ++c)
+        {
+            uint32_t key = 2 * classMap[c] + NfaEdgeMatches(node, c);
+            if (split[key] == UINT32_MAX)
+            {
+                split[key] = splitCount++;
+            }
+            classMap[c] = split[key];
+        }
+        classCount = splitCount;
+    }
+    for (int c = LEX_BYTE_COUNT - 1; c >= 0; --c)
+    {
+        representatives[classMap[c]] = c;
+    }
+    return classCount;
+}
+
+static bool HasEdge(const nfa_node_t *node)
+{
+    return node->edge != EDGE_EPSILON && node->edge != EDGE_EMPTY;
+}
+
+static size_t TagCount(const tdfa_builder_t *builder, size_t node)
+{
+    size_t rule = builder->nfa->nodes.data[node]->rule;
+    bool variable = builder->nfa->ruleEnds.data[rule]->trail == TRAIL_VARIABLE;
+    return 2 * builder->nfa->ruleGroups.data[rule] + variable;
+}
+
+// Follows epsilon edges from each kernel configuration in turn, depth first
+// and preferred edge first, so the first path to reach a node is the one a
+// backtracking matcher would take and the configurations come out in
+// priority order. Tags met on the way are set to the position being entered.
+// Only nodes with an edge to take or a rule to accept are kept.
+static void CloseConfigs(tdfa_builder_t *builder, const vec_tdfa_config_t *kernel,
+                         vec_tdfa_config_t *closed)
+{
+    const nfa_t *nfa = builder->nfa;
+    LexStatsCount(builder->stats, LEX_COUNTER_CLOSURES, 1);
+    vec_clear(closed);
+    ++builder->stamp;
+    for (int k = 0; k < kernel->length; ++k)
+    {
+        vec_push(&builder->stack, kernel->data[k]);
+        while (builder->stack.length > 0)
+        {
+            tdfa_config_t config = vec_pop(&builder->stack);
+            if (builder->visited[config.node] == builder->stamp)
+            {
+                continue;
+            }
+            builder->visited[config.node] = builder->stamp;
+            const nfa_node_t *node = nfa->nodes.data[config.node];
+            if (node->tag)
+            {
+                size_t count = TagCount(builder, config.node);
+                uint32_t *tags = GC_malloc_atomic(count * sizeof(uint32_t));
+                for (size_t t = 0; t < count; ++t)
+                {
+                    tags[t] = config.tags ? config.tags[t] : TDFA_UNSET;
+                }
+                tags[node->tag - 1] = TDFA_POSITION;
+                config.tags = tags;
+            }
+            if (HasEdge(node) || node->acceptString)
+            {
+                vec_push(closed, config);
+            }
+            if (node->edge != EDGE_EPSILON)
+            {
+                continue;
+            }
+            for (int j = 1; j >= 0; --j)
+            {
+                if (node->next[j])
+                {
+                    tdfa_config_t next = {.node = node->next[j]->index, .tags = config.tags};
+                    vec_push(&builder->stack, next);
+                }
+            }
+        }
+    }
+}
+
+// Renumbers the registers of a closed configuration list, finds or adds the
+// state it denotes, and returns the transition into that state. sources[r]
+// is what the target's register r is filled from; when that is register r
+// itself throughout, the transition needs no ops.
+static tdfa_transition_t InternState(tdfa_builder_t *builder, const vec_tdfa_config_t *closed)
+{
+    size_t keyLength = 1 + closed->length;
+    for (int i = 0; i < closed->length; ++i)
+    {
+        keyLength += TagCount(builder, closed->data[i].node);
+    }
+    size_t *key = GC_malloc_atomic(keyLength * sizeof(size_t));
+    key[0] = closed->length;
+    size_t *tagKey = key + 1 + closed->length;
+    vec_clear(&builder->sources);
+    for (int i = 0; i < closed->length; ++i)
+    {
+        const tdfa_config_t *config = &closed->data[i];
+        key[1 + i] = config->node;
+        size_t count = TagCount(builder, config->node);
+        for (size_t t = 0; t < count; ++t)
+        {
+            uint32_t value = config->tags ? config->tags[t] : TDFA_UNSET;
+            if (value == TDFA_UNSET)
+            {
+                *tagKey++ = SIZE_MAX;
+                continue;
+            }
+            size_t r = 0;
+            while (r < (size_t)builder->sources.length && builder->sources.data[r] != value)
+            {
+                ++r;
+            }
+            if (r == (size_t)builder->sources.length)
+            {
+                vec_push(&builder->sources, value);
+            }
+            *tagKey++ = r;
+        }
+    }
+
+    tdfa_state_t *state;
+    HASH_FIND(hh, builder->states, key, keyLength * sizeof(size_t), state);
+    if (!state)
+    {
+        state = AddState(builder, key, keyLength, builder->sources.length);
+    }
+
+    tdfa_transition_t transition = {.state = state->index, .opOffset = 0, .opCount = 0};
+    bool identity = true;
+    for (uint32_t r = 0; r < (uint32_t)builder->sources.length; ++r)
+    {
+        identity = identity && builder->sources.data[r] == r;
+    }
+    if (!identity)
+    {
+        transition.opOffset = builder->ops.length;
+        transition.opCount = builder->sources.length;
+        for (uint32_t r = 0; r < (uint32_t)builder->sources.length; ++r)
+        {
+            tdfa_op_t op = {.target = r, .source = builder->sources.data[r]};
+            vec_push(&builder->ops, op);
+        }
+        builder->bytes += builder->sources.length * sizeof(tdfa_op_t);
+    }
+    return transition;
+}
+
+// A new state accepts the earliest rule among its configurations, reading
+// that rule's tags from the registers its configuration holds them in. When
+// that rule ends in $, the earliest rule without one falls back in its place
+// and its tags follow the first rule's.
+static tdfa_state_t *AddState(tdfa_builder_t *builder, size_t *key, size_t keyLength,
+                              uint32_t registers)
+{
+    tdfa_state_t *state = GC_malloc(sizeof(tdfa_state_t));
+    state->key = key;
+    state->keyLength = keyLength;
+    state->index = builder->stateList.length;
+    vec_push(&builder->stateList, state);
+    if (registers > builder->maxRegisters)
+    {
+        builder->maxRegisters = registers;
+    }
+    builder->bytes += sizeof(tdfa_state_t) + keyLength * sizeof(size_t);
+    if (key)
+    {
+        HASH_ADD_KEYPTR(hh, builder->states, state->key, keyLength * sizeof(size_t), state);
+    }
+
+    uint32_t rule = LEX_NO_RULE;
+    uint32_t fallback = LEX_NO_RULE;
+    size_t ruleConfig = 0;
+    size_t fallbackConfig = 0;
+    const size_t *acceptTags = NULL;
+    const size_t *fallbackTags = NULL;
+    size_t count = key ? key[0] : 0;
+    const size_t *tagKey = key ? key + 1 + count : NULL;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const nfa_node_t *node = builder->nfa->nodes.data[key[1 + i]];
+        if (node->acceptString && node->rule < rule)
+        {
+            rule = node->rule;
+            ruleConfig = i;
+            acceptTags = tagKey;
+        }
+        if (node->acceptString && !(node->anchor & ANCHOR_LINE_END) && node->rule < fallback)
+        {
+            fallback = node->rule;
+            fallbackConfig = i;
+            fallbackTags = tagKey;
+        }
+        tagKey += TagCount(builder, key[1 + i]);
+    }
+    if (fallback == rule)
+    {
+        fallback = LEX_NO_RULE;
+    }
+    vec_push(&builder->accept, rule);
+    vec_push(&builder->fallback, fallback);
+    vec_push(&builder->finalOffset, builder->finals.length);
+    if (rule != LEX_NO_RULE)
+    {
+        PushFinals(builder, key[1 + ruleConfig], acceptTags);
+    }
+    if (fallback != LEX_NO_RULE)
+    {
+        PushFinals(builder, key[1 + fallbackConfig], fallbackTags);
+    }
+    return state;
+}
+
+static void PushFinals(tdfa_builder_t *builder, size_t node, const size_t *tags)
+{
+    for (size_t t = 0; t < TagCount(builder, node); ++t)
+    {
+        vec_push(&builder->finals, tags[t] == SIZE_MAX ? TDFA_UNSET : tags[t]);
+    }
+}
+
+static void DecodeState(const tdfa_builder_t *builder, uint32_t state, vec_tdfa_config_t *configs)
+{
+    const size_t *key = builder->stateList.data[state]->key;
+    const size_t *tagKey = key + 1 + key[0];
+    vec_clear(configs);
+    for (size_t i = 0; i < key[0]; ++i)
+    {
+        size_t count = TagCount(builder, key[1 + i]);
+        uint32_t *tags = NULL;
+        if (count > 0)
+        {
+            tags = GC_malloc_atomic(count * sizeof(uint32_t));
+            for (size_t t = 0; t < count; ++t)
+            {
+                tags[t] = tagKey[t] == SIZE_MAX ? TDFA_UNSET : tagKey[t];
+            }
+        }
+        tdfa_config_t config = {.node = key[1 + i], .tags = tags};
+        vec_push(configs, config);
+        tagKey += count;
+    }
+}
+
+static void RunOps(const tagged_dfa_t *dfa, const tdfa_transition_t *transition, size_t position,
+                   size_t **current, size_t **next)
+{
+    const tdfa_op_t *op = dfa->ops + transition->opOffset;
+    for (uint32_t i = 0; i < transition->opCount; ++i, ++op)
+    {
+        (*next)[op->target] = op->source == TDFA_POSITION ? position : (*current)[op->source];
+    }
+    size_t *swap = *current;
+    *current = *next;
+    *next = swap;
+}
+
+static void RecordGroups(const tagged_dfa_t *dfa, const uint32_t *finals, uint32_t rule,
+                         const size_t *registers, size_t *offsets, size_t offsetCount)
+{
+    size_t tags = 2 * (size_t)dfa->ruleGroups[rule];
+    for (size_t t = 0; t < tags && t + 2 < offsetCount; ++t)
+    {
+        offsets[t + 2] = finals[t] == TDFA_UNSET ? LEX_NO_OFFSET : registers[finals[t]];
+    }
+}
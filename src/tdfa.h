@@ -0,0 +1,74 @@
+#ifndef LEX_TDFA_H
+#define LEX_TDFA_H
+
+#include "lex.h"
+#include "nfa.h"
+#include "stats.h"
+#include "tables.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// An op whose source is TDFA_POSITION stores the offset just reached rather
+// than copying a register; a final register of TDFA_UNSET marks a group that
+// took no part in the match.
+#define TDFA_POSITION (UINT32_MAX - 1)
+#define TDFA_UNSET UINT32_MAX
+
+typedef struct
+{
+    uint32_t target;
+    uint32_t source;
+} tdfa_op_t;
+
+// A transition with no ops leaves every register where it is. Otherwise its
+// ops fill all of the target state's registers from the current state's at
+// once, so they never overwrite a register another op still reads.
+typedef struct
+{
+    uint32_t state;
+    uint32_t opOffset;
+    uint32_t opCount;
+} tdfa_transition_t;
+
+// Laurikari's tagged DFA: a DFA whose transitions also record where capture
+// groups open and close, in registers that each state numbers for itself.
+// State 0 is dead and transitions are indexed by state and byte class as in
+// dfa_tables_t. entries[2c] leads into start condition c's first state mid-
+// line and entries[2c + 1] at the start of a line, and their ops run before
+// the first byte. A state accepting
+// rule r finds its tag t in register finals[finalOffset[state] + t]; past
+// the group tags, a TRAIL_VARIABLE rule has one more for where r ended. As in
+// dfa_tables_t, a state whose rule ends in $ accepts fallback[state] when the
+// next byte does not end a line, and that rule's tags follow the first's.
+typedef struct
+{
+    uint32_t stateCount;
+    uint32_t classCount;
+    uint32_t conditionCount;
+    uint32_t ruleCount;
+    uint32_t maxRegisters;
+    uint8_t classMap[LEX_BYTE_COUNT];
+    const tdfa_transition_t *entries;
+    const tdfa_transition_t *transitions;
+    const uint32_t *accept;
+    const uint32_t *fallback;
+    const uint32_t *finalOffset;
+    const uint32_t *finals;
+    const tdfa_op_t *ops;
+    const uint32_t *ruleGroups;
+    const nfa_node_t *const *ruleEnds;
+} tagged_dfa_t;
+
+// Builds the tagged DFA of a Thompson NFA. Returns NULL, with the number of
+// states built in *states, once the DFA passes either limit of a non-NULL
+// budget.
+tagged_dfa_t *ConstructTaggedDfa(const nfa_t *nfa, const dfa_budget_t *budget, size_t *states,
+                                 lex_stats_t *stats);
+
+// Same contract as ScanToken, and also fills offsets as LexScanCaptures
+// describes; offsets may be NULL when offsetCount is 0.
+bool ScanTaggedToken(const tagged_dfa_t *dfa, uint32_t condition, const unsigned char *input,
+                     size_t length, bool atLineStart, lex_match_t *match, size_t *offsets,
+                     size_t offsetCount);
+
+#endif // LEX_TDFA_H
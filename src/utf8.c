@@ -0,0 +1,430 @@
+#include "utf8.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define uthash_malloc(sz) GC_malloc(sz)
+#define uthash_free(ptr, sz)
+#include <uthash.h>
+
+#define SURROGATE_FIRST 0xD800
+#define SURROGATE_LAST 0xDFFF
+
+typedef struct UTF8_TRIE_NODE utf8_trie_node_t;
+
+typedef struct
+{
+    unsigned char first;
+    unsigned char last;
+    utf8_trie_node_t *child;
+} utf8_trie_edge_t;
+
+typedef vec_t(utf8_trie_edge_t) vec_utf8_trie_edge_t;
+
+struct UTF8_TRIE_NODE
+{
+    vec_utf8_trie_edge_t edges;
+};
+
+typedef struct
+{
+    size_t *key;
+    size_t state;
+    UT_hash_handle hh;
+} utf8_state_entry_t;
+
+static int CompareRanges(const void *a, const void *b);
+static bool NamesMatch(const char *name, const char *query, size_t length);
+static void AddCategoryGroup(vec_code_point_range_t *ranges, char group);
+static void AddUnassigned(vec_code_point_range_t *ranges);
+static void SplitRange(utf8_trie_node_t *root, uint32_t first, uint32_t last);
+static void InsertSequence(utf8_trie_node_t *root, const unsigned char *first,
+                           const unsigned char *last, size_t length);
+static size_t MergeSuffixes(utf8_automaton_t *automaton, utf8_state_entry_t **registry,
+                            utf8_trie_node_t *node);
+
+void NormalizeCodePointRanges(vec_code_point_range_t *ranges)
+{
+    if (ranges->length == 0)
+    {
+        return;
+    }
+    qsort(ranges->data, ranges->length, sizeof(code_point_range_t), CompareRanges);
+    vec_code_point_range_t merged;
+    vec_init(&merged);
+    code_point_range_t current = ranges->data[0];
+    for (int i = 1; i <= ranges->length; ++i)
+    {
+        if (i < ranges->length && ranges->data[i].first <= current.last + 1)
+        {
+            if (ranges->data[i].last > current.last)
+            {
+                current.last = ranges->data[i].last;
+            }
+            continue;
+        }
+        if (current.last > UNICODE_MAX_CODE_POINT)
+        {
+            current.last = UNICODE_MAX_CODE_POINT;
+        }
+        if (current.first <= SURROGATE_LAST && current.last >= SURROGATE_FIRST)
+        {
+            code_point_range_t after = {SURROGATE_LAST + 1, current.last};
+            if (current.first < SURROGATE_FIRST)
+            {
+                current.last = SURROGATE_FIRST - 1;
+                vec_push(&merged, current);
+            }
+            current = after;
+        }
+        if (current.first <= current.last && current.first <= UNICODE_MAX_CODE_POINT)
+        {
+            vec_push(&merged, current);
+        }
+        if (i < ranges->length)
+        {
+            current = ranges->data[i];
+        }
+    }
+    vec_deinit(ranges);
+    *ranges = merged;
+}
+
+void NegateCodePointRanges(vec_code_point_range_t *ranges)
+{
+    vec_code_point_range_t negated;
+    vec_init(&negated);
+    uint32_t next = 0;
+    code_point_range_t range;
+    int i;
+    vec_foreach(ranges, range, i)
+    {
+        if (range.first > next)
+        {
+            code_point_range_t gap = {next, range.first - 1};
+            vec_push(&negated, gap);
+        }
+        next = range.last + 1;
+    }
+    if (next <= UNICODE_MAX_CODE_POINT)
+    {
+        code_point_range_t rest = {next, UNICODE_MAX_CODE_POINT};
+        vec_push(&negated, rest);
+    }
+    vec_deinit(ranges);
+    *ranges = negated;
+    NormalizeCodePointRanges(ranges);
+}
+
+bool AddUnicodeCategory(vec_code_point_range_t *ranges, const char *name, size_t length)
+{
+    static const char *const groups[][2] = {
+        {"L", "Letter"}, {"M", "Mark"},      {"N", "Number"}, {"P", "Punctuation"},
+        {"S", "Symbol"}, {"Z", "Separator"}, {"C", "Other"},
+    };
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i)
+    {
+        if (NamesMatch(groups[i][0], name, length) || NamesMatch(groups[i][1], name, length))
+        {
+            AddCategoryGroup(ranges, groups[i][0][0]);
+            if (groups[i][0][0] == 'C')
+            {
+                AddUnassigned(ranges);
+            }
+            return true;
+        }
+    }
+    if (NamesMatch("LC", name, length) || NamesMatch("Cased_Letter", name, length))
+    {
+        return AddUnicodeCategory(ranges, "Lu", 2) && AddUnicodeCategory(ranges, "Ll", 2) &&
+               AddUnicodeCategory(ranges, "Lt", 2);
+    }
+    if (NamesMatch("Cn", name, length) || NamesMatch("Unassigned", name, length))
+    {
+        AddUnassigned(ranges);
+        return true;
+    }
+    for (size_t i = 0; i < kUnicodeCategoryCount; ++i)
+    {
+        const unicode_category_t *category = &kUnicodeCategories[i];
+        if (NamesMatch(category->name, name, length) ||
+            NamesMatch(category->longName, name, length))
+        {
+            vec_pusharr(ranges, category->ranges, category->count);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t EncodeUtf8(uint32_t codePoint, unsigned char *out)
+{
+    if (codePoint < 0x80)
+    {
+        out[0] = codePoint;
+        return 1;
+    }
+    if (codePoint < 0x800)
+    {
+        out[0] = 0xC0 | (codePoint >> 6);
+        out[1] = 0x80 | (codePoint & 0x3F);
+        return 2;
+    }
+    if (codePoint < 0x10000)
+    {
+        out[0] = 0xE0 | (codePoint >> 12);
+        out[1] = 0x80 | ((codePoint >> 6) & 0x3F);
+        out[2] = 0x80 | (codePoint & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (codePoint >> 18);
+    out[1] = 0x80 | ((codePoint >> 12) & 0x3F);
+    out[2] = 0x80 | ((codePoint >> 6) & 0x3F);
+    out[3] = 0x80 | (codePoint & 0x3F);
+    return 4;
+}
+
+bool DecodeUtf8(const char **text, uint32_t *codePoint)
+{
+    const unsigned char *p = (const unsigned char *)*text;
+    size_t length;
+    uint32_t minimum;
+    if (p[0] < 0x80)
+    {
+        *codePoint = p[0];
+        ++*text;
+        return true;
+    }
+    else if (p[0] >= 0xC2 && p[0] <= 0xDF)
+    {
+        length = 2;
+        minimum = 0x80;
+        *codePoint = p[0] & 0x1F;
+    }
+    else if (p[0] >= 0xE0 && p[0] <= 0xEF)
+    {
+        length = 3;
+        minimum = 0x800;
+        *codePoint = p[0] & 0x0F;
+    }
+    else if (p[0] >= 0xF0 && p[0] <= 0xF4)
+    {
+        length = 4;
+        minimum = 0x10000;
+        *codePoint = p[0] & 0x07;
+    }
+    else
+    {
+        return false;
+    }
+
+    for (size_t i = 1; i < length; ++i)
+    {
+        if ((p[i] & 0xC0) != 0x80)
+        {
+            return false;
+        }
+        *codePoint = (*codePoint << 6) | (p[i] & 0x3F);
+    }
+    if (*codePoint < minimum || *codePoint > UNICODE_MAX_CODE_POINT ||
+        (*codePoint >= SURROGATE_FIRST && *codePoint <= SURROGATE_LAST))
+    {
+        return false;
+    }
+    *text += length;
+    return true;
+}
+
+utf8_automaton_t *CompileUtf8Ranges(const vec_code_point_range_t *ranges)
+{
+    utf8_trie_node_t *root = GC_malloc(sizeof(utf8_trie_node_t));
+    vec_init(&root->edges);
+    code_point_range_t range;
+    int i;
+    vec_foreach(ranges, range, i)
+    {
+        SplitRange(root, range.first, range.last);
+    }
+
+    utf8_automaton_t *automaton = GC_malloc(sizeof(utf8_automaton_t));
+    vec_init(&automaton->states);
+    vec_utf8_transition_t final;
+    vec_init(&final);
+    automaton->final = automaton->states.length;
+    vec_push(&automaton->states, final);
+    utf8_state_entry_t *registry = NULL;
+    automaton->start = MergeSuffixes(automaton, &registry, root);
+    return automaton;
+}
+
+static int CompareRanges(const void *a, const void *b)
+{
+    uint32_t first = ((const code_point_range_t *)a)->first;
+    uint32_t second = ((const code_point_range_t *)b)->first;
+    return first < second ? -1 : first > second;
+}
+
+static bool NamesMatch(const char *name, const char *query, size_t length)
+{
+    const char *end = query + length;
+    for (;;)
+    {
+        while (*name == '_')
+        {
+            ++name;
+        }
+        while (query < end && (*query == '_' || *query == ' ' || *query == '-'))
+        {
+            ++query;
+        }
+        if (!*name || query == end)
+        {
+            return !*name && query == end;
+        }
+        if (tolower((unsigned char)*name++) != tolower((unsigned char)*query++))
+        {
+            return false;
+        }
+    }
+}
+
+static void AddCategoryGroup(vec_code_point_range_t *ranges, char group)
+{
+    for (size_t i = 0; i < kUnicodeCategoryCount; ++i)
+    {
+        const unicode_category_t *category = &kUnicodeCategories[i];
+        if (category->name[0] == group)
+        {
+            vec_pusharr(ranges, category->ranges, category->count);
+        }
+    }
+}
+
+static void AddUnassigned(vec_code_point_range_t *ranges)
+{
+    vec_code_point_range_t assigned;
+    vec_init(&assigned);
+    for (size_t i = 0; i < kUnicodeCategoryCount; ++i)
+    {
+        vec_pusharr(&assigned, kUnicodeCategories[i].ranges, kUnicodeCategories[i].count);
+    }
+    NormalizeCodePointRanges(&assigned);
+    NegateCodePointRanges(&assigned);
+    vec_extend(ranges, &assigned);
+    vec_deinit(&assigned);
+}
+
+// Splits a range until every piece encodes as one sequence of byte ranges,
+// following the boundaries where the encoded length or a continuation byte
+// changes.
+static void SplitRange(utf8_trie_node_t *root, uint32_t first, uint32_t last)
+{
+    static const uint32_t lengthLimits[] = {0x7F, 0x7FF, 0xFFFF};
+    if (first > last)
+    {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(lengthLimits) / sizeof(lengthLimits[0]); ++i)
+    {
+        if (first <= lengthLimits[i] && lengthLimits[i] < last)
+        {
+            SplitRange(root, first, lengthLimits[i]);
+            SplitRange(root, lengthLimits[i] + 1, last);
+            return;
+        }
+    }
+    if (last >= 0x80)
+    {
+        for (int i = 1; i < 4; ++i)
+        {
+            uint32_t mask = (1u << (6 * i)) - 1;
+            if ((first & ~mask) == (last & ~mask))
+            {
+                continue;
+            }
+            if ((first & mask) != 0)
+            {
+                SplitRange(root, first, first | mask);
+                SplitRange(root, (first | mask) + 1, last);
+                return;
+            }
+            if ((last & mask) != mask)
+            {
+                SplitRange(root, first, (last & ~mask) - 1);
+                SplitRange(root, last & ~mask, last);
+                return;
+            }
+        }
+    }
+
+    unsigned char firstBytes[4];
+    unsigned char lastBytes[4];
+    size_t length = EncodeUtf8(first, firstBytes);
+    EncodeUtf8(last, lastBytes);
+    InsertSequence(root, firstBytes, lastBytes, length);
+}
+
+// Sequences arrive in code point order, which is also byte order, so a shared
+// prefix can only ever match the most recently added edge.
+static void InsertSequence(utf8_trie_node_t *root, const unsigned char *first,
+                           const unsigned char *last, size_t length)
+{
+    utf8_trie_node_t *node = root;
+    for (size_t i = 0; i < length; ++i)
+    {
+        vec_utf8_trie_edge_t *edges = &node->edges;
+        if (edges->length > 0 && vec_last(edges).first == first[i] &&
+            vec_last(edges).last == last[i])
+        {
+            node = vec_last(edges).child;
+            continue;
+        }
+        utf8_trie_edge_t edge = {first[i], last[i], GC_malloc(sizeof(utf8_trie_node_t))};
+        vec_init(&edge.child->edges);
+        vec_push(edges, edge);
+        node = edge.child;
+    }
+}
+
+// Numbers trie nodes bottom up, giving nodes with identical outgoing edges the
+// same state; leaves all become the final state.
+static size_t MergeSuffixes(utf8_automaton_t *automaton, utf8_state_entry_t **registry,
+                            utf8_trie_node_t *node)
+{
+    if (node->edges.length == 0)
+    {
+        return automaton->final;
+    }
+
+    size_t keyLength = node->edges.length * 3;
+    size_t *key = GC_malloc_atomic(keyLength * sizeof(size_t));
+    utf8_trie_edge_t edge;
+    int i;
+    vec_foreach(&node->edges, edge, i)
+    {
+        key[i * 3] = edge.first;
+        key[i * 3 + 1] = edge.last;
+        key[i * 3 + 2] = MergeSuffixes(automaton, registry, edge.child);
+    }
+
+    utf8_state_entry_t *entry;
+    HASH_FIND(hh, *registry, key, keyLength * sizeof(size_t), entry);
+    if (entry)
+    {
+        return entry->state;
+    }
+
+    vec_utf8_transition_t transitions;
+    vec_init(&transitions);
+    for (size_t j = 0; j < keyLength; j += 3)
+    {
+        utf8_transition_t transition = {key[j], key[j + 1], key[j + 2]};
+        vec_push(&transitions, transition);
+    }
+    entry = GC_malloc(sizeof(utf8_state_entry_t));
+    entry->key = key;
+    entry->state = automaton->states.length;
+    vec_push(&automaton->states, transitions);
+    HASH_ADD_KEYPTR(hh, *registry, entry->key, keyLength * sizeof(size_t), entry);
+    return entry->state;
+}
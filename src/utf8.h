@@ -0,0 +1,68 @@
+#ifndef LEX_UTF8_H
+#define LEX_UTF8_H
+
+#include <gc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vec.h>
+
+#define UNICODE_MAX_CODE_POINT 0x10FFFF
+
+typedef struct
+{
+    uint32_t first;
+    uint32_t last;
+} code_point_range_t;
+
+typedef vec_t(code_point_range_t) vec_code_point_range_t;
+
+typedef struct
+{
+    const char *name;
+    const char *longName;
+    const code_point_range_t *ranges;
+    size_t count;
+} unicode_category_t;
+
+extern const unicode_category_t kUnicodeCategories[];
+extern const size_t kUnicodeCategoryCount;
+
+// Sorts and merges the ranges and removes the surrogate block, which has no
+// UTF-8 encoding.
+void NormalizeCodePointRanges(vec_code_point_range_t *ranges);
+// Replaces normalized ranges with every other scalar value.
+void NegateCodePointRanges(vec_code_point_range_t *ranges);
+// Appends the ranges of a general category by short or long name, matched
+// loosely (`Lu`, `uppercase letter`). One-letter names cover the whole group,
+// `LC` is the cased letters and `Cn` is everything unassigned.
+bool AddUnicodeCategory(vec_code_point_range_t *ranges, const char *name, size_t length);
+
+size_t EncodeUtf8(uint32_t codePoint, unsigned char *out);
+// Decodes one well-formed sequence and advances *text past it.
+bool DecodeUtf8(const char **text, uint32_t *codePoint);
+
+// An acyclic byte automaton accepting exactly the UTF-8 encodings of a set of
+// code points. Shared prefixes and shared suffixes are merged, so it is the
+// minimal such automaton over byte ranges. States are numbered so every
+// transition targets a lower number; `final` has no transitions.
+typedef struct
+{
+    unsigned char first;
+    unsigned char last;
+    size_t target;
+} utf8_transition_t;
+
+typedef vec_t(utf8_transition_t) vec_utf8_transition_t;
+typedef vec_t(vec_utf8_transition_t) vec_utf8_state_t;
+
+typedef struct
+{
+    vec_utf8_state_t states;
+    size_t start;
+    size_t final;
+} utf8_automaton_t;
+
+utf8_automaton_t *CompileUtf8Ranges(const vec_code_point_range_t *ranges);
+
+#endif // LEX_UTF8_H
@@ -0,0 +1,53 @@
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+file(READ ${SPEC} text)
+file(WRITE ${WORK}/spec.l "${text}")
+
+# Compiles spec.l with the given options to OUTPUT and checks the counts
+# --cache-stats reports afterwards.
+function(expect_cache hits misses output)
+  execute_process(COMMAND ${LEX} --cache-dir ${WORK}/cache --cache-stats -o
+                          ${WORK}/${output} ${ARGN} ${WORK}/spec.l
+                  ERROR_VARIABLE stats RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "lex failed: ${stats}")
+  endif()
+  if(NOT stats MATCHES ": ${hits} hits, ${misses} misses")
+    message(FATAL_ERROR "expected ${hits} hits and ${misses} misses: ${stats}")
+  endif()
+endfunction()
+
+function(expect_same first second)
+  execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/${first}
+                          ${WORK}/${second} RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${second} differs from ${first}")
+  endif()
+endfunction()
+
+expect_cache(0 1 compiled.lexb)
+expect_cache(1 1 cached.lexb)
+expect_same(compiled.lexb cached.lexb)
+
+expect_cache(1 2 compiled.c -t c)
+expect_cache(2 2 cached.c -t c)
+expect_same(compiled.c cached.c)
+
+expect_cache(2 3 glushkov.lexb --nfa glushkov)
+expect_cache(2 4 error-rules.lexb --error-rules)
+
+# The DFA is over this budget, so the cached image must not stand in for it;
+# the lookup still counts a miss.
+execute_process(COMMAND ${LEX} --cache-dir ${WORK}/cache -o ${WORK}/budget.lexb
+                        --max-states 2 ${WORK}/spec.l
+                RESULT_VARIABLE result ERROR_QUIET)
+if(result EQUAL 0)
+  message(FATAL_ERROR "an image over --max-states came out of the cache")
+endif()
+expect_cache(2 6 budget.lexb --max-states 100000)
+
+file(WRITE ${WORK}/spec.l "${text}\n/* changed */\n")
+expect_cache(2 7 changed.c -t c)
+string(REPLACE "if|else|while" "if|else|while|for" changed "${text}")
+file(WRITE ${WORK}/spec.l "${changed}")
+expect_cache(2 8 changed.lexb)
@@ -0,0 +1,208 @@
+// Tokenizes an input with every engine a spec compiles to, and with the DFA
+// scanner saved to an image and loaded back, and fails unless all of them
+// split the input into the same tokens. An action of the form BEGIN(NAME)
+// switches to that start condition, as it would in generated C.
+//
+// usage: engines SPEC INPUT IMAGE
+
+#include "lex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    const char *name;
+    lex_engine_t engine;
+    lex_nfa_construction_t construction;
+    bool captures;
+} engine_config_t;
+
+typedef struct
+{
+    size_t offset;
+    size_t length;
+    uint32_t rule;
+    uint32_t condition;
+} token_t;
+
+static const engine_config_t kConfigs[] = {
+    {"dfa", LEX_ENGINE_DFA, LEX_NFA_THOMPSON, false},
+    {"dfa (glushkov)", LEX_ENGINE_DFA, LEX_NFA_GLUSHKOV, false},
+    {"nfa", LEX_ENGINE_NFA, LEX_NFA_THOMPSON, false},
+    {"nfa (glushkov)", LEX_ENGINE_NFA, LEX_NFA_GLUSHKOV, false},
+    {"shift-and", LEX_ENGINE_SHIFT_AND, LEX_NFA_THOMPSON, false},
+    {"tagged dfa", LEX_ENGINE_DFA, LEX_NFA_THOMPSON, true},
+};
+
+static char *ReadFile(const char *path, size_t *length);
+static token_t *Tokenize(const lex_scanner_t *scanner, const char *input, size_t length,
+                         size_t *count);
+static bool SameTokens(const char *name, const token_t *expected, size_t expectedCount,
+                       const token_t *actual, size_t actualCount);
+
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "usage: engines SPEC INPUT IMAGE\n");
+        return 2;
+    }
+    size_t specLength;
+    size_t inputLength;
+    char *spec = ReadFile(argv[1], &specLength);
+    char *input = ReadFile(argv[2], &inputLength);
+    if (!spec || !input)
+    {
+        return 1;
+    }
+
+    bool passed = true;
+    token_t *expected = NULL;
+    size_t expectedCount = 0;
+    for (size_t i = 0; i < sizeof(kConfigs) / sizeof(kConfigs[0]); ++i)
+    {
+        lex_context_t *context = LexCreateContext();
+        LexSetEngine(context, kConfigs[i].engine);
+        LexSetNfaConstruction(context, kConfigs[i].construction);
+        LexSetCaptures(context, kConfigs[i].captures);
+        lex_scanner_t *scanner = LexCompile(context, spec, specLength);
+        if (!scanner)
+        {
+            fprintf(stderr, "%s: %s: %s\n", argv[1], kConfigs[i].name,
+                    LexGetError(context)->message);
+            LexDestroyContext(context);
+            return 1;
+        }
+        size_t count;
+        token_t *tokens = Tokenize(scanner, input, inputLength, &count);
+        if (!expected)
+        {
+            expected = tokens;
+            expectedCount = count;
+            if (!LexSaveImage(context, scanner, argv[3]))
+            {
+                fprintf(stderr, "%s: %s\n", argv[3], LexGetError(context)->message);
+                passed = false;
+            }
+        }
+        else
+        {
+            passed &= SameTokens(kConfigs[i].name, expected, expectedCount, tokens, count);
+            free(tokens);
+        }
+        LexDestroyScanner(scanner);
+        LexDestroyContext(context);
+    }
+
+    lex_context_t *context = LexCreateContext();
+    lex_scanner_t *loaded = passed ? LexLoadImage(context, argv[3]) : NULL;
+    if (loaded)
+    {
+        size_t count;
+        token_t *tokens = Tokenize(loaded, input, inputLength, &count);
+        passed &= SameTokens("image", expected, expectedCount, tokens, count);
+        free(tokens);
+        LexDestroyScanner(loaded);
+    }
+    else if (passed)
+    {
+        fprintf(stderr, "%s: %s\n", argv[3], LexGetError(context)->message);
+        passed = false;
+    }
+    LexDestroyContext(context);
+
+    free(expected);
+    free(spec);
+    free(input);
+    return passed ? 0 : 1;
+}
+
+static char *ReadFile(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "cannot read '%s'\n", path);
+        return NULL;
+    }
+    size_t capacity = 4096;
+    char *text = malloc(capacity);
+    *length = 0;
+    size_t n;
+    while ((n = fread(text + *length, 1, capacity - *length, file)) > 0)
+    {
+        *length += n;
+        if (*length == capacity)
+        {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    fclose(file);
+    return text;
+}
+
+// Bytes no rule matches become one-byte tokens of rule LEX_NO_RULE.
+static token_t *Tokenize(const lex_scanner_t *scanner, const char *input, size_t length,
+                         size_t *count)
+{
+    token_t *tokens = malloc((length + 1) * sizeof(token_t));
+    *count = 0;
+    uint32_t condition = 0;
+    bool atLineStart = true;
+    for (size_t offset = 0; offset < length;)
+    {
+        lex_match_t match;
+        if (!LexScanIn(scanner, condition, (const unsigned char *)input + offset,
+                       length - offset, atLineStart, &match, NULL, 0) ||
+            match.length == 0)
+        {
+            match = (lex_match_t){.length = 1, .rule = LEX_NO_RULE};
+        }
+        tokens[(*count)++] = (token_t){offset, match.length, match.rule, condition};
+
+        size_t actionLength = 0;
+        const char *action =
+            match.rule == LEX_NO_RULE ? NULL : LexRuleAction(scanner, match.rule, &actionLength);
+        // Actions need not be NUL-terminated.
+        char text[256];
+        snprintf(text, sizeof(text), "%.*s", (int)actionLength, action ? action : "");
+        const char *begin = strstr(text, "BEGIN(");
+        if (begin)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "%.*s", (int)strcspn(begin + 6, ")"), begin + 6);
+            condition = LexFindCondition(scanner, name);
+        }
+        atLineStart = input[offset + match.length - 1] == '\n';
+        offset += match.length;
+    }
+    return tokens;
+}
+
+static bool SameTokens(const char *name, const token_t *expected, size_t expectedCount,
+                       const token_t *actual, size_t actualCount)
+{
+    for (size_t i = 0; i < expectedCount && i < actualCount; ++i)
+    {
+        const token_t *e = &expected[i];
+        const token_t *a = &actual[i];
+        if (e->offset != a->offset || e->length != a->length || e->rule != a->rule ||
+            e->condition != a->condition)
+        {
+            fprintf(stderr,
+                    "%s: token %zu at offset %zu is rule %u, length %zu in condition %u; "
+                    "dfa found rule %u, length %zu in condition %u\n",
+                    name, i, a->offset, a->rule, a->length, a->condition, e->rule, e->length,
+                    e->condition);
+            return false;
+        }
+    }
+    if (expectedCount != actualCount)
+    {
+        fprintf(stderr, "%s: %zu tokens; dfa found %zu\n", name, actualCount, expectedCount);
+        return false;
+    }
+    return true;
+}
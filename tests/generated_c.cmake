@@ -0,0 +1,22 @@
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+execute_process(COMMAND ${LEX} --no-cache -o ${WORK}/tokens.lexb ${SPEC}
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "lex failed on ${SPEC}")
+endif()
+execute_process(COMMAND ${LEX} -r ${WORK}/tokens.lexb ${INPUT}
+                OUTPUT_FILE ${WORK}/image.out RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "lex -r failed on ${INPUT}")
+endif()
+execute_process(COMMAND ${GENERATED} INPUT_FILE ${INPUT}
+                OUTPUT_FILE ${WORK}/generated.out RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "the generated scanner failed on ${INPUT}")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/image.out
+                        ${WORK}/generated.out RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${WORK}/generated.out differs from ${WORK}/image.out")
+endif()
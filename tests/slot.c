@@ -0,0 +1,116 @@
+// Scans from several threads while several others compile scanners and
+// publish them to the same slot, and fails if a reader ever sees a scanner
+// that does not behave like one of the two that are published.
+
+#include "lex.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+enum
+{
+    kReaders = 4,
+    kPublishers = 2,
+    kPublishes = 200,
+};
+
+// The two specs match the input's first token with different rules, so a
+// reader can tell which one it holds.
+static const char *const kSpecs[] = {
+    "%%\n[a-z]+ letters\n[0-9]+ digits\n",
+    "%%\n[0-9]+ digits\n[a-z]+ letters\n",
+};
+static const unsigned char kInput[] = "abc123";
+
+static atomic_bool sPublishing = true;
+static atomic_int sFailures = 0;
+
+static lex_scanner_t *CompileSpec(const char *spec);
+static void *Read(void *argument);
+static void *Publish(void *argument);
+
+int main(void)
+{
+    lex_slot_t *slot = LexCreateSlot(CompileSpec(kSpecs[0]));
+    pthread_t readers[kReaders];
+    pthread_t publishers[kPublishers];
+    for (int i = 0; i < kReaders; ++i)
+    {
+        pthread_create(&readers[i], NULL, Read, slot);
+    }
+    for (int i = 0; i < kPublishers; ++i)
+    {
+        pthread_create(&publishers[i], NULL, Publish, slot);
+    }
+    for (int i = 0; i < kPublishers; ++i)
+    {
+        pthread_join(publishers[i], NULL);
+    }
+    atomic_store(&sPublishing, false);
+    for (int i = 0; i < kReaders; ++i)
+    {
+        pthread_join(readers[i], NULL);
+    }
+
+    size_t pending = LexReclaimScanners(slot);
+    if (pending != 0)
+    {
+        fprintf(stderr, "%zu scanners still retired with no reader active\n", pending);
+        atomic_fetch_add(&sFailures, 1);
+    }
+    LexDestroySlot(slot);
+    return atomic_load(&sFailures) == 0 ? 0 : 1;
+}
+
+static lex_scanner_t *CompileSpec(const char *spec)
+{
+    lex_context_t *context = LexCreateContext();
+    lex_scanner_t *scanner = LexCompile(context, spec, strlen(spec));
+    if (!scanner)
+    {
+        fprintf(stderr, "%s\n", LexGetError(context)->message);
+    }
+    LexDestroyContext(context);
+    return scanner;
+}
+
+static void *Read(void *argument)
+{
+    lex_reader_t *reader = LexAttachReader(argument);
+    while (atomic_load(&sPublishing))
+    {
+        const lex_scanner_t *scanner = LexAcquireScanner(reader);
+        for (int i = 0; i < 100; ++i)
+        {
+            lex_match_t match;
+            size_t length;
+            if (!LexScan(scanner, kInput, sizeof(kInput) - 1, true, &match) || match.length != 3 ||
+                match.rule > 1 || LexRuleCount(scanner) != 2 ||
+                strncmp(LexRuleAction(scanner, match.rule, &length), "letters", 7) != 0)
+            {
+                fprintf(stderr, "a reader saw a scanner that was not published\n");
+                atomic_fetch_add(&sFailures, 1);
+                break;
+            }
+        }
+        LexReleaseScanner(reader);
+    }
+    LexDetachReader(reader);
+    return NULL;
+}
+
+static void *Publish(void *argument)
+{
+    for (int i = 0; i < kPublishes; ++i)
+    {
+        lex_scanner_t *scanner = CompileSpec(kSpecs[i % 2]);
+        if (!scanner)
+        {
+            atomic_fetch_add(&sFailures, 1);
+            break;
+        }
+        LexPublishScanner(argument, scanner);
+    }
+    return NULL;
+}